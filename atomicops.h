@@ -17,7 +17,9 @@
 #include <cerrno>
 #include <cstdint>
 #include <ctime>
+#include <cstdlib> // For malloc_allocator
 #include <iostream>
+#include <memory> // For std::allocator_traits
 
 // Platform detection
 #if defined(__INTEL_COMPILER)
@@ -40,6 +42,13 @@
 #define AE_ARCH_UNKNOWN
 #endif
 
+// AE_WAITPKG: UMONITOR/UMWAIT can be issued (x86, GCC-style inline assembly). Whether the
+// CPU actually supports them is only known at run time (see spsc_sema::LowPowerWait).
+#if (defined(AE_ARCH_X64) || defined(AE_ARCH_X86)) && defined(__GNUC__) && !defined(MOODYCAMEL_NO_WAITPKG)
+#define AE_WAITPKG
+#include <cpuid.h>
+#endif
+
 // AE_UNUSED
 #define AE_UNUSED(x) ((void)x)
 
@@ -88,6 +97,40 @@ extern "C" void AnnotateHappensAfter(const char *, int, void *);
 #define AE_ALIGN(x) __attribute__((aligned(x)))
 #endif
 
+// MOODYCAMEL_CACHE_LINE_SIZE
+// The distance (in bytes) the queues keep between variables written by the producer and
+// variables written by the consumer, to avoid false sharing. Define it before including
+// the queue headers to override the default, e.g. as 128 on Intel CPUs where the adjacent-line
+// prefetcher makes pairs of 64-byte lines the effective unit of false sharing. The default is
+// 128 on Apple Silicon and 64 otherwise. The value is part of the queues' layout, so all code
+// sharing a queue must be compiled with the same one; that's also why the default is fixed
+// rather than std::hardware_destructive_interference_size, which changes with -mtune.
+#ifndef MOODYCAMEL_CACHE_LINE_SIZE
+#if defined(__APPLE__) && (defined(__aarch64__) || defined(__arm64__))
+#define MOODYCAMEL_CACHE_LINE_SIZE 128
+#else
+#define MOODYCAMEL_CACHE_LINE_SIZE 64
+#endif
+#endif
+
+// MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
+// Aligns the queue classes to MOODYCAMEL_CACHE_LINE_SIZE, so that their padding actually keeps
+// the producer's and the consumer's variables on different cache lines
+#ifndef MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
+#if defined(__APPLE__) && defined(__MACH__) && __cplusplus >= 201703L
+// This is required to find out what deployment target we are using
+#include <CoreFoundation/CoreFoundation.h>
+#if !defined(MAC_OS_X_VERSION_MIN_REQUIRED) || MAC_OS_X_VERSION_MIN_REQUIRED < MAC_OS_X_VERSION_10_14
+// C++17 new(size_t, align_val_t) is not backwards-compatible with older versions of macOS, so we can't support over-alignment in this case
+#define MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
+#endif
+#endif
+#endif
+
+#ifndef MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
+#define MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE AE_ALIGN(MOODYCAMEL_CACHE_LINE_SIZE)
+#endif
+
 // Portable atomic fences implemented below:
 
 namespace moodycamel
@@ -295,6 +338,7 @@ namespace moodycamel
 
 #ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
 #include <atomic>
+#include <chrono> // For spsc_sema::ParkingSpot
 #endif
 #include <utility>
 
@@ -385,8 +429,216 @@ extern "C"
 #include <task.h>
 #endif
 
+// For the queues' pmr aliases (e.g. moodycamel::pmr::ReaderWriterQueue)
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#include <memory_resource>
+#define MOODYCAMEL_HAS_PMR 1
+#endif
+#endif
+
+// For locking a queue's memory into RAM (see prefault_t)
+#if defined(_WIN32)
+// (dwSize is a SIZE_T, i.e. a ULONG_PTR: not the same type as std::size_t on 32-bit Windows)
+extern "C"
+{
+#if defined(_WIN64)
+    __declspec(dllimport) int __stdcall VirtualLock(void *lpAddress, unsigned __int64 dwSize);
+    __declspec(dllimport) int __stdcall VirtualUnlock(void *lpAddress, unsigned __int64 dwSize);
+#else
+    __declspec(dllimport) int __stdcall VirtualLock(void *lpAddress, unsigned long dwSize);
+    __declspec(dllimport) int __stdcall VirtualUnlock(void *lpAddress, unsigned long dwSize);
+#endif
+}
+#elif defined(__unix__) || defined(__MACH__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 namespace moodycamel
 {
+    // Describes how a blocking wait went (see e.g. BlockingReaderWriterQueue::wait_dequeue_outcome).
+    // A wait that is satisfied right away has success set and everything else clear.
+    struct wait_outcome
+    {
+        bool success;            // The wait was satisfied (as opposed to timing out)
+        bool spun;               // ... while spinning, before going to sleep
+        bool slept;              // The thread blocked in the kernel
+        bool woken_by_signal;    // ... and was woken up by the other thread (rather than by the timeout)
+        bool timed_out;          // The timeout expired (success is false)
+        bool closed;             // The queue was closed, and is empty (success is false)
+        int spins;               // Iterations of the spin loop that ran
+        std::int64_t wait_usecs; // Time spent waiting, in microseconds (0 if satisfied right away)
+
+        wait_outcome()
+            : success(false), spun(false), slept(false), woken_by_signal(false), timed_out(false), closed(false), spins(0), wait_usecs(0)
+        {
+        }
+    };
+
+    // Lets the producer of a blocking queue hold off on waking up a consumer that's asleep
+    // waiting for an element until `items` elements are waiting for it, or the first of them
+    // has waited `max_delay_usecs` microseconds, whichever comes first; fewer, later wake-ups
+    // under a trickle of elements, in exchange for latency. Since the producer may go quiet
+    // with elements still waiting, a sleeping consumer also checks the queue on its own every
+    // `max_delay_usecs` (so an idle consumer wakes up that often). A negative max_delay_usecs
+    // means no time limit (and no such checks). The default wakes the consumer right away.
+    struct wake_hysteresis
+    {
+        std::size_t items;
+        std::int64_t max_delay_usecs;
+
+        wake_hysteresis(std::size_t items_ = 1, std::int64_t max_delay_usecs_ = -1)
+            : items(items_), max_delay_usecs(max_delay_usecs_)
+        {
+        }
+    };
+
+    // Pass `prefault` as the last constructor argument of a queue to have it write to every
+    // page of the memory it reserves for elements, so that the OS maps the pages in during
+    // construction rather than on the first pass through them (a page fault each, on the
+    // producer's side). `prefault_and_lock` also locks the queue's memory into RAM (mlock or
+    // VirtualLock), so that it can't be paged out later either; if the OS refuses (e.g. past
+    // RLIMIT_MEMLOCK), the memory is only pre-faulted. Freeing it (destroying the queue, or
+    // shrinking it) unlocks only the pages it has to itself: the first and last page of each
+    // allocation can be shared with memory that is still locked, so they stay locked.
+    struct prefault_t
+    {
+        bool lock;
+    };
+    static const prefault_t prefault = {false};
+    static const prefault_t prefault_and_lock = {true};
+
+    namespace details
+    {
+        // Writes to every page of [memory, memory + size), which must not hold any objects yet
+        inline void prefault_pages(void *memory, std::size_t size) AE_NO_TSAN
+        {
+            const std::size_t pageSize = 4096; // The smallest page size in common use
+            volatile char *bytes = static_cast<volatile char *>(memory);
+            for (std::size_t i = 0; i < size; i += pageSize)
+                bytes[i] = 0;
+            if (size != 0)
+                bytes[size - 1] = 0;
+        }
+
+        // Locks the pages of [memory, memory + size) into RAM. Returns false if the OS refuses.
+        inline bool lock_pages(void *memory, std::size_t size) AE_NO_TSAN
+        {
+#if defined(_WIN32)
+            return VirtualLock(memory, size) != 0;
+#elif defined(__unix__) || defined(__MACH__)
+            return mlock(memory, size) == 0;
+#else
+            AE_UNUSED(memory);
+            AE_UNUSED(size);
+            return false;
+#endif
+        }
+
+        // The granularity of lock_pages and unlock_pages
+        inline std::size_t page_size() AE_NO_TSAN
+        {
+#if defined(__unix__) || defined(__MACH__)
+            static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            return size;
+#else
+            return 4096;
+#endif
+        }
+
+        // Undoes lock_pages, before the memory is freed, for the pages that lie entirely within
+        // [memory, memory + size). The pages at either end may also hold other allocations that
+        // are locked (e.g. neighbouring blocks of the same queue), and the OS doesn't count
+        // locks, so those stay locked; they're unlocked when the process exits, or the heap
+        // gives them back to the OS.
+        inline void unlock_pages(void *memory, std::size_t size) AE_NO_TSAN
+        {
+            std::uintptr_t pageMask = static_cast<std::uintptr_t>(page_size() - 1);
+            std::uintptr_t begin = (reinterpret_cast<std::uintptr_t>(memory) + pageMask) & ~pageMask;
+            std::uintptr_t end = (reinterpret_cast<std::uintptr_t>(memory) + size) & ~pageMask;
+            if (begin >= end)
+                return;
+            memory = reinterpret_cast<void *>(begin);
+            size = static_cast<std::size_t>(end - begin);
+#if defined(_WIN32)
+            VirtualUnlock(memory, size);
+#elif defined(__unix__) || defined(__MACH__)
+            munlock(memory, size);
+#else
+            AE_UNUSED(memory);
+            AE_UNUSED(size);
+#endif
+        }
+    }
+
+    // The queues' default allocator: std::malloc and std::free. Unlike std::allocator, its
+    // allocate() returns nullptr when malloc fails (which the queues check for) rather than
+    // throwing. Queues that use it share the BlockCache.
+    // Any other allocator of chars (e.g. std::pmr::polymorphic_allocator<char>) may be given
+    // to the queues instead; they go through std::allocator_traits.
+    template <typename T>
+    struct malloc_allocator
+    {
+        typedef T value_type;
+        typedef std::true_type propagate_on_container_swap;
+
+        malloc_allocator() {}
+
+        template <typename U>
+        malloc_allocator(malloc_allocator<U> const &)
+        {
+        }
+
+        T *allocate(std::size_t n) AE_NO_TSAN
+        {
+            return static_cast<T *>(std::malloc(n * sizeof(T)));
+        }
+
+        void deallocate(T *memory, std::size_t) AE_NO_TSAN
+        {
+            std::free(memory);
+        }
+    };
+
+    template <typename T, typename U>
+    inline bool operator==(malloc_allocator<T> const &, malloc_allocator<U> const &)
+    {
+        return true;
+    }
+
+    template <typename T, typename U>
+    inline bool operator!=(malloc_allocator<T> const &, malloc_allocator<U> const &)
+    {
+        return false;
+    }
+
+    namespace details
+    {
+        // Swaps the allocators of two queues that are swapping their memory. Allocators that
+        // don't propagate on swap must be equal, as with the standard containers.
+        template <typename Allocator>
+        inline void swap_allocators(Allocator &a, Allocator &b, std::true_type)
+        {
+            using std::swap;
+            swap(a, b);
+        }
+
+        template <typename Allocator>
+        inline void swap_allocators(Allocator &a, Allocator &b, std::false_type)
+        {
+            assert(a == b && "Queues with unequal allocators can't be swapped (or move-assigned)");
+            AE_UNUSED(a);
+            AE_UNUSED(b);
+        }
+
+        template <typename Allocator>
+        inline void swap_allocators(Allocator &a, Allocator &b)
+        {
+            swap_allocators(a, b, typename std::allocator_traits<Allocator>::propagate_on_container_swap());
+        }
+    }
+
     // Code in the spsc_sema namespace below is an adaptation of Jeff Preshing's
     // portable + lightweight semaphore implementations, originally from
     // https://github.com/preshing/cpp11-on-multicore/blob/master/common/sema.h
@@ -663,6 +915,104 @@ namespace moodycamel
 #error Unsupported platform! (No semaphore wrapper available)
 #endif
 
+        //---------------------------------------------------------
+        // LowPowerWait
+        //---------------------------------------------------------
+        // Power-aware spinning: on x86 CPUs with WAITPKG, LightweightSemaphore can spend the
+        // spin phase of a wait in a light sleep (UMWAIT, in C0.1) that ends as soon as the
+        // producer writes the count's cache line (UMONITOR), instead of spinning flat out.
+        // Off by default. enable() only turns it on if the CPU supports it (checked once,
+        // with CPUID); otherwise the semaphores keep using the plain spin loop.
+#ifndef MOODYCAMEL_LOW_POWER_WAIT_CYCLES
+// How long (in TSC ticks) the low-power spin phase lasts before the thread blocks in the kernel
+#define MOODYCAMEL_LOW_POWER_WAIT_CYCLES 100000
+#endif
+        class LowPowerWait
+        {
+        public:
+            // Whether the CPU (and this build) supports UMONITOR/UMWAIT
+            static bool supported() AE_NO_TSAN
+            {
+                static const bool result = detect();
+                return result;
+            }
+
+            static bool enabled() AE_NO_TSAN
+            {
+                return flag().load();
+            }
+
+            // Turns power-aware spinning on or off, for all semaphores. Returns whether it's
+            // on (it stays off where it isn't supported). Thread-safe.
+            static bool enable(bool on) AE_NO_TSAN
+            {
+                on = on && supported();
+                flag() = on;
+                return on;
+            }
+
+            // Arms the monitor on `address`'s cache line
+            static AE_FORCEINLINE void monitor(void const volatile *address) AE_NO_TSAN
+            {
+#ifdef AE_WAITPKG
+                // umonitor %rax (spelled out, for assemblers that predate WAITPKG)
+                __asm__ __volatile__(".byte 0xf3, 0x0f, 0xae, 0xf0" : : "a"(address) : "memory");
+#else
+                AE_UNUSED(address);
+#endif
+            }
+
+            // Sleeps until the monitored cache line is written, or the TSC reaches
+            // `deadline` (or the OS's limit on a single wait expires), whichever comes first
+            static AE_FORCEINLINE void wait(std::uint64_t deadline) AE_NO_TSAN
+            {
+#ifdef AE_WAITPKG
+                // umwait %ecx, with ecx = 1 (C0.1: the lighter sleep, with faster wake-up)
+                __asm__ __volatile__(".byte 0xf2, 0x0f, 0xae, 0xf1"
+                                     :
+                                     : "c"(1u), "a"(static_cast<std::uint32_t>(deadline)), "d"(static_cast<std::uint32_t>(deadline >> 32))
+                                     : "memory", "cc");
+#else
+                AE_UNUSED(deadline);
+#endif
+            }
+
+            // Reads the TSC
+            static AE_FORCEINLINE std::uint64_t now() AE_NO_TSAN
+            {
+#ifdef AE_WAITPKG
+                std::uint32_t lo, hi;
+                __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+                return (static_cast<std::uint64_t>(hi) << 32) | lo;
+#else
+                return 0;
+#endif
+            }
+
+        private:
+            static bool detect() AE_NO_TSAN
+            {
+#ifdef AE_WAITPKG
+                unsigned int eax, ebx, ecx, edx;
+                if (__get_cpuid_max(0, 0) < 7)
+                    return false;
+                __cpuid_count(7, 0, eax, ebx, ecx, edx);
+                AE_UNUSED(eax);
+                AE_UNUSED(ebx);
+                AE_UNUSED(edx);
+                return (ecx & (1u << 5)) != 0; // CPUID.(EAX=7,ECX=0):ECX.WAITPKG
+#else
+                return false;
+#endif
+            }
+
+            static weak_atomic<bool> &flag() AE_NO_TSAN
+            {
+                static weak_atomic<bool> on(false);
+                return on;
+            }
+        };
+
         //---------------------------------------------------------
         // LightweightSemaphore
         //---------------------------------------------------------
@@ -676,38 +1026,86 @@ namespace moodycamel
             weak_atomic<ssize_t> m_count;
             Semaphore m_sema;
 
-            bool waitWithPartialSpinning(std::int64_t timeout_usecs = -1) AE_NO_TSAN
+            // `outcome`, if not null, is filled in with how the wait went (except for success,
+            // timed_out and wait_usecs, which are up to the caller)
+            bool waitWithPartialSpinning(std::int64_t timeout_usecs = -1, wait_outcome *outcome = nullptr) AE_NO_TSAN
             {
                 ssize_t oldCount;
-                // Is there a better way to set the initial spin count?
-                // If we lower it to 1000, testBenaphore becomes 15x slower on my Core i7-5930K Windows PC,
-                // as threads start hitting the kernel semaphore.
-                int spin = 1024;
-                // 自旋等待
-                while (--spin >= 0)
+                if (LowPowerWait::enabled())
                 {
-                    if (m_count.load() > 0)
+                    int rounds = 0;
+                    bool success = lowPowerSpin(rounds);
+                    if (outcome != nullptr)
                     {
-                        // 如果在自旋等待期间有元素入队或者出队，则更新计数
-                        m_count.fetch_add_acquire(-1);
+                        outcome->spun = success;
+                        outcome->spins = rounds;
+                    }
+                    if (success)
                         return true;
+                }
+                else
+                {
+                    // Is there a better way to set the initial spin count?
+                    // If we lower it to 1000, testBenaphore becomes 15x slower on my Core i7-5930K Windows PC,
+                    // as threads start hitting the kernel semaphore.
+                    int spin = 1024;
+                    // 自旋等待
+                    while (--spin >= 0)
+                    {
+                        if (m_count.load() > 0)
+                        {
+                            // 如果在自旋等待期间有元素入队或者出队，则更新计数
+                            m_count.fetch_add_acquire(-1);
+                            if (outcome != nullptr)
+                            {
+                                outcome->spun = true;
+                                outcome->spins = 1024 - spin;
+                            }
+                            return true;
+                        }
+                        compiler_fence(memory_order_acquire); // Prevent the compiler from collapsing the loop.
+                    }
+                    if (outcome != nullptr)
+                    {
+                        outcome->spins = 1024;
                     }
-                    compiler_fence(memory_order_acquire); // Prevent the compiler from collapsing the loop.
                 }
                 // 减一更新计数（这里假设的是有线程在自旋结束之后对队列进行了入队或者出队操作，并且更新了计数）
                 // 如果没有线程更新计数，则这里的 m_count.load() == -1（在这之前 m_count.load() == 0）
                 oldCount = m_count.fetch_add_acquire(-1);
                 if (oldCount > 0)
+                {
+                    if (outcome != nullptr)
+                    {
+                        outcome->spun = true;
+                    }
                     return true;
+                }
+                if (outcome != nullptr && timeout_usecs != 0)
+                {
+                    outcome->slept = true;
+                }
                 // 如果没有设置超时时间，就在这里死等信号量
                 if (timeout_usecs < 0)
                 {
                     if (m_sema.wait())
+                    {
+                        if (outcome != nullptr)
+                        {
+                            outcome->woken_by_signal = true;
+                        }
                         return true;
+                    }
                 }
                 // 设置了超时时间，且在超时时间内等到了信号量
                 if (timeout_usecs > 0 && m_sema.timed_wait(static_cast<uint64_t>(timeout_usecs)))
+                {
+                    if (outcome != nullptr)
+                    {
+                        outcome->woken_by_signal = true;
+                    }
                     return true;
+                }
                 // At this point, we've timed out waiting for the semaphore, but the
                 // count is still decremented indicating we may still be waiting on
                 // it. So we have to re-adjust the count, but only if the semaphore
@@ -733,6 +1131,28 @@ namespace moodycamel
                 }
             }
 
+            // The spin phase with LowPowerWait enabled: sleeps in a low-power state until the
+            // count's cache line is written, for up to MOODYCAMEL_LOW_POWER_WAIT_CYCLES TSC
+            // ticks in all. `rounds` counts the checks.
+            bool lowPowerSpin(int &rounds) AE_NO_TSAN
+            {
+                std::uint64_t deadline = LowPowerWait::now() + MOODYCAMEL_LOW_POWER_WAIT_CYCLES;
+                while (true)
+                {
+                    ++rounds;
+                    // Arm the monitor before checking, so that a write in between still ends the wait
+                    LowPowerWait::monitor(&m_count);
+                    if (m_count.load() > 0)
+                    {
+                        m_count.fetch_add_acquire(-1);
+                        return true;
+                    }
+                    if (LowPowerWait::now() >= deadline)
+                        return false;
+                    LowPowerWait::wait(deadline);
+                }
+            }
+
         public:
             AE_NO_TSAN LightweightSemaphore(ssize_t initialCount = 0) : m_count(initialCount), m_sema()
             {
@@ -749,6 +1169,23 @@ namespace moodycamel
                 return false;
             }
 
+            // Takes up to max from the count without waiting; returns how much was taken.
+            // (Only one thread ever waits, so no one else can take from the count in between.)
+            std::size_t tryWaitMany(std::size_t max) AE_NO_TSAN
+            {
+                ssize_t count = m_count.load();
+                if (count <= 0 || max == 0)
+                {
+                    return 0;
+                }
+                if (static_cast<std::size_t>(count) > max)
+                {
+                    count = static_cast<ssize_t>(max);
+                }
+                m_count.fetch_add_acquire(-count);
+                return static_cast<std::size_t>(count);
+            }
+
             bool wait() AE_NO_TSAN
             {
                 return tryWait() || waitWithPartialSpinning();
@@ -759,6 +1196,16 @@ namespace moodycamel
                 return tryWait() || waitWithPartialSpinning(timeout_usecs);
             }
 
+            // Like wait(timeout_usecs), but also reports how the wait went in `outcome`
+            // (all but wait_usecs, which is left to the caller)
+            bool wait(std::int64_t timeout_usecs, wait_outcome &outcome) AE_NO_TSAN
+            {
+                outcome = wait_outcome();
+                outcome.success = tryWait() || waitWithPartialSpinning(timeout_usecs, &outcome);
+                outcome.timed_out = !outcome.success;
+                return outcome.success;
+            }
+
             void signal(ssize_t count = 1) AE_NO_TSAN
             {
                 assert(count >= 0);
@@ -776,7 +1223,220 @@ namespace moodycamel
                 ssize_t count = m_count.load();
                 return count > 0 ? static_cast<std::size_t>(count) : 0;
             }
+
+            // Exchanges the counts of two semaphores (used to move a queue along with its
+            // semaphore). Not thread-safe: no thread may be waiting on or signalling either one.
+            void swapCount(LightweightSemaphore &other) AE_NO_TSAN
+            {
+                ssize_t count = m_count.load();
+                assert(count >= 0 && other.m_count.load() >= 0);
+                m_count = other.m_count.load();
+                other.m_count = count;
+            }
+        };
+
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        //---------------------------------------------------------
+        // ParkingSpot
+        //---------------------------------------------------------
+        // Where one thread sleeps while it waits for a condition that the other thread makes
+        // true. The waiting thread announces itself with prepareWait(), checks the condition
+        // once more, and then either sleeps with wait() or backs out with cancelWait(); the
+        // other thread calls notify() after every change that may satisfy the condition.
+        // notify() is a fence and a load unless the waiting thread is actually sleeping (or
+        // about to), and may hold off on waking it (see wake_hysteresis).
+        class ParkingSpot
+        {
+        public:
+            AE_NO_TSAN ParkingSpot() : m_waiting(false), m_sema(0), m_hysteresis(), m_pending(0), m_firstPending()
+            {
+            }
+
+            // Not thread-safe: no thread may be waiting or notifying
+            void setHysteresis(wake_hysteresis const &hysteresis) AE_NO_TSAN
+            {
+                m_hysteresis = hysteresis;
+                m_pending = 0;
+            }
+
+            wake_hysteresis const &hysteresis() const AE_NO_TSAN
+            {
+                return m_hysteresis;
+            }
+
+            // Whether notify() may hold off on waking the waiting thread
+            bool throttled() const AE_NO_TSAN
+            {
+                return m_hysteresis.items > 1 && m_hysteresis.max_delay_usecs != 0;
+            }
+
+            void prepareWait() AE_NO_TSAN
+            {
+                m_waiting.store(true, std::memory_order_relaxed);
+                // Pairs with the fence in notify(): either we see the other thread's change
+                // when we check the condition, or it sees m_waiting and wakes us
+                fence(memory_order_sync);
+            }
+
+            // Returns true if woken by notify(), false if the timeout expired first.
+            // A negative timeout waits indefinitely.
+            bool wait(std::int64_t timeout_usecs) AE_NO_TSAN
+            {
+                if (timeout_usecs < 0)
+                {
+                    while (!m_sema.wait())
+                        continue;
+                    return true;
+                }
+                if (timeout_usecs > 0 && m_sema.timed_wait(static_cast<std::uint64_t>(timeout_usecs)))
+                    return true;
+                return cancelWait();
+            }
+
+            // Withdraws a prepareWait(). Returns true if a notify() got to it first (the
+            // thread has effectively been woken)
+            bool cancelWait() AE_NO_TSAN
+            {
+                if (m_waiting.exchange(false, std::memory_order_relaxed))
+                    return false;
+                // notify() claimed us and is about to signal (or did already); absorb it so
+                // that the next wait doesn't return early
+                while (!m_sema.wait())
+                    continue;
+                return true;
+            }
+
+            // Wakes the waiting thread, if any; unless `urgent`, a throttled spot only does so
+            // once enough notifications have piled up, or the first of them is old enough
+            void notify(bool urgent = false) AE_NO_TSAN
+            {
+                fence(memory_order_sync);
+                if (!m_waiting.load(std::memory_order_relaxed))
+                {
+                    if (m_pending != 0)
+                        m_pending = 0;
+                    return;
+                }
+                if (!urgent && throttled())
+                {
+                    if (m_hysteresis.max_delay_usecs < 0)
+                    {
+                        if (++m_pending < m_hysteresis.items)
+                            return;
+                    }
+                    else
+                    {
+                        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                        if (m_pending++ == 0)
+                            m_firstPending = now;
+                        if (m_pending < m_hysteresis.items && now - m_firstPending < std::chrono::microseconds(m_hysteresis.max_delay_usecs))
+                            return;
+                    }
+                }
+                m_pending = 0;
+                if (m_waiting.exchange(false, std::memory_order_relaxed))
+                    m_sema.signal();
+            }
+
+            // Like notify(true), but may be called from any thread (it leaves the notifier's
+            // bookkeeping for the hysteresis alone)
+            void wake() AE_NO_TSAN
+            {
+                fence(memory_order_sync);
+                if (m_waiting.load(std::memory_order_relaxed) && m_waiting.exchange(false, std::memory_order_relaxed))
+                    m_sema.signal();
+            }
+
+            // Spins for a while, like LightweightSemaphore, then sleeps here until ready()
+            // (or until the timeout expires, in which case ready() is checked one last time).
+            // A throttled spot sleeps at most max_delay_usecs at a time, checking ready() in
+            // between. `outcome`, if not null, is filled in with how the wait went (except
+            // for success and wait_usecs, which are up to the caller).
+            template <typename Ready>
+            bool waitUntil(Ready ready, std::int64_t timeout_usecs, wait_outcome *outcome = nullptr) AE_NO_TSAN
+            {
+                if (outcome != nullptr)
+                    *outcome = wait_outcome();
+                if (ready())
+                    return true;
+                for (int spin = 1024; --spin >= 0;)
+                {
+                    if (ready())
+                    {
+                        if (outcome != nullptr)
+                        {
+                            outcome->spun = true;
+                            outcome->spins = 1024 - spin;
+                        }
+                        return true;
+                    }
+                    compiler_fence(memory_order_acquire); // Prevent the compiler from collapsing the loop.
+                }
+                if (outcome != nullptr)
+                    outcome->spins = 1024;
+                if (timeout_usecs == 0)
+                {
+                    if (outcome != nullptr)
+                        outcome->timed_out = true;
+                    return false;
+                }
+
+                typedef std::chrono::steady_clock Clock;
+                Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_usecs < 0 ? 0 : timeout_usecs);
+                while (true)
+                {
+                    prepareWait();
+                    if (ready())
+                    {
+                        cancelWait();
+                        if (outcome != nullptr && !outcome->slept)
+                            outcome->spun = true;
+                        return true;
+                    }
+                    std::int64_t remaining = -1;
+                    if (timeout_usecs > 0)
+                    {
+                        remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+                        if (remaining <= 0)
+                        {
+                            cancelWait();
+                            bool result = ready();
+                            if (outcome != nullptr)
+                                outcome->timed_out = !result;
+                            return result;
+                        }
+                    }
+                    std::int64_t slice = remaining;
+                    if (throttled() && m_hysteresis.max_delay_usecs > 0 && (slice < 0 || slice > m_hysteresis.max_delay_usecs))
+                        slice = m_hysteresis.max_delay_usecs;
+                    if (outcome != nullptr)
+                        outcome->slept = true;
+                    if (!wait(slice))
+                    {
+                        bool result = ready();
+                        if (result || slice == remaining)
+                        {
+                            if (outcome != nullptr)
+                                outcome->timed_out = !result;
+                            return result;
+                        }
+                        continue; // Only a slice expired; the producer may be sitting on a deferred wake-up
+                    }
+                    if (outcome != nullptr)
+                        outcome->woken_by_signal = true;
+                    if (ready())
+                        return true;
+                }
+            }
+
+        private:
+            std::atomic<bool> m_waiting;
+            Semaphore m_sema;
+            wake_hysteresis m_hysteresis;
+            std::size_t m_pending; // Notifications held back since the waiting thread went to sleep (notifier only)
+            std::chrono::steady_clock::time_point m_firstPending;
         };
+#endif
     } // end namespace spsc_sema
 } // end namespace moodycamel
 
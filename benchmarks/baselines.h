@@ -0,0 +1,143 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Simple, in-tree SPSC queue implementations that the benchmarks use as baselines:
+// what you'd write without a dedicated lock-free queue library. Each has the
+// interface runBenchmark expects (a constructor taking a capacity, enqueue, and
+// try_dequeue); the condition variable queue also has wait_dequeue so it can be
+// compared with the blocking queues.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../readerwriterqueue.h" // For MOODYCAMEL_CACHE_LINE_SIZE
+
+namespace baselines
+{
+	// A std::deque guarded by a std::mutex
+	template <typename T>
+	class MutexDequeQueue
+	{
+	public:
+		explicit MutexDequeQueue(std::size_t) {}
+
+		bool enqueue(T const &element)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			items.push_back(element);
+			return true;
+		}
+
+		bool try_dequeue(T &result)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (items.empty())
+				return false;
+			result = std::move(items.front());
+			items.pop_front();
+			return true;
+		}
+
+	private:
+		std::mutex mutex;
+		std::deque<T> items;
+	};
+
+	// The textbook blocking queue: a mutex-protected std::deque plus a condition
+	// variable that the consumer waits on while the queue is empty
+	template <typename T>
+	class CondVarQueue
+	{
+	public:
+		explicit CondVarQueue(std::size_t) {}
+
+		bool enqueue(T const &element)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				items.push_back(element);
+			}
+			cv.notify_one();
+			return true;
+		}
+
+		bool try_dequeue(T &result)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (items.empty())
+				return false;
+			result = std::move(items.front());
+			items.pop_front();
+			return true;
+		}
+
+		void wait_dequeue(T &result)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv.wait(lock, [&]() { return !items.empty(); });
+			result = std::move(items.front());
+			items.pop_front();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::deque<T> items;
+	};
+
+	// Lamport's single-producer, single-consumer ring buffer with C++11 atomics: a
+	// fixed power-of-two array and two indices on separate cache lines, with no
+	// caching of the other side's index (every operation reads both indices).
+	// enqueue spins while the ring is full.
+	template <typename T>
+	class LamportRing
+	{
+	public:
+		explicit LamportRing(std::size_t capacity)
+			: head(0), tail(0)
+		{
+			std::size_t size = 2;
+			while (size < capacity + 1)
+				size <<= 1;
+			slots.resize(size);
+			mask = size - 1;
+		}
+
+		bool enqueue(T const &element)
+		{
+			std::size_t t = tail.load(std::memory_order_relaxed);
+			while (((t + 1) & mask) == head.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			slots[t] = element;
+			tail.store((t + 1) & mask, std::memory_order_release);
+			return true;
+		}
+
+		bool try_dequeue(T &result)
+		{
+			std::size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire))
+				return false;
+			result = std::move(slots[h]);
+			head.store((h + 1) & mask, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::vector<T> slots;
+		std::size_t mask;
+		char cachelineFiller0[MOODYCAMEL_CACHE_LINE_SIZE];
+		std::atomic<std::size_t> head; // Written by the consumer
+		char cachelineFiller1[MOODYCAMEL_CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+		std::atomic<std::size_t> tail; // Written by the producer
+	};
+}
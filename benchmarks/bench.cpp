@@ -31,15 +31,25 @@ public:
 	void enqueue(T const &x) { this->wait_enqueue(x); }
 };
 #endif
+#include "baselines.h" // Mutex/condition variable/Lamport ring baselines
 #include "systemtime.h"
+#include "benchreport.h"
+#include "perfcounters.h"
 #include "../tests/common/simplethread.h"
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <numeric> // For std::accumulate
 #include <algorithm>
 #include <random>
 #include <ctime>
+#include <thread>
 
 #ifndef UNUSED
 #define UNUSED(x) ((void)x);
@@ -62,6 +72,7 @@ enum BenchmarkType
 	bench_mostly_remove,
 	bench_heavy_concurrent,
 	bench_random_concurrent,
+	bench_blocking_dequeue,
 
 	BENCHMARK_COUNT
 };
@@ -73,169 +84,513 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 
 const int BENCHMARK_NAME_MAX = 17; // Not including null terminator
 const char *benchmarkName(BenchmarkType benchmark);
+const char *benchmarkId(BenchmarkType benchmark); // Identifier used in machine-readable output
+
+// Performance counters wrapped around the timed section of each run (null unless --perf is given)
+perfcounters::CounterSet *perfCounters = nullptr;
+
+// Marks the start and end of the timed section of a run
+inline SystemTime beginMeasurement()
+{
+	if (perfCounters != nullptr)
+		perfCounters->start();
+	return getSystemTime();
+}
+
+inline double endMeasurement(SystemTime start)
+{
+	double elapsed = getTimeDelta(start);
+	if (perfCounters != nullptr)
+		perfCounters->stop();
+	return elapsed;
+}
+
+typedef double (*BenchmarkRunner)(BenchmarkType benchmark, unsigned int randomSeed, double &out_Ops);
+
+struct QueueUnderTest
+{
+	const char *shortName; // Column header, and queue name in machine-readable output
+	const char *longName;
+	BenchmarkRunner run;
+};
+
+// The consumer side of the blocking benchmark: queues that can block use wait_dequeue,
+// the others poll with try_dequeue, yielding between attempts
+template <typename TQueue>
+inline auto waitDequeue(TQueue &q, int &element, int) -> decltype(q.wait_dequeue(element), void())
+{
+	q.wait_dequeue(element);
+}
+
+template <typename TQueue>
+inline void waitDequeue(TQueue &q, int &element, long)
+{
+	while (!q.try_dequeue(element))
+		std::this_thread::yield();
+}
+
+enum OutputFormat
+{
+	format_table,
+	format_json,
+	format_csv
+};
+
+void printUsage(const char *progName, std::vector<QueueUnderTest> const &queues)
+{
+	std::printf("%s\n    Description: Benchmarks moodycamel::ReaderWriterQueue against other SPSC queues\n", progName);
+	std::printf("                 and simple mutex/condition variable/ring buffer baselines\n");
+	std::printf("    --help                    Prints this help blurb\n");
+	std::printf("    --format table|json|csv   Output format (default: table)\n");
+	std::printf("    --output file             Writes results to a file instead of stdout\n");
+	std::printf("    --runs n                  Number of runs per benchmark and queue (at least 2)\n");
+	std::printf("    --benchmark id            Runs only the specified benchmark(s):\n");
+	for (int benchmark = 0; benchmark < BENCHMARK_COUNT; ++benchmark)
+		std::printf("                                  %s\n", benchmarkId((BenchmarkType)benchmark));
+	std::printf("    --queue name              Runs only the specified queue(s); the table compares every\n");
+	std::printf("                              queue with the first one:\n");
+	for (std::size_t q = 0; q != queues.size(); ++q)
+		std::printf("                                  %-8s %s\n", queues[q].shortName, queues[q].longName);
+	std::printf("    --perf                    Records hardware/software performance counters (cycles,\n");
+	std::printf("                              instructions, L1D/LLC misses, context switches) per\n");
+	std::printf("                              operation, where the OS and CPU make them available\n");
+	std::printf("    --perf-raw name=code      With --perf, also records a raw CPU-specific event, e.g.\n");
+	std::printf("                              hitm=0x04d2 (cross-core cache-line transfers on Skylake)\n");
+	std::printf("    --compare base new        Compares two JSON/CSV result files and exits with 1 if\n");
+	std::printf("                              the new results have a significant regression\n");
+	std::printf("    --threshold percent       Minimum slowdown reported as a regression (default: 5)\n");
+}
+
+int compareFiles(const char *baselinePath, const char *candidatePath, double thresholdPercent)
+{
+	std::vector<benchreport::Run> baseline, candidate;
+	std::string error;
+	if (!benchreport::readResults(baselinePath, baseline, error))
+	{
+		std::fprintf(stderr, "Could not read '%s': %s\n", baselinePath, error.c_str());
+		return 2;
+	}
+	if (!benchreport::readResults(candidatePath, candidate, error))
+	{
+		std::fprintf(stderr, "Could not read '%s': %s\n", candidatePath, error.c_str());
+		return 2;
+	}
+	return benchreport::compareResults(baseline, candidate, thresholdPercent, std::cout) == 0 ? 0 : 1;
+}
+
+void printTable(std::vector<QueueUnderTest> const &queues, std::vector<int> const &benchmarks,
+				std::vector<std::vector<std::vector<double>>> &results, std::vector<std::vector<std::vector<double>>> const &ops,
+				int testCount, int max, std::ostream &out)
+{
+	const int COLUMN_WIDTH = 10; // "0.0000s | "
+	const std::size_t queueCount = queues.size();
+
+	// Sort results
+	for (std::size_t b = 0; b != benchmarks.size(); ++b)
+	{
+		for (std::size_t q = 0; q != queueCount; ++q)
+		{
+			std::sort(results[b][q].begin(), results[b][q].end());
+		}
+	}
+
+	out << std::setw(BENCHMARK_NAME_MAX) << "         "
+			  << " |";
+	const char *groups[] = {" Min ", " Max ", " Avg "};
+	for (int g = 0; g != 3; ++g)
+	{
+		int width = (int)queueCount * COLUMN_WIDTH - 1;
+		int left = (width - 5) / 2;
+		out << std::string(left, '-') << groups[g] << std::string(width - 5 - left, '-') << "|";
+	}
+	out << "\n";
+	out << std::left << std::setw(BENCHMARK_NAME_MAX) << "Benchmark"
+			  << " |";
+	for (int g = 0; g != 3; ++g)
+	{
+		for (std::size_t q = 0; q != queueCount; ++q)
+		{
+			std::string name = queues[q].shortName;
+			int left = (COLUMN_WIDTH - 1 - (int)name.size()) / 2;
+			out << std::string(left, ' ') << name << std::string(std::max(0, COLUMN_WIDTH - 1 - left - (int)name.size()), ' ') << "|";
+		}
+	}
+	for (std::size_t q = 1; q != queueCount; ++q)
+	{
+		out << " x" << queues[q].shortName << (q + 1 == queueCount ? "" : " |");
+	}
+	out << "\n";
+	out.fill('-');
+	out << std::setw(BENCHMARK_NAME_MAX) << "---------"
+			  << "-+";
+	for (std::size_t c = 0; c != 3 * queueCount; ++c)
+	{
+		out << std::string(COLUMN_WIDTH - 1, '-') << "+";
+	}
+	for (std::size_t q = 1; q != queueCount; ++q)
+	{
+		out << std::string(std::strlen(queues[q].shortName) + 2, '-') << (q + 1 == queueCount ? "" : "-+");
+	}
+	out << "\n";
+	out.fill(' ');
+
+	std::vector<double> opsPerSec(queueCount, 0);
+	int opTimedBenchmarks = 0;
+	for (std::size_t b = 0; b != benchmarks.size(); ++b)
+	{
+		std::vector<double> mins(queueCount), maxs(queueCount), avgs(queueCount);
+		for (std::size_t q = 0; q != queueCount; ++q)
+		{
+			std::vector<double> const &r = results[b][q];
+			mins[q] = r[0];
+			maxs[q] = r[max - 1];
+			avgs[q] = std::accumulate(r.begin(), r.begin() + max, 0.0) / max;
+		}
+
+		if (results[b][0][0] != -1)
+		{
+			for (std::size_t q = 0; q != queueCount; ++q)
+			{
+				double totalAvg = std::accumulate(results[b][q].begin(), results[b][q].end(), 0.0) / testCount;
+				opsPerSec[q] += totalAvg == 0 ? 0 : std::accumulate(ops[b][q].begin(), ops[b][q].end(), 0.0) / testCount / totalAvg;
+			}
+			++opTimedBenchmarks;
+		}
+
+		out << std::left << std::setw(BENCHMARK_NAME_MAX) << benchmarkName((BenchmarkType)benchmarks[b]) << " | ";
+		for (std::size_t q = 0; q != queueCount; ++q)
+			out << std::fixed << std::setprecision(4) << mins[q] << "s | ";
+		for (std::size_t q = 0; q != queueCount; ++q)
+			out << std::fixed << std::setprecision(4) << maxs[q] << "s | ";
+		for (std::size_t q = 0; q != queueCount; ++q)
+			out << std::fixed << std::setprecision(4) << avgs[q] << "s | ";
+		for (std::size_t q = 1; q != queueCount; ++q)
+		{
+			double mult = avgs[0] < 0.00001 ? 0 : avgs[q] / avgs[0];
+			out << std::fixed << std::setprecision(2) << mult << "x" << (q + 1 == queueCount ? "" : " | ");
+		}
+		out << "\n";
+	}
+
+	std::size_t longest = 0;
+	for (std::size_t q = 0; q != queueCount; ++q)
+		longest = std::max(longest, std::strlen(queues[q].longName));
+	out << "\nAverage ops/s:\n";
+	for (std::size_t q = 0; q != queueCount; ++q)
+	{
+		out << "    " << std::left << std::setw((int)longest + 2) << (std::string(queues[q].longName) + ":")
+				  << std::fixed << std::setprecision(2) << (opTimedBenchmarks == 0 ? 0 : opsPerSec[q] / opTimedBenchmarks) / 1000000 << " million\n";
+	}
+	out << std::endl;
+}
+
+// Prints the mean of each performance counter per operation, over all runs of each
+// benchmark on each queue
+void printCounters(std::vector<QueueUnderTest> const &queues, std::vector<benchreport::Run> const &runs, std::ostream &out)
+{
+	const int COLUMN_WIDTH = 12;
+	std::vector<std::string> benchmarkIds, counterNames;
+	for (std::size_t r = 0; r != runs.size(); ++r)
+	{
+		if (std::find(benchmarkIds.begin(), benchmarkIds.end(), runs[r].benchmark) == benchmarkIds.end())
+			benchmarkIds.push_back(runs[r].benchmark);
+		for (std::size_t m = 0; m != runs[r].metrics.size(); ++m)
+		{
+			if (std::find(counterNames.begin(), counterNames.end(), runs[r].metrics[m].first) == counterNames.end())
+				counterNames.push_back(runs[r].metrics[m].first);
+		}
+	}
+	if (counterNames.empty())
+		return;
+
+	out << "Performance counters per operation (mean of all runs):\n";
+	for (std::size_t b = 0; b != benchmarkIds.size(); ++b)
+	{
+		out << "\n" << std::left << std::setw(28) << benchmarkIds[b];
+		for (std::size_t q = 0; q != queues.size(); ++q)
+			out << std::right << std::setw(COLUMN_WIDTH) << queues[q].shortName;
+		out << "\n";
+		for (std::size_t c = 0; c != counterNames.size(); ++c)
+		{
+			out << "    " << std::left << std::setw(24) << counterNames[c];
+			for (std::size_t q = 0; q != queues.size(); ++q)
+			{
+				double total = 0;
+				int count = 0;
+				for (std::size_t r = 0; r != runs.size(); ++r)
+				{
+					if (runs[r].benchmark != benchmarkIds[b] || runs[r].queue != queues[q].shortName)
+						continue;
+					for (std::size_t m = 0; m != runs[r].metrics.size(); ++m)
+					{
+						if (runs[r].metrics[m].first == counterNames[c])
+						{
+							total += runs[r].metrics[m].second;
+							++count;
+						}
+					}
+				}
+				out << std::right << std::setw(COLUMN_WIDTH) << std::defaultfloat << std::setprecision(4) << (count == 0 ? 0 : total / count);
+			}
+			out << "\n";
+		}
+	}
+	out << std::endl;
+}
 
 int main(int argc, char **argv)
 {
 #ifdef NDEBUG
-	const int TEST_COUNT = 25;
+	int TEST_COUNT = 25;
 #else
-	const int TEST_COUNT = 2;
+	int TEST_COUNT = 2;
 #endif
-	assert(TEST_COUNT >= 2);
 
 	const double FASTEST_PERCENT_CONSIDERED = 20; // Consider only the fastest runs in the top 20%
 
-	double rwqResults[BENCHMARK_COUNT][TEST_COUNT];
-	double brwcbResults[BENCHMARK_COUNT][TEST_COUNT];
-	double spscResults[BENCHMARK_COUNT][TEST_COUNT];
-	double follyResults[BENCHMARK_COUNT][TEST_COUNT];
-
-	// Also calculate a rough heuristic of "ops/s" (across all runs, not just fastest)
-	double rwqOps[BENCHMARK_COUNT][TEST_COUNT];
-	double brwcbOps[BENCHMARK_COUNT][TEST_COUNT];
-	double spscOps[BENCHMARK_COUNT][TEST_COUNT];
-	double follyOps[BENCHMARK_COUNT][TEST_COUNT];
+	// Parse command line options
+	std::string progName = argv[0];
+	auto slash = progName.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		progName = progName.substr(slash + 1);
+	}
 
-	// Make sure the randomness of each benchmark run is identical
-	unsigned int randSeeds[BENCHMARK_COUNT];
-	for (unsigned int i = 0; i != BENCHMARK_COUNT; ++i)
+	std::vector<QueueUnderTest> queues;
 	{
-		randSeeds[i] = ((unsigned int)time(NULL)) * i;
+		QueueUnderTest rwq = {"RWQ", "ReaderWriterQueue", &runBenchmark<ReaderWriterQueue<int>>};
+		queues.push_back(rwq);
+		QueueUnderTest brwq = {"BRWQ", "BlockingReaderWriterQueue", &runBenchmark<BlockingReaderWriterQueue<int>>};
+		queues.push_back(brwq);
+#ifndef NO_CIRCULAR_BUFFER_SUPPORT
+		QueueUnderTest brwcb = {"BRWCB", "BlockingReaderWriterCircularBuffer", &runBenchmark<BlockingReaderWriterCircularBufferAdapter<int>>};
+		queues.push_back(brwcb);
+#endif
+#ifndef NO_SPSC_SUPPORT
+		QueueUnderTest spsc = {"SPSC", "SPSC queue", &runBenchmark<spsc_queue<int>>};
+		queues.push_back(spsc);
+#endif
+#ifndef NO_FOLLY_SUPPORT
+		QueueUnderTest folly = {"Folly", "Folly queue", &runBenchmark<ProducerConsumerQueue<int>>};
+		queues.push_back(folly);
+#endif
+		QueueUnderTest mutexDeque = {"Mutex", "std::mutex + std::deque", &runBenchmark<baselines::MutexDequeQueue<int>>};
+		queues.push_back(mutexDeque);
+		QueueUnderTest condVar = {"CondVar", "Condition variable queue", &runBenchmark<baselines::CondVarQueue<int>>};
+		queues.push_back(condVar);
+		QueueUnderTest lamport = {"Lamport", "Lamport ring buffer", &runBenchmark<baselines::LamportRing<int>>};
+		queues.push_back(lamport);
 	}
 
-	// Run benchmarks
-	for (int benchmark = 0; benchmark < BENCHMARK_COUNT; ++benchmark)
+	OutputFormat format = format_table;
+	const char *outputPath = nullptr;
+	std::vector<int> benchmarks;
+	std::vector<QueueUnderTest> selectedQueues;
+	double thresholdPercent = 5;
+	const char *compareBase = nullptr;
+	const char *compareNew = nullptr;
+	bool recordCounters = false;
+	std::vector<perfcounters::EventSpec> counterEvents = perfcounters::defaultEvents();
+	for (int i = 1; i < argc; ++i)
 	{
-		for (int i = 0; i < TEST_COUNT; ++i)
+		bool hasArg = i + 1 < argc;
+		if (std::strcmp(argv[i], "--help") == 0)
 		{
-			rwqResults[benchmark][i] = runBenchmark<ReaderWriterQueue<int>>((BenchmarkType)benchmark, randSeeds[benchmark], rwqOps[benchmark][i]);
+			printUsage(progName.c_str(), queues);
+			return 0;
 		}
-#ifndef NO_CIRCULAR_BUFFER_SUPPORT
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--format") == 0 && hasArg)
 		{
-			brwcbResults[benchmark][i] = runBenchmark<BlockingReaderWriterCircularBufferAdapter<int>>((BenchmarkType)benchmark, randSeeds[benchmark], brwcbOps[benchmark][i]);
+			++i;
+			if (std::strcmp(argv[i], "table") == 0)
+				format = format_table;
+			else if (std::strcmp(argv[i], "json") == 0)
+				format = format_json;
+			else if (std::strcmp(argv[i], "csv") == 0)
+				format = format_csv;
+			else
+			{
+				std::printf("Unrecognized format '%s'.\n\n", argv[i]);
+				printUsage(progName.c_str(), queues);
+				return -1;
+			}
 		}
-#else
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--output") == 0 && hasArg)
 		{
-			brwcbResults[benchmark][i] = 0;
-			brwcbOps[benchmark][i] = 0;
+			outputPath = argv[++i];
 		}
-#endif
-#ifndef NO_SPSC_SUPPORT
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--runs") == 0 && hasArg)
 		{
-			spscResults[benchmark][i] = runBenchmark<spsc_queue<int>>((BenchmarkType)benchmark, randSeeds[benchmark], spscOps[benchmark][i]);
+			TEST_COUNT = std::atoi(argv[++i]);
+			if (TEST_COUNT < 2)
+			{
+				std::printf("At least 2 runs are required.\n");
+				return -1;
+			}
 		}
-#else
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--benchmark") == 0 && hasArg)
 		{
-			spscResults[benchmark][i] = 0;
-			spscOps[benchmark][i] = 0;
+			++i;
+			int benchmark = 0;
+			while (benchmark != BENCHMARK_COUNT && std::strcmp(argv[i], benchmarkId((BenchmarkType)benchmark)) != 0)
+				++benchmark;
+			if (benchmark == BENCHMARK_COUNT)
+			{
+				std::printf("Unrecognized benchmark '%s'.\n\n", argv[i]);
+				printUsage(progName.c_str(), queues);
+				return -1;
+			}
+			benchmarks.push_back(benchmark);
 		}
-#endif
-#ifndef NO_FOLLY_SUPPORT
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--queue") == 0 && hasArg)
 		{
-			follyResults[benchmark][i] = runBenchmark<ProducerConsumerQueue<int>>((BenchmarkType)benchmark, randSeeds[benchmark], follyOps[benchmark][i]);
+			++i;
+			std::size_t q = 0;
+			while (q != queues.size() && std::strcmp(argv[i], queues[q].shortName) != 0)
+				++q;
+			if (q == queues.size())
+			{
+				std::printf("Unrecognized queue '%s'.\n\n", argv[i]);
+				printUsage(progName.c_str(), queues);
+				return -1;
+			}
+			selectedQueues.push_back(queues[q]);
 		}
-#else
-		for (int i = 0; i < TEST_COUNT; ++i)
+		else if (std::strcmp(argv[i], "--perf") == 0)
 		{
-			follyResults[benchmark][i] = 0;
-			follyOps[benchmark][i] = 0;
+			recordCounters = true;
+		}
+		else if (std::strcmp(argv[i], "--perf-raw") == 0 && hasArg)
+		{
+			perfcounters::EventSpec event;
+			if (!perfcounters::parseRawEvent(argv[++i], event))
+			{
+				std::printf("Invalid raw event '%s' (expected name=code).\n\n", argv[i]);
+				printUsage(progName.c_str(), queues);
+				return -1;
+			}
+			counterEvents.push_back(event);
+		}
+		else if (std::strcmp(argv[i], "--compare") == 0 && i + 2 < argc)
+		{
+			compareBase = argv[++i];
+			compareNew = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--threshold") == 0 && hasArg)
+		{
+			thresholdPercent = std::atof(argv[++i]);
+		}
+		else
+		{
+			std::printf("Unrecognized option '%s' (or missing argument).\n\n", argv[i]);
+			printUsage(progName.c_str(), queues);
+			return -1;
 		}
-#endif
 	}
+	assert(TEST_COUNT >= 2);
 
-	// Sort results
-	for (int benchmark = 0; benchmark < BENCHMARK_COUNT; ++benchmark)
+	if (compareBase != nullptr)
+	{
+		return compareFiles(compareBase, compareNew, thresholdPercent);
+	}
+
+	if (benchmarks.empty())
+	{
+		for (int benchmark = 0; benchmark < BENCHMARK_COUNT; ++benchmark)
+			benchmarks.push_back(benchmark);
+	}
+	if (!selectedQueues.empty())
+	{
+		queues = selectedQueues;
+	}
+
+	perfcounters::CounterSet counters;
+	if (recordCounters)
+	{
+		std::string unavailable = counters.open(counterEvents);
+		if (!unavailable.empty())
+			std::fprintf(stderr, "Note: some performance counters are unavailable: %s\n", unavailable.c_str());
+		if (!counters.empty())
+			perfCounters = &counters;
+	}
+
+	// Make sure the randomness of each benchmark run is identical
+	unsigned int randSeeds[BENCHMARK_COUNT];
+	for (unsigned int i = 0; i != BENCHMARK_COUNT; ++i)
 	{
-		std::sort(&rwqResults[benchmark][0], &rwqResults[benchmark][0] + TEST_COUNT);
-		std::sort(&brwcbResults[benchmark][0], &brwcbResults[benchmark][0] + TEST_COUNT);
-		std::sort(&spscResults[benchmark][0], &spscResults[benchmark][0] + TEST_COUNT);
-		std::sort(&follyResults[benchmark][0], &follyResults[benchmark][0] + TEST_COUNT);
+		randSeeds[i] = ((unsigned int)time(NULL)) * i;
 	}
 
-	// Display results
-	int max = std::max(2, (int)(TEST_COUNT * FASTEST_PERCENT_CONSIDERED / 100));
-	assert(max > 0);
+	// Run benchmarks
+	// results[benchmark][queue][run] is the time taken in seconds; ops[...] the number of operations
+	// performed (used to calculate a rough heuristic of "ops/s" across all runs, not just the fastest)
+	std::vector<std::vector<std::vector<double>>> results(benchmarks.size(), std::vector<std::vector<double>>(queues.size(), std::vector<double>(TEST_COUNT)));
+	std::vector<std::vector<std::vector<double>>> ops(results);
+	std::vector<benchreport::Run> runs;
+	for (std::size_t b = 0; b != benchmarks.size(); ++b)
+	{
+		BenchmarkType benchmark = (BenchmarkType)benchmarks[b];
+		for (std::size_t q = 0; q != queues.size(); ++q)
+		{
+			for (int i = 0; i < TEST_COUNT; ++i)
+			{
+				results[b][q][i] = queues[q].run(benchmark, randSeeds[benchmark], ops[b][q][i]);
+
+				benchreport::Run run;
+				run.benchmark = benchmarkId(benchmark);
+				run.queue = queues[q].shortName;
+				run.run = i;
+				run.seconds = results[b][q][i];
+				run.ops = ops[b][q][i];
+				if (perfCounters != nullptr)
+				{
+					std::vector<perfcounters::CounterSet::Reading> readings = perfCounters->read();
+					for (std::size_t c = 0; c != readings.size(); ++c)
+						run.metrics.push_back(std::make_pair(readings[c].name + "_per_op", run.ops == 0 ? 0 : readings[c].value / run.ops));
+				}
+				runs.push_back(run);
+			}
+		}
+	}
+
+	std::ofstream file;
+	if (outputPath != nullptr)
+	{
+		file.open(outputPath);
+		if (!file)
+		{
+			std::fprintf(stderr, "Could not open '%s' for writing\n", outputPath);
+			return 2;
+		}
+	}
+	std::ostream &out = outputPath != nullptr ? file : std::cout;
+
+	if (format == format_json)
+	{
+		benchreport::writeJson(out, benchreport::currentEnvironment(), runs);
+	}
+	else if (format == format_csv)
+	{
+		benchreport::writeCsv(out, benchreport::currentEnvironment(), runs);
+	}
+	else
+	{
+		// Display results
+		int max = std::max(2, (int)(TEST_COUNT * FASTEST_PERCENT_CONSIDERED / 100));
+		assert(max > 0);
 #ifdef NO_CIRCULAR_BUFFER_SUPPORT
-	std::cout << "Note: BRWCB queue not supported on this platform, discount its timings" << std::endl;
+		out << "Note: BRWCB queue not supported on this platform, skipping it" << std::endl;
 #endif
 #ifdef NO_SPSC_SUPPORT
-	std::cout << "Note: SPSC queue not supported on this platform, discount its timings" << std::endl;
+		out << "Note: SPSC queue not supported on this platform, skipping it" << std::endl;
 #endif
 #ifdef NO_FOLLY_SUPPORT
-	std::cout << "Note: Folly queue not supported by this compiler, discount its timings" << std::endl;
+		out << "Note: Folly queue not supported by this compiler, skipping it" << std::endl;
 #endif
-	std::cout << std::setw(BENCHMARK_NAME_MAX) << "         "
-			  << " |----------------  Min -----------------|----------------- Max -----------------|----------------- Avg -----------------|\n";
-	std::cout << std::left << std::setw(BENCHMARK_NAME_MAX) << "Benchmark"
-			  << " |   RWQ   |  BRWCB  |  SPSC   |  Folly  |   RWQ   |  BRWCB  |  SPSC   |  Folly  |   RWQ   |  BRWCB  |  SPSC   |  Folly  | xSPSC | xFolly\n";
-	std::cout.fill('-');
-	std::cout << std::setw(BENCHMARK_NAME_MAX) << "---------"
-			  << "-+---------+---------+---------+---------+---------+---------+---------+---------+---------+---------+---------+---------+-------+-------\n";
-	std::cout.fill(' ');
-	double rwqOpsPerSec = 0, brwcbOpsPerSec = 0, spscOpsPerSec = 0, follyOpsPerSec = 0;
-	int opTimedBenchmarks = 0;
-	for (int benchmark = 0; benchmark < BENCHMARK_COUNT; ++benchmark)
-	{
-		double rwqMin = rwqResults[benchmark][0], rwqMax = rwqResults[benchmark][max - 1];
-		double brwcbMin = brwcbResults[benchmark][0], brwcbMax = brwcbResults[benchmark][max - 1];
-		double spscMin = spscResults[benchmark][0], spscMax = spscResults[benchmark][max - 1];
-		double follyMin = follyResults[benchmark][0], follyMax = follyResults[benchmark][max - 1];
-		double rwqAvg = std::accumulate(&rwqResults[benchmark][0], &rwqResults[benchmark][0] + max, 0.0) / max;
-		double brwcbAvg = std::accumulate(&brwcbResults[benchmark][0], &brwcbResults[benchmark][0] + max, 0.0) / max;
-		double spscAvg = std::accumulate(&spscResults[benchmark][0], &spscResults[benchmark][0] + max, 0.0) / max;
-		double follyAvg = std::accumulate(&follyResults[benchmark][0], &follyResults[benchmark][0] + max, 0.0) / max;
-		double spscMult = rwqAvg < 0.00001 ? 0 : spscAvg / rwqAvg;
-		double follyMult = follyAvg < 0.00001 ? 0 : follyAvg / rwqAvg;
-
-		if (rwqResults[benchmark][0] != -1)
-		{
-			double rwqTotalAvg = std::accumulate(&rwqResults[benchmark][0], &rwqResults[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT;
-			double brwcbTotalAvg = std::accumulate(&brwcbResults[benchmark][0], &brwcbResults[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT;
-			double spscTotalAvg = std::accumulate(&spscResults[benchmark][0], &spscResults[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT;
-			double follyTotalAvg = std::accumulate(&follyResults[benchmark][0], &follyResults[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT;
-			rwqOpsPerSec += rwqTotalAvg == 0 ? 0 : std::accumulate(&rwqOps[benchmark][0], &rwqOps[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT / rwqTotalAvg;
-			brwcbOpsPerSec += brwcbTotalAvg == 0 ? 0 : std::accumulate(&brwcbOps[benchmark][0], &brwcbOps[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT / brwcbTotalAvg;
-			spscOpsPerSec += spscTotalAvg == 0 ? 0 : std::accumulate(&spscOps[benchmark][0], &spscOps[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT / spscTotalAvg;
-			follyOpsPerSec += follyTotalAvg == 0 ? 0 : std::accumulate(&follyOps[benchmark][0], &follyOps[benchmark][0] + TEST_COUNT, 0.0) / TEST_COUNT / follyTotalAvg;
-			++opTimedBenchmarks;
-		}
-
-		std::cout
-			<< std::left << std::setw(BENCHMARK_NAME_MAX) << benchmarkName((BenchmarkType)benchmark) << " | "
-			<< std::fixed << std::setprecision(4) << rwqMin << "s | "
-			<< std::fixed << std::setprecision(4) << brwcbMin << "s | "
-			<< std::fixed << std::setprecision(4) << spscMin << "s | "
-			<< std::fixed << std::setprecision(4) << follyMin << "s | "
-			<< std::fixed << std::setprecision(4) << rwqMax << "s | "
-			<< std::fixed << std::setprecision(4) << brwcbMax << "s | "
-			<< std::fixed << std::setprecision(4) << spscMax << "s | "
-			<< std::fixed << std::setprecision(4) << follyMax << "s | "
-			<< std::fixed << std::setprecision(4) << rwqAvg << "s | "
-			<< std::fixed << std::setprecision(4) << brwcbAvg << "s | "
-			<< std::fixed << std::setprecision(4) << spscAvg << "s | "
-			<< std::fixed << std::setprecision(4) << follyAvg << "s | "
-			<< std::fixed << std::setprecision(2) << spscMult << "x | "
-			<< std::fixed << std::setprecision(2) << follyMult << "x"
-			<< "\n";
-	}
-
-	rwqOpsPerSec /= opTimedBenchmarks;
-	brwcbOpsPerSec /= opTimedBenchmarks;
-	spscOpsPerSec /= opTimedBenchmarks;
-	follyOpsPerSec /= opTimedBenchmarks;
-
-	std::cout
-		<< "\nAverage ops/s:\n"
-		<< "    ReaderWriterQueue:                  " << std::fixed << std::setprecision(2) << rwqOpsPerSec / 1000000 << " million\n"
-		<< "    BlockingReaderWriterCircularBuffer: " << std::fixed << std::setprecision(2) << brwcbOpsPerSec / 1000000 << " million\n"
-		<< "    SPSC queue:                         " << std::fixed << std::setprecision(2) << spscOpsPerSec / 1000000 << " million\n"
-		<< "    Folly queue:                        " << std::fixed << std::setprecision(2) << follyOpsPerSec / 1000000 << " million\n";
-	std::cout << std::endl;
+		printTable(queues, benchmarks, results, ops, TEST_COUNT, max, out);
+		if (perfCounters != nullptr)
+			printCounters(queues, runs, out);
+	}
 
 	return 0;
 }
@@ -257,13 +612,13 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		out_Ops = MAX;
 		TQueue q(MAX);
 		int num = 0;
-		start = getSystemTime();
+		start = beginMeasurement();
 		for (counter_t i = 0; i != MAX; ++i)
 		{
 			q.enqueue(num);
 			++num;
 		}
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 
 		int temp = -1;
 		q.try_dequeue(temp);
@@ -285,7 +640,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		int element = -1;
 		int total = 0;
 		num = 0;
-		start = getSystemTime();
+		start = beginMeasurement();
 		for (counter_t i = 0; i != MAX; ++i)
 		{
 			bool success = q.try_dequeue(element);
@@ -293,7 +648,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 			UNUSED(success);
 			total += element;
 		}
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		assert(!q.try_dequeue(element));
 		forceNoOptimizeDummy = total;
 	}
@@ -304,7 +659,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		out_Ops = MAX;
 		TQueue q(MAX);
 		int total = 0;
-		start = getSystemTime();
+		start = beginMeasurement();
 		SimpleThread consumer([&]()
 							  {
 								  int element;
@@ -330,7 +685,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 							  });
 		producer.join();
 		consumer.join();
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = total;
 	}
 	break;
@@ -343,7 +698,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		TQueue q(MAX);
 		int num = 0;
 		int element = -1;
-		start = getSystemTime();
+		start = beginMeasurement();
 		for (counter_t i = 0; i != MAX; ++i)
 		{
 			if (rand(rng) == 1)
@@ -356,7 +711,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 				q.try_dequeue(element);
 			}
 		}
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = (int)(q.try_dequeue(element));
 	}
 	break;
@@ -369,7 +724,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		std::uniform_int_distribution<int> rand(0, 3);
 		TQueue q(MAX);
 		int element = -1;
-		start = getSystemTime();
+		start = beginMeasurement();
 		SimpleThread consumer([&]()
 							  {
 								  for (counter_t i = 0; i != MAX / 10; ++i)
@@ -392,7 +747,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 							  });
 		producer.join();
 		consumer.join();
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = (int)(q.try_dequeue(element));
 		out_Ops += readOps;
 	}
@@ -406,7 +761,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		std::uniform_int_distribution<int> rand(0, 3);
 		TQueue q(MAX);
 		int element = -1;
-		start = getSystemTime();
+		start = beginMeasurement();
 		SimpleThread consumer([&]()
 							  {
 								  for (counter_t i = 0; i != MAX; ++i)
@@ -429,7 +784,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 							  });
 		producer.join();
 		consumer.join();
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = (int)(q.try_dequeue(element));
 		out_Ops += writeOps;
 	}
@@ -440,7 +795,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		out_Ops = MAX * 2;
 		TQueue q(MAX);
 		int element = -1;
-		start = getSystemTime();
+		start = beginMeasurement();
 		SimpleThread consumer([&]()
 							  {
 								  for (counter_t i = 0; i != MAX; ++i)
@@ -459,7 +814,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 							  });
 		producer.join();
 		consumer.join();
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = (int)(q.try_dequeue(element));
 	}
 	break;
@@ -469,7 +824,7 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 		int readOps = 0, writeOps = 0;
 		TQueue q(MAX);
 		int element = -1;
-		start = getSystemTime();
+		start = beginMeasurement();
 		SimpleThread consumer([&]()
 							  {
 								  RNG_t rng(randomSeed);
@@ -500,11 +855,48 @@ double runBenchmark(BenchmarkType benchmark, unsigned int randomSeed, double &ou
 							  });
 		producer.join();
 		consumer.join();
-		result = getTimeDelta(start);
+		result = endMeasurement(start);
 		forceNoOptimizeDummy = (int)(q.try_dequeue(element));
 		out_Ops = readOps + writeOps;
 	}
 	break;
+	case bench_blocking_dequeue:
+	{
+		// The consumer waits for every element; the producer yields now and then so
+		// that the consumer regularly finds the queue empty and has to block (or poll)
+		const counter_t MAX = 500 * 1000;
+		out_Ops = MAX * 2;
+		TQueue q(MAX);
+		int total = 0;
+		start = beginMeasurement();
+		SimpleThread consumer([&]()
+							  {
+								  int element = -1;
+								  for (counter_t i = 0; i != MAX; ++i)
+								  {
+									  waitDequeue(q, element, 0);
+									  total += element;
+								  }
+							  });
+		SimpleThread producer([&]()
+							  {
+								  int num = 0;
+								  for (counter_t i = 0; i != MAX; ++i)
+								  {
+									  q.enqueue(num);
+									  ++num;
+									  if ((i & 1023) == 0)
+									  {
+										  std::this_thread::yield();
+									  }
+								  }
+							  });
+		producer.join();
+		consumer.join();
+		result = endMeasurement(start);
+		forceNoOptimizeDummy = total;
+	}
+	break;
 	default:
 		assert(false);
 		out_Ops = 0;
@@ -535,6 +927,35 @@ const char *benchmarkName(BenchmarkType benchmark)
 		return "Heavy concurrent";
 	case bench_random_concurrent:
 		return "Random concurrent";
+	case bench_blocking_dequeue:
+		return "Blocking dequeue";
+	default:
+		return "";
+	}
+}
+
+const char *benchmarkId(BenchmarkType benchmark)
+{
+	switch (benchmark)
+	{
+	case bench_raw_add:
+		return "raw_add";
+	case bench_raw_remove:
+		return "raw_remove";
+	case bench_empty_remove:
+		return "empty_remove";
+	case bench_single_threaded:
+		return "single_threaded";
+	case bench_mostly_add:
+		return "mostly_add";
+	case bench_mostly_remove:
+		return "mostly_remove";
+	case bench_heavy_concurrent:
+		return "heavy_concurrent";
+	case bench_random_concurrent:
+		return "random_concurrent";
+	case bench_blocking_dequeue:
+		return "blocking_dequeue";
 	default:
 		return "";
 	}
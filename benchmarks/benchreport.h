@@ -0,0 +1,694 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Machine-readable (JSON/CSV) benchmark results, plus a comparison mode that
+// flags statistically significant regressions between two result files.
+// Header-only so that it can be dropped into the existing benchmark projects.
+
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+
+#ifndef BENCH_COMPILER_FLAGS
+#define BENCH_COMPILER_FLAGS "unknown"
+#endif
+
+namespace benchreport
+{
+	// One timed run of one benchmark on one queue. `metrics` holds any additional
+	// per-run measurements (named, in insertion order) beyond time and op count.
+	struct Run
+	{
+		std::string benchmark;
+		std::string queue;
+		int run;
+		double seconds;
+		double ops;
+		std::vector<std::pair<std::string, double>> metrics;
+
+		Run() : run(0), seconds(0), ops(0) {}
+
+		double opsPerSec() const { return seconds > 0 ? ops / seconds : 0; }
+	};
+
+	// Describes the machine and build that produced a set of results
+	struct Environment
+	{
+		std::string compiler;
+		std::string flags;
+		std::string cpu;
+		unsigned int hardwareThreads;
+		std::string timestamp;
+		bool assertions;
+
+		Environment() : hardwareThreads(0), assertions(false) {}
+	};
+
+	inline Environment currentEnvironment()
+	{
+		Environment env;
+#if defined(__clang__)
+		env.compiler = std::string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+		env.compiler = std::string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+		env.compiler = "msvc " + std::to_string(_MSC_FULL_VER);
+#else
+		env.compiler = "unknown";
+#endif
+		env.flags = BENCH_COMPILER_FLAGS;
+#ifdef NDEBUG
+		env.assertions = false;
+#else
+		env.assertions = true;
+#endif
+		env.cpu = "unknown";
+#if defined(__linux__)
+		std::ifstream cpuinfo("/proc/cpuinfo");
+		std::string line;
+		while (std::getline(cpuinfo, line))
+		{
+			if (line.compare(0, 10, "model name") == 0 || line.compare(0, 9, "Processor") == 0)
+			{
+				auto colon = line.find(':');
+				if (colon != std::string::npos)
+				{
+					env.cpu = line.substr(line.find_first_not_of(" \t", colon + 1));
+					break;
+				}
+			}
+		}
+#endif
+		env.hardwareThreads = std::thread::hardware_concurrency();
+
+		char buf[32];
+		std::time_t now = std::time(nullptr);
+		std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+		env.timestamp = buf;
+		return env;
+	}
+
+	//////// Statistics ////////
+
+	struct Summary
+	{
+		std::size_t count;
+		double mean;
+		double stddev; // sample standard deviation (0 if fewer than two samples)
+
+		Summary() : count(0), mean(0), stddev(0) {}
+	};
+
+	inline Summary summarize(std::vector<double> const &samples)
+	{
+		Summary s;
+		s.count = samples.size();
+		if (s.count == 0)
+			return s;
+		for (double x : samples)
+			s.mean += x;
+		s.mean /= s.count;
+		if (s.count > 1)
+		{
+			double sq = 0;
+			for (double x : samples)
+				sq += (x - s.mean) * (x - s.mean);
+			s.stddev = std::sqrt(sq / (s.count - 1));
+		}
+		return s;
+	}
+
+	// Two-sided 95% critical value of Student's t distribution
+	inline double tCritical95(double df)
+	{
+		static const double table[] = {
+			12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+			2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+			2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+		if (df < 1)
+			df = 1;
+		if (df <= 30)
+			return table[static_cast<int>(df) - 1]; // round df down (conservative)
+
+		// Cornish-Fisher expansion around the normal quantile
+		const double z = 1.959964;
+		double z3 = z * z * z, z5 = z3 * z * z, z7 = z5 * z * z;
+		return z + (z3 + z) / (4 * df) + (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df) + (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * df * df * df);
+	}
+
+	// Welch's unequal-variance t-test. Returns true if the means differ at the 95% level.
+	inline bool significantlyDifferent(Summary const &a, Summary const &b)
+	{
+		if (a.count < 2 || b.count < 2)
+			return false;
+		double va = a.stddev * a.stddev / a.count;
+		double vb = b.stddev * b.stddev / b.count;
+		if (va + vb == 0)
+			return a.mean != b.mean;
+		double t = (a.mean - b.mean) / std::sqrt(va + vb);
+		double df = (va + vb) * (va + vb) / (va * va / (a.count - 1) + vb * vb / (b.count - 1));
+		return std::fabs(t) > tCritical95(df);
+	}
+
+	//////// Writers ////////
+
+	inline std::string jsonEscape(std::string const &s)
+	{
+		std::string out;
+		for (char c : s)
+		{
+			switch (c)
+			{
+			case '"':
+				out += "\\\"";
+				break;
+			case '\\':
+				out += "\\\\";
+				break;
+			case '\n':
+				out += "\\n";
+				break;
+			case '\t':
+				out += "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char buf[8];
+					std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+					out += buf;
+				}
+				else
+				{
+					out += c;
+				}
+			}
+		}
+		return out;
+	}
+
+	inline std::string formatNumber(double x)
+	{
+		if (!(x == x) || std::isinf(x))
+			return "0"; // JSON has no NaN/Inf
+		char buf[32];
+		std::snprintf(buf, sizeof(buf), "%.9g", x);
+		return buf;
+	}
+
+	inline void writeJson(std::ostream &out, Environment const &env, std::vector<Run> const &runs)
+	{
+		out << "{\n";
+		out << "  \"environment\": {\n";
+		out << "    \"compiler\": \"" << jsonEscape(env.compiler) << "\",\n";
+		out << "    \"flags\": \"" << jsonEscape(env.flags) << "\",\n";
+		out << "    \"assertions\": " << (env.assertions ? "true" : "false") << ",\n";
+		out << "    \"cpu\": \"" << jsonEscape(env.cpu) << "\",\n";
+		out << "    \"hardware_threads\": " << env.hardwareThreads << ",\n";
+		out << "    \"timestamp\": \"" << jsonEscape(env.timestamp) << "\"\n";
+		out << "  },\n";
+
+		out << "  \"runs\": [";
+		for (std::size_t i = 0; i != runs.size(); ++i)
+		{
+			Run const &r = runs[i];
+			out << (i == 0 ? "\n" : ",\n");
+			out << "    {\"benchmark\": \"" << jsonEscape(r.benchmark) << "\", \"queue\": \"" << jsonEscape(r.queue)
+				<< "\", \"run\": " << r.run << ", \"seconds\": " << formatNumber(r.seconds)
+				<< ", \"ops\": " << formatNumber(r.ops) << ", \"ops_per_sec\": " << formatNumber(r.opsPerSec());
+			if (!r.metrics.empty())
+			{
+				out << ", \"metrics\": {";
+				for (std::size_t m = 0; m != r.metrics.size(); ++m)
+					out << (m == 0 ? "" : ", ") << "\"" << jsonEscape(r.metrics[m].first) << "\": " << formatNumber(r.metrics[m].second);
+				out << "}";
+			}
+			out << "}";
+		}
+		out << "\n  ],\n";
+
+		// Per benchmark/queue summary, in order of first appearance
+		std::vector<std::pair<std::string, std::string>> keys;
+		std::map<std::pair<std::string, std::string>, std::vector<double>> samples;
+		for (Run const &r : runs)
+		{
+			auto key = std::make_pair(r.benchmark, r.queue);
+			if (samples.find(key) == samples.end())
+				keys.push_back(key);
+			samples[key].push_back(r.opsPerSec());
+		}
+		out << "  \"summary\": [";
+		for (std::size_t i = 0; i != keys.size(); ++i)
+		{
+			Summary s = summarize(samples[keys[i]]);
+			out << (i == 0 ? "\n" : ",\n");
+			out << "    {\"benchmark\": \"" << jsonEscape(keys[i].first) << "\", \"queue\": \"" << jsonEscape(keys[i].second)
+				<< "\", \"runs\": " << s.count << ", \"ops_per_sec_mean\": " << formatNumber(s.mean)
+				<< ", \"ops_per_sec_stddev\": " << formatNumber(s.stddev) << "}";
+		}
+		out << "\n  ]\n}\n";
+	}
+
+	inline void writeCsv(std::ostream &out, Environment const &env, std::vector<Run> const &runs)
+	{
+		// Environment goes in comment lines so the body stays a plain table
+		out << "# compiler: " << env.compiler << "\n";
+		out << "# flags: " << env.flags << "\n";
+		out << "# assertions: " << (env.assertions ? "true" : "false") << "\n";
+		out << "# cpu: " << env.cpu << "\n";
+		out << "# hardware_threads: " << env.hardwareThreads << "\n";
+		out << "# timestamp: " << env.timestamp << "\n";
+		out << "benchmark,queue,run,seconds,ops,ops_per_sec,metrics\n";
+		for (Run const &r : runs)
+		{
+			out << r.benchmark << "," << r.queue << "," << r.run << "," << formatNumber(r.seconds) << ","
+				<< formatNumber(r.ops) << "," << formatNumber(r.opsPerSec()) << ",";
+			for (std::size_t m = 0; m != r.metrics.size(); ++m)
+				out << (m == 0 ? "" : ";") << r.metrics[m].first << "=" << formatNumber(r.metrics[m].second);
+			out << "\n";
+		}
+	}
+
+	//////// Readers ////////
+
+	namespace details
+	{
+		// Just enough of a JSON reader to load back what writeJson() produces
+		// (objects, arrays, strings, numbers, booleans and null).
+		struct JsonValue
+		{
+			enum Type
+			{
+				Null,
+				Bool,
+				Number,
+				String,
+				Array,
+				Object
+			};
+
+			Type type;
+			double number;
+			std::string string;
+			std::vector<JsonValue> array;
+			std::vector<std::pair<std::string, JsonValue>> object;
+
+			JsonValue() : type(Null), number(0) {}
+
+			JsonValue const *get(char const *key) const
+			{
+				for (auto const &kv : object)
+				{
+					if (kv.first == key)
+						return &kv.second;
+				}
+				return nullptr;
+			}
+		};
+
+		class JsonParser
+		{
+		public:
+			explicit JsonParser(std::string const &text) : s(text), pos(0) {}
+
+			bool parse(JsonValue &out)
+			{
+				return value(out) && (skipSpace(), pos == s.size());
+			}
+
+		private:
+			void skipSpace()
+			{
+				while (pos < s.size() && std::isspace(static_cast<unsigned char>(s[pos])))
+					++pos;
+			}
+
+			bool literal(char const *word)
+			{
+				std::size_t len = std::strlen(word);
+				if (s.compare(pos, len, word) != 0)
+					return false;
+				pos += len;
+				return true;
+			}
+
+			bool str(std::string &out)
+			{
+				if (s[pos] != '"')
+					return false;
+				for (++pos; pos < s.size(); ++pos)
+				{
+					char c = s[pos];
+					if (c == '"')
+					{
+						++pos;
+						return true;
+					}
+					if (c == '\\' && pos + 1 < s.size())
+					{
+						c = s[++pos];
+						switch (c)
+						{
+						case 'n':
+							out += '\n';
+							break;
+						case 't':
+							out += '\t';
+							break;
+						case 'u':
+							if (pos + 4 >= s.size())
+								return false;
+							out += static_cast<char>(std::strtol(s.substr(pos + 1, 4).c_str(), nullptr, 16));
+							pos += 4;
+							break;
+						default:
+							out += c;
+						}
+					}
+					else
+					{
+						out += c;
+					}
+				}
+				return false;
+			}
+
+			bool value(JsonValue &out)
+			{
+				skipSpace();
+				if (pos >= s.size())
+					return false;
+				char c = s[pos];
+				if (c == '{')
+				{
+					out.type = JsonValue::Object;
+					++pos;
+					skipSpace();
+					if (pos < s.size() && s[pos] == '}')
+						return ++pos, true;
+					while (true)
+					{
+						skipSpace();
+						std::pair<std::string, JsonValue> kv;
+						if (pos >= s.size() || !str(kv.first))
+							return false;
+						skipSpace();
+						if (pos >= s.size() || s[pos++] != ':' || !value(kv.second))
+							return false;
+						out.object.push_back(std::move(kv));
+						skipSpace();
+						if (pos >= s.size())
+							return false;
+						if (s[pos] == '}')
+							return ++pos, true;
+						if (s[pos++] != ',')
+							return false;
+					}
+				}
+				if (c == '[')
+				{
+					out.type = JsonValue::Array;
+					++pos;
+					skipSpace();
+					if (pos < s.size() && s[pos] == ']')
+						return ++pos, true;
+					while (true)
+					{
+						out.array.push_back(JsonValue());
+						if (!value(out.array.back()))
+							return false;
+						skipSpace();
+						if (pos >= s.size())
+							return false;
+						if (s[pos] == ']')
+							return ++pos, true;
+						if (s[pos++] != ',')
+							return false;
+					}
+				}
+				if (c == '"')
+				{
+					out.type = JsonValue::String;
+					return str(out.string);
+				}
+				if (literal("true"))
+				{
+					out.type = JsonValue::Bool;
+					out.number = 1;
+					return true;
+				}
+				if (literal("false"))
+				{
+					out.type = JsonValue::Bool;
+					return true;
+				}
+				if (literal("null"))
+					return true;
+
+				char const *begin = s.c_str() + pos;
+				char *end;
+				out.type = JsonValue::Number;
+				out.number = std::strtod(begin, &end);
+				if (end == begin)
+					return false;
+				pos += static_cast<std::size_t>(end - begin);
+				return true;
+			}
+
+		private:
+			std::string const &s;
+			std::size_t pos;
+		};
+
+		inline std::vector<std::string> splitString(std::string const &s, char sep)
+		{
+			std::vector<std::string> parts;
+			std::string::size_type start = 0, end;
+			while ((end = s.find(sep, start)) != std::string::npos)
+			{
+				parts.push_back(s.substr(start, end - start));
+				start = end + 1;
+			}
+			parts.push_back(s.substr(start));
+			return parts;
+		}
+
+		inline bool readJson(std::string const &text, std::vector<Run> &runs, std::string &error)
+		{
+			JsonValue root;
+			if (!JsonParser(text).parse(root) || root.type != JsonValue::Object)
+			{
+				error = "malformed JSON";
+				return false;
+			}
+			JsonValue const *list = root.get("runs");
+			if (list == nullptr || list->type != JsonValue::Array)
+			{
+				error = "no \"runs\" array";
+				return false;
+			}
+			for (JsonValue const &item : list->array)
+			{
+				JsonValue const *benchmark = item.get("benchmark");
+				JsonValue const *queue = item.get("queue");
+				JsonValue const *seconds = item.get("seconds");
+				JsonValue const *ops = item.get("ops");
+				if (benchmark == nullptr || queue == nullptr || seconds == nullptr || ops == nullptr)
+				{
+					error = "run entry is missing benchmark/queue/seconds/ops";
+					return false;
+				}
+				Run r;
+				r.benchmark = benchmark->string;
+				r.queue = queue->string;
+				r.seconds = seconds->number;
+				r.ops = ops->number;
+				if (JsonValue const *run = item.get("run"))
+					r.run = static_cast<int>(run->number);
+				if (JsonValue const *metrics = item.get("metrics"))
+				{
+					for (auto const &kv : metrics->object)
+						r.metrics.push_back(std::make_pair(kv.first, kv.second.number));
+				}
+				runs.push_back(r);
+			}
+			return true;
+		}
+
+		inline bool readCsv(std::string const &text, std::vector<Run> &runs, std::string &error)
+		{
+			std::istringstream in(text);
+			std::string line;
+			std::vector<std::string> columns;
+			while (std::getline(in, line))
+			{
+				if (!line.empty() && line[line.size() - 1] == '\r')
+					line.erase(line.size() - 1);
+				if (line.empty() || line[0] == '#')
+					continue;
+				std::vector<std::string> fields = splitString(line, ',');
+				if (columns.empty())
+				{
+					columns = fields;
+					continue;
+				}
+				Run r;
+				for (std::size_t i = 0; i != fields.size() && i != columns.size(); ++i)
+				{
+					std::string const &col = columns[i];
+					if (col == "benchmark")
+						r.benchmark = fields[i];
+					else if (col == "queue")
+						r.queue = fields[i];
+					else if (col == "run")
+						r.run = std::atoi(fields[i].c_str());
+					else if (col == "seconds")
+						r.seconds = std::strtod(fields[i].c_str(), nullptr);
+					else if (col == "ops")
+						r.ops = std::strtod(fields[i].c_str(), nullptr);
+					else if (col == "metrics" && !fields[i].empty())
+					{
+						for (std::string const &m : splitString(fields[i], ';'))
+						{
+							auto eq = m.find('=');
+							if (eq != std::string::npos)
+								r.metrics.push_back(std::make_pair(m.substr(0, eq), std::strtod(m.c_str() + eq + 1, nullptr)));
+						}
+					}
+				}
+				if (r.benchmark.empty() || r.queue.empty())
+				{
+					error = "CSV row is missing benchmark/queue";
+					return false;
+				}
+				runs.push_back(r);
+			}
+			if (columns.empty())
+			{
+				error = "no CSV header row";
+				return false;
+			}
+			return true;
+		}
+	}
+
+	// Loads results written by writeJson() or writeCsv() (the format is detected
+	// from the content). Returns false and sets `error` on failure.
+	inline bool readResults(char const *path, std::vector<Run> &runs, std::string &error)
+	{
+		std::ifstream in(path, std::ios::binary);
+		if (!in)
+		{
+			error = "cannot open file";
+			return false;
+		}
+		std::stringstream buf;
+		buf << in.rdbuf();
+		std::string text = buf.str();
+		std::string::size_type first = text.find_first_not_of(" \t\r\n");
+		if (first != std::string::npos && text[first] == '{')
+			return details::readJson(text, runs, error);
+		return details::readCsv(text, runs, error);
+	}
+
+	//////// Comparison ////////
+
+	// Compares candidate results against a baseline, benchmark by benchmark and
+	// queue by queue, using the per-run ops/sec. A difference is only reported as
+	// a regression (or improvement) when it exceeds `thresholdPercent` *and* is
+	// statistically significant (Welch's t-test, 95%). When either side has fewer
+	// than two runs, significance can't be established and the threshold alone decides.
+	// Returns the number of regressions found.
+	inline int compareResults(std::vector<Run> const &baseline, std::vector<Run> const &candidate, double thresholdPercent, std::ostream &out)
+	{
+		typedef std::pair<std::string, std::string> Key;
+		std::vector<Key> keys;
+		std::map<Key, std::vector<double>> base, cand;
+		for (Run const &r : baseline)
+		{
+			Key key(r.benchmark, r.queue);
+			if (base.find(key) == base.end())
+				keys.push_back(key);
+			base[key].push_back(r.opsPerSec());
+		}
+		for (Run const &r : candidate)
+			cand[Key(r.benchmark, r.queue)].push_back(r.opsPerSec());
+
+		const int NAME_WIDTH = 24;
+		out << std::left << std::setw(NAME_WIDTH) << "Benchmark" << " " << std::setw(8) << "Queue"
+			<< std::right << " " << std::setw(17) << "Base Mops/s" << " " << std::setw(17) << "New Mops/s"
+			<< " " << std::setw(9) << "Delta" << "  Verdict\n";
+
+		int regressions = 0, improvements = 0, compared = 0;
+		for (Key const &key : keys)
+		{
+			auto it = cand.find(key);
+			if (it == cand.end())
+			{
+				out << std::left << std::setw(NAME_WIDTH) << key.first << " " << std::setw(8) << key.second << std::right
+					<< "  (missing from new results)\n";
+				continue;
+			}
+			Summary b = summarize(base[key]);
+			Summary c = summarize(it->second);
+			double delta = b.mean == 0 ? 0 : (c.mean - b.mean) / b.mean * 100;
+			bool enoughRuns = b.count >= 2 && c.count >= 2;
+			bool significant = enoughRuns ? significantlyDifferent(b, c) : true;
+			char const *verdict = "ok";
+			if (std::fabs(delta) > thresholdPercent && significant)
+			{
+				if (delta < 0)
+				{
+					verdict = "REGRESSION";
+					++regressions;
+				}
+				else
+				{
+					verdict = "improved";
+					++improvements;
+				}
+			}
+			else if (std::fabs(delta) > thresholdPercent)
+			{
+				verdict = "ok (noise)";
+			}
+			++compared;
+
+			std::ostringstream d;
+			d << std::showpos << std::fixed << std::setprecision(1) << delta << "%";
+			out << std::left << std::setw(NAME_WIDTH) << key.first << " " << std::setw(8) << key.second << std::right
+				<< std::fixed << std::setprecision(2)
+				<< " " << std::setw(7) << b.mean / 1000000 << " +/-" << std::setw(6) << b.stddev / 1000000
+				<< " " << std::setw(7) << c.mean / 1000000 << " +/-" << std::setw(6) << c.stddev / 1000000
+				<< " " << std::setw(9) << d.str() << "  " << verdict << (enoughRuns ? "" : " (n<2)") << "\n";
+		}
+		for (auto const &kv : cand)
+		{
+			if (base.find(kv.first) == base.end())
+			{
+				out << std::left << std::setw(NAME_WIDTH) << kv.first.first << " " << std::setw(8) << kv.first.second << std::right
+					<< "  (new, no baseline)\n";
+			}
+		}
+
+		out << std::defaultfloat << "\n"
+			<< compared << " compared, " << regressions << " regression(s), " << improvements << " improvement(s)"
+			<< " (threshold " << thresholdPercent << "%, 95% confidence)\n";
+		return regressions;
+	}
+}
@@ -0,0 +1,462 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Bursty-traffic scenarios for moodycamel::ReaderWriterQueue and friends.
+// Unlike bench.cpp, which measures raw throughput under uniform load, these model
+// the conditions that make a queue grow or a consumer go to sleep: on/off bursts,
+// Poisson arrivals, and a consumer that can't keep up. Besides throughput, each run
+// reports how far the queue grew, how many blocks it had to allocate, how much
+// resident memory that cost, and how long a consumer took to pick up an element
+// that arrived after the queue had been idle.
+
+#include "../readerwriterqueue.h"
+#include "../readerwritercircularbuffer.h"
+#include "benchreport.h"
+#include "../tests/common/simplethread.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+using namespace moodycamel;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline std::int64_t nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	// Resident set size of the process, in bytes (0 where unsupported)
+	std::size_t residentBytes()
+	{
+#if defined(__linux__)
+		std::ifstream statm("/proc/self/statm");
+		std::size_t size = 0, resident = 0;
+		if (statm >> size >> resident)
+			return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+		return 0;
+	}
+
+	struct Msg
+	{
+		std::uint64_t seq;
+		std::int64_t sentNs;
+		bool afterIdle; // the producer had been idle for a while before sending this one
+
+		Msg() : seq(0), sentNs(0), afterIdle(false) {}
+	};
+
+	// A gap between two enqueues at least this long counts as the queue going idle
+	const std::int64_t IDLE_GAP_NS = 50 * 1000;
+
+	//////// Queue adapters ////////
+	// Each exposes produce()/consume() plus the statistics the scenarios report.
+
+	template <typename TQueue>
+	class GrowableAdapter
+	{
+	public:
+		explicit GrowableAdapter(std::size_t size) : allocations(0), q(size) {}
+
+		void produce(Msg const &m)
+		{
+			if (!q.try_enqueue(m))
+			{
+				// Slow path only: find out whether enqueue() had to allocate a block
+				std::size_t cap = q.max_capacity();
+				q.enqueue(m);
+				if (q.max_capacity() != cap)
+					++allocations;
+			}
+		}
+
+		void consume(Msg &m) { consumeFrom(q, m); }
+		std::size_t size() const { return q.size_approx(); }
+		std::size_t capacity() const { return q.max_capacity(); }
+
+		std::size_t allocations;
+
+	private:
+		static void consumeFrom(ReaderWriterQueue<Msg> &q, Msg &m)
+		{
+			while (!q.try_dequeue(m))
+				continue;
+		}
+
+		static void consumeFrom(BlockingReaderWriterQueue<Msg> &q, Msg &m)
+		{
+			q.wait_dequeue(m);
+		}
+
+	private:
+		TQueue q;
+	};
+
+	// Fixed capacity: a full buffer blocks the producer instead of growing
+	class CircularAdapter
+	{
+	public:
+		explicit CircularAdapter(std::size_t size) : allocations(0), q(size) {}
+
+		void produce(Msg const &m) { q.wait_enqueue(m); }
+		void consume(Msg &m) { q.wait_dequeue(m); }
+		std::size_t size() const { return q.size_approx(); }
+		std::size_t capacity() const { return q.max_capacity(); }
+
+		std::size_t allocations;
+
+	private:
+		BlockingReaderWriterCircularBuffer<Msg> q;
+	};
+
+	//////// Scenarios ////////
+
+	enum ScenarioType
+	{
+		scenario_onoff_burst,     // bursts enqueued as fast as possible, separated by idle periods
+		scenario_poisson,         // exponentially distributed inter-arrival times
+		scenario_slow_consumer,   // full-speed producer, consumer does extra work per element
+
+		SCENARIO_COUNT
+	};
+
+	const char *scenarioId(ScenarioType scenario)
+	{
+		switch (scenario)
+		{
+		case scenario_onoff_burst:
+			return "onoff_burst";
+		case scenario_poisson:
+			return "poisson";
+		case scenario_slow_consumer:
+			return "slow_consumer";
+		default:
+			return "";
+		}
+	}
+
+	struct Parameters
+	{
+		double scale;             // multiplies all element counts
+		std::size_t initialSize;  // initial queue capacity
+		unsigned int seed;
+	};
+
+	double percentile(std::vector<double> &v, double p)
+	{
+		if (v.empty())
+			return 0;
+		std::size_t i = static_cast<std::size_t>(p / 100 * (v.size() - 1) + 0.5);
+		std::nth_element(v.begin(), v.begin() + i, v.end());
+		return v[i];
+	}
+
+	inline void spinUntil(std::int64_t deadlineNs)
+	{
+		while (nowNs() < deadlineNs)
+			continue;
+	}
+
+	template <typename TAdapter>
+	benchreport::Run runScenario(ScenarioType scenario, Parameters const &params)
+	{
+		// Scenario shapes
+		const std::size_t BURSTS = 20;
+		const std::size_t BURST_SIZE = std::max<std::size_t>(1, static_cast<std::size_t>(50000 * params.scale));
+		const int BURST_IDLE_MS = 5;
+		const std::size_t POISSON_COUNT = std::max<std::size_t>(1, static_cast<std::size_t>(50000 * params.scale));
+		const double POISSON_MEAN_GAP_NS = 10000;
+		const std::size_t SLOW_COUNT = std::max<std::size_t>(1, static_cast<std::size_t>(500000 * params.scale));
+		const int SLOW_WORK = 64; // spin iterations per element on the consumer side
+
+		std::size_t total = 0;
+		switch (scenario)
+		{
+		case scenario_onoff_burst:
+			total = BURSTS * BURST_SIZE;
+			break;
+		case scenario_poisson:
+			total = POISSON_COUNT;
+			break;
+		case scenario_slow_consumer:
+			total = SLOW_COUNT;
+			break;
+		default:
+			assert(false);
+		}
+
+		std::vector<double> latencies, wakeLatencies;
+		latencies.reserve(total);
+		wakeLatencies.reserve(total / 16 + BURSTS);
+		std::size_t peakSize = 0;
+		bool ordered = true;
+
+		std::size_t rssBefore = residentBytes();
+		// Held by value: the queues are cache-line aligned, which a plain new doesn't honour before C++17
+		TAdapter adapter(params.initialSize);
+		TAdapter *q = &adapter;
+		std::size_t initialCapacity = q->capacity();
+
+		std::int64_t start = nowNs();
+		SimpleThread consumer([&]()
+							  {
+								  Msg m;
+								  volatile int work = 0;
+								  for (std::size_t i = 0; i != total; ++i)
+								  {
+									  q->consume(m);
+									  std::int64_t latency = nowNs() - m.sentNs;
+									  latencies.push_back(latency / 1000.0);
+									  if (m.afterIdle)
+										  wakeLatencies.push_back(latency / 1000.0);
+									  if (m.seq != i)
+										  ordered = false;
+									  if (scenario == scenario_slow_consumer)
+									  {
+										  for (int w = 0; w != SLOW_WORK; ++w)
+											  work = work + 1;
+									  }
+								  }
+							  });
+		SimpleThread producer([&]()
+							  {
+								  std::mt19937 rng(params.seed);
+								  std::exponential_distribution<double> gap(1.0 / POISSON_MEAN_GAP_NS);
+								  std::int64_t last = nowNs();
+								  std::int64_t nextArrival = last;
+								  for (std::size_t i = 0; i != total; ++i)
+								  {
+									  if (scenario == scenario_onoff_burst && i != 0 && i % BURST_SIZE == 0)
+									  {
+										  std::this_thread::sleep_for(std::chrono::milliseconds(BURST_IDLE_MS));
+									  }
+									  else if (scenario == scenario_poisson)
+									  {
+										  nextArrival += static_cast<std::int64_t>(gap(rng));
+										  spinUntil(nextArrival);
+									  }
+									  Msg m;
+									  m.seq = i;
+									  m.sentNs = nowNs();
+									  m.afterIdle = m.sentNs - last >= IDLE_GAP_NS;
+									  q->produce(m);
+									  last = nowNs(); // time spent blocked on a full queue isn't idle time
+									  if ((i & 255) == 0)
+										  peakSize = std::max(peakSize, q->size());
+								  }
+							  });
+		producer.join();
+		consumer.join();
+		double seconds = (nowNs() - start) / 1e9;
+
+		benchreport::Run run;
+		run.benchmark = scenarioId(scenario);
+		run.seconds = seconds;
+		run.ops = static_cast<double>(total);
+		run.metrics.push_back(std::make_pair("peak_size", static_cast<double>(peakSize)));
+		run.metrics.push_back(std::make_pair("capacity_growth", static_cast<double>(q->capacity() - initialCapacity)));
+		run.metrics.push_back(std::make_pair("block_allocations", static_cast<double>(q->allocations)));
+		run.metrics.push_back(std::make_pair("rss_growth_kb", (static_cast<double>(residentBytes()) - static_cast<double>(rssBefore)) / 1024));
+		run.metrics.push_back(std::make_pair("latency_p50_us", percentile(latencies, 50)));
+		run.metrics.push_back(std::make_pair("latency_p99_us", percentile(latencies, 99)));
+		run.metrics.push_back(std::make_pair("wakeups", static_cast<double>(wakeLatencies.size())));
+		run.metrics.push_back(std::make_pair("wake_p50_us", percentile(wakeLatencies, 50)));
+		run.metrics.push_back(std::make_pair("wake_p99_us", percentile(wakeLatencies, 99)));
+		run.metrics.push_back(std::make_pair("wake_max_us", wakeLatencies.empty() ? 0 : *std::max_element(wakeLatencies.begin(), wakeLatencies.end())));
+		if (!ordered)
+			std::fprintf(stderr, "ERROR: %s elements were dequeued out of order\n", run.benchmark.c_str());
+		return run;
+	}
+
+	typedef benchreport::Run (*ScenarioRunner)(ScenarioType scenario, Parameters const &params);
+
+	struct QueueUnderTest
+	{
+		const char *shortName;
+		ScenarioRunner run;
+	};
+
+	double metric(benchreport::Run const &run, const char *name)
+	{
+		for (auto const &m : run.metrics)
+		{
+			if (m.first == name)
+				return m.second;
+		}
+		return 0;
+	}
+
+	void printUsage(const char *progName)
+	{
+		std::printf("%s\n    Description: Bursty-traffic benchmarks for moodycamel::ReaderWriterQueue\n", progName);
+		std::printf("    --help                    Prints this help blurb\n");
+		std::printf("    --scenario id             Runs only the specified scenario(s):\n");
+		for (int s = 0; s != SCENARIO_COUNT; ++s)
+			std::printf("                                  %s\n", scenarioId((ScenarioType)s));
+		std::printf("    --runs n                  Number of runs per scenario and queue (default: 3)\n");
+		std::printf("    --scale factor            Multiplies the number of elements per scenario (default: 1)\n");
+		std::printf("    --initial-size n          Initial capacity of every queue (default: 1024)\n");
+		std::printf("    --format table|json|csv   Output format (default: table)\n");
+		std::printf("    --output file             Writes results to a file instead of stdout\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string progName = argv[0];
+	auto slash = progName.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		progName = progName.substr(slash + 1);
+	}
+
+	Parameters params;
+	params.scale = 1;
+	params.initialSize = 1024;
+	params.seed = static_cast<unsigned int>(std::time(nullptr));
+	int runCount = 3;
+	std::string format = "table";
+	const char *outputPath = nullptr;
+	std::vector<int> scenarios;
+	for (int i = 1; i < argc; ++i)
+	{
+		bool hasArg = i + 1 < argc;
+		if (std::strcmp(argv[i], "--help") == 0)
+		{
+			printUsage(progName.c_str());
+			return 0;
+		}
+		else if (std::strcmp(argv[i], "--scenario") == 0 && hasArg)
+		{
+			++i;
+			int s = 0;
+			while (s != SCENARIO_COUNT && std::strcmp(argv[i], scenarioId((ScenarioType)s)) != 0)
+				++s;
+			if (s == SCENARIO_COUNT)
+			{
+				std::printf("Unrecognized scenario '%s'.\n\n", argv[i]);
+				printUsage(progName.c_str());
+				return -1;
+			}
+			scenarios.push_back(s);
+		}
+		else if (std::strcmp(argv[i], "--runs") == 0 && hasArg)
+			runCount = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--scale") == 0 && hasArg)
+			params.scale = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--initial-size") == 0 && hasArg)
+			params.initialSize = static_cast<std::size_t>(std::atol(argv[++i]));
+		else if (std::strcmp(argv[i], "--format") == 0 && hasArg && (std::strcmp(argv[i + 1], "table") == 0 || std::strcmp(argv[i + 1], "json") == 0 || std::strcmp(argv[i + 1], "csv") == 0))
+			format = argv[++i];
+		else if (std::strcmp(argv[i], "--output") == 0 && hasArg)
+			outputPath = argv[++i];
+		else
+		{
+			std::printf("Unrecognized option '%s' (or missing/invalid argument).\n\n", argv[i]);
+			printUsage(progName.c_str());
+			return -1;
+		}
+	}
+	if (scenarios.empty())
+	{
+		for (int s = 0; s != SCENARIO_COUNT; ++s)
+			scenarios.push_back(s);
+	}
+
+	QueueUnderTest queues[] = {
+		{"RWQ", &runScenario<GrowableAdapter<ReaderWriterQueue<Msg>>>},
+		{"BRWQ", &runScenario<GrowableAdapter<BlockingReaderWriterQueue<Msg>>>},
+		{"BRWCB", &runScenario<CircularAdapter>},
+	};
+
+	std::ofstream file;
+	if (outputPath != nullptr)
+	{
+		file.open(outputPath);
+		if (!file)
+		{
+			std::fprintf(stderr, "Could not open '%s' for writing\n", outputPath);
+			return 2;
+		}
+	}
+	std::ostream &out = outputPath != nullptr ? file : std::cout;
+
+	if (format == "table")
+	{
+		out << "Metrics are averaged over " << runCount << " run(s); latencies in microseconds\n\n";
+		out << std::left << std::setw(15) << "Scenario" << std::setw(7) << "Queue" << std::right
+			<< std::setw(9) << "Mops/s" << std::setw(10) << "PeakSize" << std::setw(10) << "CapGrowth"
+			<< std::setw(8) << "Blocks" << std::setw(10) << "RSS KB" << std::setw(9) << "Lat p50" << std::setw(9) << "Lat p99"
+			<< std::setw(8) << "Wakes" << std::setw(9) << "Wake p50" << std::setw(9) << "Wake p99" << std::setw(10) << "Wake max" << "\n";
+		out << std::string(123, '-') << "\n";
+	}
+
+	std::vector<benchreport::Run> runs;
+	for (int s : scenarios)
+	{
+		for (auto const &queue : queues)
+		{
+			std::vector<benchreport::Run> these;
+			for (int i = 0; i != runCount; ++i)
+			{
+				Parameters p = params;
+				p.seed = params.seed + static_cast<unsigned int>(i); // same arrivals for every queue
+				benchreport::Run run = queue.run((ScenarioType)s, p);
+				run.queue = queue.shortName;
+				run.run = i;
+				these.push_back(run);
+				runs.push_back(run);
+			}
+
+			if (format == "table")
+			{
+				auto avg = [&](const char *name)
+				{
+					double sum = 0;
+					for (auto const &r : these)
+						sum += metric(r, name);
+					return sum / these.size();
+				};
+				double opsPerSec = 0;
+				for (auto const &r : these)
+					opsPerSec += r.opsPerSec();
+				opsPerSec /= these.size();
+
+				out << std::left << std::setw(15) << scenarioId((ScenarioType)s) << std::setw(7) << queue.shortName << std::right
+					<< std::fixed << std::setprecision(2) << std::setw(9) << opsPerSec / 1000000
+					<< std::setprecision(0) << std::setw(10) << avg("peak_size") << std::setw(10) << avg("capacity_growth")
+					<< std::setw(8) << avg("block_allocations") << std::setw(10) << avg("rss_growth_kb")
+					<< std::setprecision(1) << std::setw(9) << avg("latency_p50_us") << std::setw(9) << avg("latency_p99_us")
+					<< std::setprecision(0) << std::setw(8) << avg("wakeups")
+					<< std::setprecision(1) << std::setw(9) << avg("wake_p50_us") << std::setw(9) << avg("wake_p99_us") << std::setw(10) << avg("wake_max_us")
+					<< std::endl;
+			}
+		}
+	}
+
+	if (format == "json")
+		benchreport::writeJson(out, benchreport::currentEnvironment(), runs);
+	else if (format == "csv")
+		benchreport::writeCsv(out, benchreport::currentEnvironment(), runs);
+	return 0;
+}
@@ -0,0 +1,180 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Shows the effect of MOODYCAMEL_CACHE_LINE_SIZE (the padding between the variables the
+// producer writes and those the consumer writes). The padding is a compile-time
+// setting, so this file is built several times with different values (see the makefile
+// and CMakeLists.txt); compare the output of each build on the same machine. With 32,
+// a block's front and tail indices share a 64-byte cache line; with 64 they share an
+// adjacent-line prefetch pair on many Intel CPUs; with 128 they share neither.
+
+#include "../readerwriterqueue.h"
+#include "benchreport.h"
+#include "../tests/common/simplethread.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+using namespace moodycamel;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	// Busy-waits for a bounded number of attempts before yielding, so that a run doesn't
+	// crawl when the two threads have to share a core
+	template <typename TAttempt>
+	inline void retry(TAttempt attempt)
+	{
+		for (int spins = 0; !attempt(); ++spins)
+		{
+			if (spins >= 1024)
+			{
+				std::this_thread::yield();
+				spins = 0;
+			}
+		}
+	}
+
+	// Producer and consumer stream elements through a queue small enough to stay in
+	// cache, so that the cost is dominated by cache-line transfers between the two
+	// cores, i.e. by what the padding is there to minimize
+	benchreport::Run runStream(std::size_t count, std::size_t capacity)
+	{
+		ReaderWriterQueue<int> q(capacity);
+		Clock::time_point start = Clock::now();
+		long long sum = 0;
+		SimpleThread consumer([&]()
+							  {
+								  int element;
+								  for (std::size_t i = 0; i != count; ++i)
+								  {
+									  retry([&]() { return q.try_dequeue(element); });
+									  sum += element;
+								  }
+							  });
+		SimpleThread producer([&]()
+							  {
+								  for (std::size_t i = 0; i != count; ++i)
+								  {
+									  retry([&]() { return q.try_enqueue(static_cast<int>(i)); });
+								  }
+							  });
+		producer.join();
+		consumer.join();
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		if (sum != static_cast<long long>(count) * (static_cast<long long>(count) - 1) / 2)
+			std::fprintf(stderr, "ERROR: checksum mismatch\n");
+
+		benchreport::Run run;
+		run.benchmark = "stream/capacity:" + std::to_string(capacity);
+		run.queue = "RWQ/line:" + std::to_string(static_cast<unsigned long long>(MOODYCAMEL_CACHE_LINE_SIZE));
+		run.seconds = seconds;
+		run.ops = static_cast<double>(count) * 2;
+		return run;
+	}
+
+	void printUsage(const char *progName)
+	{
+		std::printf("%s\n    Description: Producer/consumer throughput with MOODYCAMEL_CACHE_LINE_SIZE = %d\n", progName, (int)MOODYCAMEL_CACHE_LINE_SIZE);
+		std::printf("    --help                    Prints this help blurb\n");
+		std::printf("    --runs n                  Number of runs per queue capacity (default: 5)\n");
+		std::printf("    --scale factor            Multiplies the number of elements (default: 1)\n");
+		std::printf("    --format table|json|csv   Output format (default: table)\n");
+		std::printf("    --output file             Writes results to a file instead of stdout\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string progName = argv[0];
+	auto slash = progName.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		progName = progName.substr(slash + 1);
+	}
+
+	int runCount = 5;
+	double scale = 1;
+	std::string format = "table";
+	const char *outputPath = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		bool hasArg = i + 1 < argc;
+		if (std::strcmp(argv[i], "--help") == 0)
+		{
+			printUsage(progName.c_str());
+			return 0;
+		}
+		else if (std::strcmp(argv[i], "--runs") == 0 && hasArg)
+			runCount = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--scale") == 0 && hasArg)
+			scale = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--format") == 0 && hasArg && (std::strcmp(argv[i + 1], "table") == 0 || std::strcmp(argv[i + 1], "json") == 0 || std::strcmp(argv[i + 1], "csv") == 0))
+			format = argv[++i];
+		else if (std::strcmp(argv[i], "--output") == 0 && hasArg)
+			outputPath = argv[++i];
+		else
+		{
+			std::printf("Unrecognized option '%s' (or missing/invalid argument).\n\n", argv[i]);
+			printUsage(progName.c_str());
+			return -1;
+		}
+	}
+
+	std::ofstream file;
+	if (outputPath != nullptr)
+	{
+		file.open(outputPath);
+		if (!file)
+		{
+			std::fprintf(stderr, "Could not open '%s' for writing\n", outputPath);
+			return 2;
+		}
+	}
+	std::ostream &out = outputPath != nullptr ? file : std::cout;
+
+	const std::size_t count = std::max<std::size_t>(1, static_cast<std::size_t>(10000000 * scale));
+	const std::size_t capacities[] = {15, 255, 4095};
+	std::vector<benchreport::Run> runs;
+	if (format == "table")
+	{
+		out << "MOODYCAMEL_CACHE_LINE_SIZE = " << MOODYCAMEL_CACHE_LINE_SIZE << "; median of " << runCount << " run(s)\n\n";
+		out << std::left << std::setw(22) << "Benchmark" << std::right << std::setw(12) << "Mops/s" << "\n";
+		out << std::string(34, '-') << "\n";
+	}
+	for (std::size_t capacity : capacities)
+	{
+		std::vector<double> opsPerSec;
+		for (int i = 0; i != runCount; ++i)
+		{
+			benchreport::Run run = runStream(count, capacity);
+			run.run = i;
+			opsPerSec.push_back(run.opsPerSec());
+			runs.push_back(run);
+		}
+		if (format == "table")
+		{
+			std::sort(opsPerSec.begin(), opsPerSec.end());
+			out << std::left << std::setw(22) << runs.back().benchmark << std::right << std::fixed << std::setprecision(2)
+				<< std::setw(12) << opsPerSec[opsPerSec.size() / 2] / 1000000 << std::endl;
+		}
+	}
+
+	if (format == "json")
+		benchreport::writeJson(out, benchreport::currentEnvironment(), runs);
+	else if (format == "csv")
+		benchreport::writeCsv(out, benchreport::currentEnvironment(), runs);
+	return 0;
+}
@@ -0,0 +1,413 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Per-operation microbenchmarks for moodycamel::ReaderWriterQueue, in the style of
+// Google Benchmark: each benchmark is run with a growing number of iterations until
+// it has been timed for at least --min-time seconds, then the cost per operation is
+// reported. Every benchmark is instantiated for several block and element sizes.
+
+#include "../readerwriterqueue.h"
+#include "systemtime.h"
+#include "benchreport.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+using namespace moodycamel;
+
+namespace
+{
+	// An element of (at least) Size bytes; trivially copyable like most message structs
+	template <std::size_t Size>
+	struct Payload
+	{
+		Payload() { bytes[0] = 0; }
+		explicit Payload(std::size_t x) { bytes[0] = static_cast<unsigned char>(x); }
+		unsigned char bytes[Size];
+	};
+
+	volatile unsigned int forceNoOptimizeDummy;
+
+	template <std::size_t Size>
+	AE_FORCEINLINE void consume(Payload<Size> const &p)
+	{
+		forceNoOptimizeDummy = forceNoOptimizeDummy + p.bytes[0];
+	}
+
+	// Operations are timed in batches of (at most) this many elements, so that the
+	// queue never needs to grow while being timed
+	const std::size_t BATCH = 4096;
+
+	// Returns the number of seconds spent in the timed portion of `iterations` operations
+	typedef double (*MicroBenchmark)(std::size_t iterations);
+
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double enqueue_single(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		ReaderWriterQueue<T, BlockSize> q(BATCH);
+		double seconds = 0;
+		for (std::size_t done = 0; done < iterations; done += BATCH)
+		{
+			std::size_t n = std::min(BATCH, iterations - done);
+			SystemTime start = getSystemTime();
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			seconds += getTimeDelta(start) / 1000.0;
+			while (q.pop())
+				continue;
+		}
+		return seconds;
+	}
+
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double dequeue_single(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		ReaderWriterQueue<T, BlockSize> q(BATCH);
+		T item;
+		double seconds = 0;
+		for (std::size_t done = 0; done < iterations; done += BATCH)
+		{
+			std::size_t n = std::min(BATCH, iterations - done);
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			SystemTime start = getSystemTime();
+			for (std::size_t i = 0; i != n; ++i)
+			{
+				q.try_dequeue(item);
+				consume(item);
+			}
+			seconds += getTimeDelta(start) / 1000.0;
+		}
+		return seconds;
+	}
+
+	// Like dequeue_single, but reads each element in place with try_consume
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double consume_single(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		ReaderWriterQueue<T, BlockSize> q(BATCH);
+		double seconds = 0;
+		for (std::size_t done = 0; done < iterations; done += BATCH)
+		{
+			std::size_t n = std::min(BATCH, iterations - done);
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			SystemTime start = getSystemTime();
+			for (std::size_t i = 0; i != n; ++i)
+				q.try_consume([](T &item) { consume(item); });
+			seconds += getTimeDelta(start) / 1000.0;
+		}
+		return seconds;
+	}
+
+	// A run of enqueues followed by a run of dequeues (what a producer and consumer
+	// batching their work see); one iteration is one element in and out
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double bulk(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		const std::size_t RUN = 256;
+		ReaderWriterQueue<T, BlockSize> q(RUN);
+		T item;
+		SystemTime start = getSystemTime();
+		for (std::size_t done = 0; done < iterations; done += RUN)
+		{
+			std::size_t n = std::min(RUN, iterations - done);
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			for (std::size_t i = 0; i != n; ++i)
+			{
+				q.try_dequeue(item);
+				consume(item);
+			}
+		}
+		return getTimeDelta(start) / 1000.0;
+	}
+
+	// The same runs through enqueue_bulk and try_dequeue_bulk, which publish a block's
+	// worth of elements at a time instead of one
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double bulk_api(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		const std::size_t RUN = 256;
+		ReaderWriterQueue<T, BlockSize> q(RUN);
+		std::vector<T> in(RUN), out(RUN);
+		for (std::size_t i = 0; i != RUN; ++i)
+			in[i] = T(i);
+		SystemTime start = getSystemTime();
+		for (std::size_t done = 0; done < iterations; done += RUN)
+		{
+			std::size_t n = std::min(RUN, iterations - done);
+			q.enqueue_bulk(in.data(), n);
+			n = q.try_dequeue_bulk(out.data(), n);
+			for (std::size_t i = 0; i != n; ++i)
+				consume(out[i]);
+		}
+		return getTimeDelta(start) / 1000.0;
+	}
+
+	// Enqueue plus wait_dequeue on the blocking queue (never actually blocks, so this is
+	// the uncontended cost of the semaphore bookkeeping); one iteration is one element in and out
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double blocking(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		const std::size_t RUN = 64;
+		BlockingReaderWriterQueue<T, BlockSize> q(RUN);
+		T item;
+		SystemTime start = getSystemTime();
+		for (std::size_t done = 0; done < iterations; done += RUN)
+		{
+			std::size_t n = std::min(RUN, iterations - done);
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			for (std::size_t i = 0; i != n; ++i)
+			{
+				q.wait_dequeue(item);
+				consume(item);
+			}
+		}
+		return getTimeDelta(start) / 1000.0;
+	}
+
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double empty_dequeue(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		ReaderWriterQueue<T, BlockSize> q(BlockSize * 4);
+		T item;
+		unsigned int found = 0;
+		SystemTime start = getSystemTime();
+		for (std::size_t i = 0; i != iterations; ++i)
+			found += q.try_dequeue(item) ? 1 : 0;
+		double seconds = getTimeDelta(start) / 1000.0;
+		forceNoOptimizeDummy = found;
+		return seconds;
+	}
+
+	// Fills just past one block and drains it again, so that both the producer and the
+	// consumer move to the next block once per BlockSize - 1 elements
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	double block_crossing(std::size_t iterations)
+	{
+		typedef Payload<ElemSize> T;
+		const std::size_t RUN = BlockSize; // one more than fits in a block
+		ReaderWriterQueue<T, BlockSize> q(BlockSize * 3);
+		T item;
+		SystemTime start = getSystemTime();
+		for (std::size_t done = 0; done < iterations; done += RUN)
+		{
+			std::size_t n = std::min(RUN, iterations - done);
+			for (std::size_t i = 0; i != n; ++i)
+				q.enqueue(T(i));
+			for (std::size_t i = 0; i != n; ++i)
+			{
+				q.try_dequeue(item);
+				consume(item);
+			}
+		}
+		return getTimeDelta(start) / 1000.0;
+	}
+
+	struct Registration
+	{
+		std::string name;
+		const char *queue;
+		MicroBenchmark run;
+	};
+
+	template <std::size_t BlockSize, std::size_t ElemSize>
+	void registerSizes(std::vector<Registration> &all)
+	{
+		char suffix[64];
+		std::snprintf(suffix, sizeof(suffix), "/block:%u/elem:%u", (unsigned)BlockSize, (unsigned)ElemSize);
+		Registration regs[] = {
+			{"enqueue_single", "RWQ", &enqueue_single<BlockSize, ElemSize>},
+			{"dequeue_single", "RWQ", &dequeue_single<BlockSize, ElemSize>},
+			{"consume_single", "RWQ", &consume_single<BlockSize, ElemSize>},
+			{"bulk", "RWQ", &bulk<BlockSize, ElemSize>},
+			{"bulk_api", "RWQ", &bulk_api<BlockSize, ElemSize>},
+			{"blocking", "BRWQ", &blocking<BlockSize, ElemSize>},
+			{"empty_dequeue", "RWQ", &empty_dequeue<BlockSize, ElemSize>},
+			{"block_crossing", "RWQ", &block_crossing<BlockSize, ElemSize>},
+		};
+		for (auto &reg : regs)
+		{
+			reg.name += suffix;
+			all.push_back(reg);
+		}
+	}
+
+	template <std::size_t BlockSize>
+	void registerElementSizes(std::vector<Registration> &all)
+	{
+		registerSizes<BlockSize, 8>(all);
+		registerSizes<BlockSize, 64>(all);
+		registerSizes<BlockSize, 256>(all);
+	}
+
+	std::vector<Registration> registerAll()
+	{
+		std::vector<Registration> all;
+		registerElementSizes<32>(all);
+		registerElementSizes<512>(all);
+		registerElementSizes<4096>(all);
+		return all;
+	}
+
+	// Runs a benchmark with a growing number of iterations until it takes at least
+	// minTime seconds; returns the timed seconds and sets the number of iterations used
+	double measure(MicroBenchmark run, double minTime, std::size_t &iterations)
+	{
+		iterations = 1;
+		while (true)
+		{
+			double seconds = run(iterations);
+			if (seconds >= minTime || iterations >= 1000000000)
+				return seconds;
+			// Aim for 1.4x the minimum time, but grow by at most 10x per step (like Google Benchmark)
+			double multiplier = seconds <= 0 ? 10 : std::min(10.0, std::max(1.4 * minTime / seconds, 2.0));
+			iterations = static_cast<std::size_t>(iterations * multiplier);
+		}
+	}
+
+	void printUsage(const char *progName)
+	{
+		std::printf("%s\n    Description: Per-operation microbenchmarks for moodycamel::ReaderWriterQueue\n", progName);
+		std::printf("    --help                    Prints this help blurb\n");
+		std::printf("    --list                    Lists the benchmarks without running them\n");
+		std::printf("    --filter text             Runs only the benchmarks whose name contains text\n");
+		std::printf("    --min-time seconds        Minimum time to run each benchmark for (default: 0.5)\n");
+		std::printf("    --repetitions n           Number of times each benchmark is measured (default: 1)\n");
+		std::printf("    --format table|json|csv   Output format (default: table)\n");
+		std::printf("    --output file             Writes results to a file instead of stdout\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string progName = argv[0];
+	auto slash = progName.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		progName = progName.substr(slash + 1);
+	}
+
+	std::vector<std::string> filters;
+	double minTime = 0.5;
+	int repetitions = 1;
+	std::string format = "table";
+	const char *outputPath = nullptr;
+	bool listOnly = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		bool hasArg = i + 1 < argc;
+		if (std::strcmp(argv[i], "--help") == 0)
+		{
+			printUsage(progName.c_str());
+			return 0;
+		}
+		else if (std::strcmp(argv[i], "--list") == 0)
+			listOnly = true;
+		else if (std::strcmp(argv[i], "--filter") == 0 && hasArg)
+			filters.push_back(argv[++i]);
+		else if (std::strcmp(argv[i], "--min-time") == 0 && hasArg)
+			minTime = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--repetitions") == 0 && hasArg)
+			repetitions = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--format") == 0 && hasArg && (std::strcmp(argv[i + 1], "table") == 0 || std::strcmp(argv[i + 1], "json") == 0 || std::strcmp(argv[i + 1], "csv") == 0))
+			format = argv[++i];
+		else if (std::strcmp(argv[i], "--output") == 0 && hasArg)
+			outputPath = argv[++i];
+		else
+		{
+			std::printf("Unrecognized option '%s' (or missing/invalid argument).\n\n", argv[i]);
+			printUsage(progName.c_str());
+			return -1;
+		}
+	}
+
+	std::vector<Registration> selected;
+	for (Registration const &reg : registerAll())
+	{
+		bool match = filters.empty();
+		for (std::string const &f : filters)
+			match = match || reg.name.find(f) != std::string::npos;
+		if (match)
+			selected.push_back(reg);
+	}
+	if (selected.empty())
+	{
+		std::printf("No benchmark matches the given filter(s).\n");
+		return -1;
+	}
+	if (listOnly)
+	{
+		for (Registration const &reg : selected)
+			std::printf("%s\n", reg.name.c_str());
+		return 0;
+	}
+
+	std::ofstream file;
+	if (outputPath != nullptr)
+	{
+		file.open(outputPath);
+		if (!file)
+		{
+			std::fprintf(stderr, "Could not open '%s' for writing\n", outputPath);
+			return 2;
+		}
+	}
+	std::ostream &out = outputPath != nullptr ? file : std::cout;
+
+	const int NAME_WIDTH = 40;
+	if (format == "table")
+	{
+		out << std::left << std::setw(NAME_WIDTH) << "Benchmark" << std::right << std::setw(14) << "Iterations"
+			<< std::setw(12) << "ns/op" << std::setw(12) << "Mops/s" << "\n";
+		out << std::string(NAME_WIDTH + 38, '-') << "\n";
+	}
+
+	std::vector<benchreport::Run> runs;
+	for (Registration const &reg : selected)
+	{
+		for (int rep = 0; rep != repetitions; ++rep)
+		{
+			std::size_t iterations;
+			double seconds = measure(reg.run, minTime, iterations);
+
+			benchreport::Run run;
+			run.benchmark = reg.name;
+			run.queue = reg.queue;
+			run.run = rep;
+			run.seconds = seconds;
+			run.ops = static_cast<double>(iterations);
+			runs.push_back(run);
+
+			if (format == "table")
+			{
+				out << std::left << std::setw(NAME_WIDTH) << reg.name << std::right << std::setw(14) << iterations
+					<< std::fixed << std::setprecision(2) << std::setw(12) << seconds * 1e9 / iterations
+					<< std::setw(12) << run.opsPerSec() / 1000000 << std::endl;
+			}
+		}
+	}
+
+	if (format == "json")
+		benchreport::writeJson(out, benchreport::currentEnvironment(), runs);
+	else if (format == "csv")
+		benchreport::writeCsv(out, benchreport::currentEnvironment(), runs);
+	return 0;
+}
@@ -0,0 +1,220 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Optional hardware/software performance counters (Linux perf_event_open) for the
+// benchmarks, so that a difference in throughput can be traced back to where it
+// comes from (more instructions, more cache misses, more cross-core cache-line
+// transfers, or more context switches).
+// Each counter is opened separately and inherited by threads created while it is
+// enabled; counters the kernel or CPU doesn't support (e.g. in most VMs, or with a
+// restrictive perf_event_paranoid) are simply left out. On other platforms no
+// counters are ever available.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define BENCH_HAS_PERF_EVENTS
+#endif
+
+namespace perfcounters
+{
+	// Describes one counter: `name` is used as the metric name in results
+	// (suffixed with "_per_op"), `type` and `config` are as in perf_event_attr.
+	struct EventSpec
+	{
+		std::string name;
+		std::uint32_t type;
+		std::uint64_t config;
+		bool userSpaceFallback; // If kernel counting isn't permitted, count user space only
+	};
+
+	// The default set of events. HITM (loads that hit a line modified in another
+	// core's cache, i.e. actual cache-line transfers between the producer and the
+	// consumer) has no generic perf event; it can be added as a raw event with
+	// parseRawEvent(), using the code for the CPU at hand.
+	inline std::vector<EventSpec> defaultEvents()
+	{
+		std::vector<EventSpec> events;
+#ifdef BENCH_HAS_PERF_EVENTS
+		EventSpec cycles = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true};
+		EventSpec instructions = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true};
+		EventSpec l1dMisses = {"l1d_misses", PERF_TYPE_HW_CACHE,
+							   PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), true};
+		EventSpec llcMisses = {"llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true};
+		EventSpec contextSwitches = {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false};
+		events.push_back(cycles);
+		events.push_back(instructions);
+		events.push_back(l1dMisses);
+		events.push_back(llcMisses);
+		events.push_back(contextSwitches);
+#endif
+		return events;
+	}
+
+	// Parses "name=0xCODE" (a raw, CPU-specific event code as accepted by
+	// `perf stat -e rCODE`), e.g. "hitm=0x04d2" for MEM_LOAD_L3_HIT_RETIRED.XSNP_HITM
+	// on Skylake. Returns false if the specification is malformed.
+	inline bool parseRawEvent(const char *spec, EventSpec &out)
+	{
+		const char *eq = std::strchr(spec, '=');
+		if (eq == nullptr || eq == spec || eq[1] == '\0')
+			return false;
+		char *end;
+		errno = 0;
+		unsigned long long config = std::strtoull(eq + 1, &end, 0);
+		if (*end != '\0' || errno != 0)
+			return false;
+		out.name.assign(spec, eq);
+#ifdef BENCH_HAS_PERF_EVENTS
+		out.type = PERF_TYPE_RAW;
+#else
+		out.type = 0;
+#endif
+		out.config = config;
+		out.userSpaceFallback = true;
+		return true;
+	}
+
+	// A set of counters that are started and stopped together around the timed
+	// section of a benchmark run. Not copyable; the file descriptors are closed on
+	// destruction.
+	class CounterSet
+	{
+	public:
+		struct Reading
+		{
+			std::string name;
+			double value; // Scaled up if the kernel had to multiplex the counter
+		};
+
+		CounterSet() {}
+		~CounterSet() { close(); }
+
+		// Opens every event that is available, and returns a description of the
+		// ones that weren't (empty if all of them were opened)
+		std::string open(std::vector<EventSpec> const &events)
+		{
+			close();
+			std::string unavailable;
+			for (std::size_t i = 0; i != events.size(); ++i)
+			{
+				int err = 0;
+				int fd = openEvent(events[i], err);
+				if (fd < 0)
+				{
+					unavailable += (unavailable.empty() ? "" : ", ") + events[i].name + " (" + std::strerror(err) + ")";
+					continue;
+				}
+				Counter counter = {events[i].name, fd};
+				counters.push_back(counter);
+			}
+			return unavailable;
+		}
+
+		bool empty() const { return counters.empty(); }
+
+		// Resets and enables all counters. Threads created after this call (until
+		// stop()) are counted too.
+		void start()
+		{
+#ifdef BENCH_HAS_PERF_EVENTS
+			for (std::size_t i = 0; i != counters.size(); ++i)
+			{
+				ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+		}
+
+		void stop()
+		{
+#ifdef BENCH_HAS_PERF_EVENTS
+			for (std::size_t i = 0; i != counters.size(); ++i)
+				ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+		}
+
+		// Counts accumulated between the last start() and stop(), including those
+		// of (joined or still running) threads created in between
+		std::vector<Reading> read() const
+		{
+			std::vector<Reading> readings;
+#ifdef BENCH_HAS_PERF_EVENTS
+			for (std::size_t i = 0; i != counters.size(); ++i)
+			{
+				std::uint64_t values[3]; // value, time enabled, time running
+				if (::read(counters[i].fd, values, sizeof(values)) != (ssize_t)sizeof(values))
+					continue;
+				double value = (double)values[0];
+				if (values[2] != 0 && values[2] < values[1])
+					value *= (double)values[1] / (double)values[2];
+				Reading reading = {counters[i].name, value};
+				readings.push_back(reading);
+			}
+#endif
+			return readings;
+		}
+
+	private:
+		CounterSet(CounterSet const &);
+		CounterSet &operator=(CounterSet const &);
+
+		void close()
+		{
+#ifdef BENCH_HAS_PERF_EVENTS
+			for (std::size_t i = 0; i != counters.size(); ++i)
+				::close(counters[i].fd);
+#endif
+			counters.clear();
+		}
+
+		static int openEvent(EventSpec const &event, int &err)
+		{
+#ifdef BENCH_HAS_PERF_EVENTS
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = event.type;
+			attr.config = event.config;
+			attr.disabled = 1;
+			attr.inherit = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			// Hardware events include kernel time (futex waits, page faults) if we're
+			// allowed to; with perf_event_paranoid >= 2 only user space can be counted.
+			// Software events (context switches) are only ever raised in the kernel.
+			int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if (fd < 0 && event.userSpaceFallback && (errno == EACCES || errno == EPERM))
+			{
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			}
+			err = fd < 0 ? errno : 0;
+			return fd;
+#else
+			(void)event;
+			err = ENOSYS;
+			return -1;
+#endif
+		}
+
+		struct Counter
+		{
+			std::string name;
+			int fd;
+		};
+		std::vector<Counter> counters;
+	};
+}
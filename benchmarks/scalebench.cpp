@@ -0,0 +1,468 @@
+// ©2013-2015 Cameron Desrochers.
+// Distributed under the simplified BSD license (see the LICENSE file that
+// should have come with this file).
+
+// Scaling benchmark: many independent producer/consumer pairs, each with its own
+// queue, running at the same time (N pairs on 2*N threads). A single pair can't
+// show what happens when hundreds of queues share a host: memory bandwidth limits,
+// false sharing between neighbouring queue objects, and contention in the
+// allocator when many queues grow (allocate blocks) at once. Each run reports the
+// aggregate throughput, the spread of per-pair throughput, and element latency
+// across all pairs.
+
+#include "../readerwriterqueue.h"
+#include "../readerwritercircularbuffer.h"
+#include "benchreport.h"
+#include "../tests/common/simplethread.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+using namespace moodycamel;
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	inline std::int64_t nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+	}
+
+	struct Msg
+	{
+		std::uint64_t seq;
+		std::int64_t sentNs;
+
+		Msg() : seq(0), sentNs(0) {}
+	};
+
+	//////// Queue adapters ////////
+	// Each exposes produce()/consume(), plus the number of blocks allocated by the
+	// producer (for the growable queues).
+
+	template <typename TQueue>
+	class GrowableAdapter
+	{
+	public:
+		explicit GrowableAdapter(std::size_t size) : allocations(0), q(size) {}
+
+		void produce(Msg const &m)
+		{
+			if (!q.try_enqueue(m))
+			{
+				// Slow path only: find out whether enqueue() had to allocate a block
+				std::size_t cap = q.max_capacity();
+				q.enqueue(m);
+				if (q.max_capacity() != cap)
+					++allocations;
+			}
+		}
+
+		void consume(Msg &m) { consumeFrom(q, m); }
+
+		std::size_t allocations;
+
+	private:
+		// Polls, yielding between attempts, since with 2*N threads the consumers may
+		// well share cores with producers
+		static void consumeFrom(ReaderWriterQueue<Msg> &q, Msg &m)
+		{
+			while (!q.try_dequeue(m))
+				std::this_thread::yield();
+		}
+
+		static void consumeFrom(BlockingReaderWriterQueue<Msg> &q, Msg &m)
+		{
+			q.wait_dequeue(m);
+		}
+
+	private:
+		TQueue q;
+	};
+
+	class CircularAdapter
+	{
+	public:
+		explicit CircularAdapter(std::size_t size) : allocations(0), q(size) {}
+
+		void produce(Msg const &m) { q.wait_enqueue(m); }
+		void consume(Msg &m) { q.wait_dequeue(m); }
+
+		std::size_t allocations;
+
+	private:
+		BlockingReaderWriterCircularBuffer<Msg> q;
+	};
+
+	enum Layout
+	{
+		layout_packed,   // all queue objects back to back in one allocation
+		layout_separate  // each queue object allocated on its own, cache-line aligned and padded
+	};
+
+	struct Parameters
+	{
+		std::size_t pairs;
+		std::size_t count;        // elements per pair
+		std::size_t initialSize;  // initial capacity of every queue
+		Layout layout;
+	};
+
+	double percentile(std::vector<double> &v, double p)
+	{
+		if (v.empty())
+			return 0;
+		std::size_t i = static_cast<std::size_t>(p / 100 * (v.size() - 1) + 0.5);
+		std::nth_element(v.begin(), v.begin() + i, v.end());
+		return v[i];
+	}
+
+	// Owns `count` queue objects laid out according to `layout`
+	template <typename TAdapter>
+	class QueueArray
+	{
+	public:
+		QueueArray(std::size_t count, std::size_t initialSize, Layout layout)
+			: stride(0), storage(nullptr)
+		{
+			stride = sizeof(TAdapter);
+			if (layout == layout_separate)
+			{
+				// Round up to whole cache lines, plus one spare line so that even the
+				// adjacent-line prefetcher doesn't pull a neighbour in
+				stride = (stride + MOODYCAMEL_CACHE_LINE_SIZE - 1) / MOODYCAMEL_CACHE_LINE_SIZE * MOODYCAMEL_CACHE_LINE_SIZE + MOODYCAMEL_CACHE_LINE_SIZE;
+			}
+			storage = static_cast<char *>(std::malloc(stride * count + MOODYCAMEL_CACHE_LINE_SIZE));
+			if (storage == nullptr)
+				throw std::bad_alloc();
+			char *base = storage + (MOODYCAMEL_CACHE_LINE_SIZE - reinterpret_cast<std::uintptr_t>(storage) % MOODYCAMEL_CACHE_LINE_SIZE) % MOODYCAMEL_CACHE_LINE_SIZE;
+			for (std::size_t i = 0; i != count; ++i)
+				queues.push_back(new (base + i * stride) TAdapter(initialSize));
+		}
+
+		~QueueArray()
+		{
+			for (std::size_t i = 0; i != queues.size(); ++i)
+				queues[i]->~TAdapter();
+			std::free(storage);
+		}
+
+		TAdapter &operator[](std::size_t i) { return *queues[i]; }
+
+	private:
+		QueueArray(QueueArray const &);
+		QueueArray &operator=(QueueArray const &);
+
+		std::size_t stride;
+		char *storage;
+		std::vector<TAdapter *> queues;
+	};
+
+	template <typename TAdapter>
+	benchreport::Run runPairs(Parameters const &params)
+	{
+		const std::size_t N = params.pairs;
+		const std::size_t COUNT = params.count;
+		const std::size_t LATENCY_SAMPLE_MASK = 15; // record every 16th element's latency
+
+		QueueArray<TAdapter> queues(N, params.initialSize, params.layout);
+		std::vector<std::vector<double>> latencies(N);
+		std::vector<double> pairSeconds(N);
+		std::vector<char> ordered(N, 1);
+		for (std::size_t p = 0; p != N; ++p)
+			latencies[p].reserve(COUNT / (LATENCY_SAMPLE_MASK + 1) + 1);
+
+		// All threads start together, so that the pairs actually overlap
+		std::atomic<std::size_t> ready(0);
+		std::atomic<bool> go(false);
+		auto waitForStart = [&]()
+		{
+			ready.fetch_add(1);
+			while (!go.load())
+				std::this_thread::yield();
+		};
+
+		std::vector<std::unique_ptr<SimpleThread>> threads;
+		for (std::size_t p = 0; p != N; ++p)
+		{
+			threads.emplace_back(new SimpleThread([&, p]()
+												  {
+													  waitForStart();
+													  TAdapter &q = queues[p];
+													  std::int64_t first = nowNs();
+													  Msg m;
+													  for (std::size_t i = 0; i != COUNT; ++i)
+													  {
+														  q.consume(m);
+														  if ((i & LATENCY_SAMPLE_MASK) == 0)
+															  latencies[p].push_back((nowNs() - m.sentNs) / 1000.0);
+														  if (m.seq != i)
+															  ordered[p] = 0;
+													  }
+													  pairSeconds[p] = (nowNs() - first) / 1e9;
+												  }));
+			threads.emplace_back(new SimpleThread([&, p]()
+												  {
+													  waitForStart();
+													  TAdapter &q = queues[p];
+													  Msg m;
+													  for (std::size_t i = 0; i != COUNT; ++i)
+													  {
+														  m.seq = i;
+														  m.sentNs = nowNs();
+														  q.produce(m);
+													  }
+												  }));
+		}
+		while (ready.load() != 2 * N)
+			std::this_thread::yield();
+		std::int64_t start = nowNs();
+		go.store(true);
+		for (std::size_t t = 0; t != threads.size(); ++t)
+			threads[t]->join();
+		double seconds = (nowNs() - start) / 1e9;
+
+		std::vector<double> allLatencies;
+		double worstP99 = 0;
+		double slowestPair = 0, fastestPair = 0;
+		std::size_t allocations = 0;
+		for (std::size_t p = 0; p != N; ++p)
+		{
+			allLatencies.insert(allLatencies.end(), latencies[p].begin(), latencies[p].end());
+			worstP99 = std::max(worstP99, percentile(latencies[p], 99));
+			double opsPerSec = pairSeconds[p] > 0 ? COUNT / pairSeconds[p] : 0;
+			slowestPair = p == 0 ? opsPerSec : std::min(slowestPair, opsPerSec);
+			fastestPair = std::max(fastestPair, opsPerSec);
+			allocations += queues[p].allocations;
+			if (!ordered[p])
+				std::fprintf(stderr, "ERROR: elements were dequeued out of order in pair %d\n", (int)p);
+		}
+
+		benchreport::Run run;
+		run.benchmark = "pairs_" + std::to_string(N) + (params.layout == layout_packed ? "_packed" : "_separate");
+		run.seconds = seconds;
+		run.ops = static_cast<double>(N * COUNT);
+		run.metrics.push_back(std::make_pair("pairs", static_cast<double>(N)));
+		run.metrics.push_back(std::make_pair("pair_min_ops_per_sec", slowestPair));
+		run.metrics.push_back(std::make_pair("pair_max_ops_per_sec", fastestPair));
+		run.metrics.push_back(std::make_pair("latency_p50_us", percentile(allLatencies, 50)));
+		run.metrics.push_back(std::make_pair("latency_p99_us", percentile(allLatencies, 99)));
+		run.metrics.push_back(std::make_pair("worst_pair_p99_us", worstP99));
+		run.metrics.push_back(std::make_pair("block_allocations", static_cast<double>(allocations)));
+		return run;
+	}
+
+	typedef benchreport::Run (*PairRunner)(Parameters const &params);
+
+	struct QueueUnderTest
+	{
+		const char *shortName;
+		PairRunner run;
+	};
+
+	double metric(benchreport::Run const &run, const char *name)
+	{
+		for (auto const &m : run.metrics)
+		{
+			if (m.first == name)
+				return m.second;
+		}
+		return 0;
+	}
+
+	// Parses a comma-separated list of positive integers
+	bool parseList(const char *s, std::vector<std::size_t> &out)
+	{
+		out.clear();
+		while (*s != '\0')
+		{
+			char *end;
+			long value = std::strtol(s, &end, 10);
+			if (end == s || value <= 0 || (*end != ',' && *end != '\0'))
+				return false;
+			out.push_back(static_cast<std::size_t>(value));
+			s = *end == ',' ? end + 1 : end;
+		}
+		return !out.empty();
+	}
+
+	void printUsage(const char *progName)
+	{
+		std::printf("%s\n    Description: Runs N independent producer/consumer pairs at once, one queue each\n", progName);
+		std::printf("    --help                    Prints this help blurb\n");
+		std::printf("    --pairs a,b,...           Numbers of pairs to run (default: 1, 2, 4, ... up to the\n");
+		std::printf("                              number of hardware threads)\n");
+		std::printf("    --layout packed|separate|both\n");
+		std::printf("                              Whether queue objects are allocated back to back (exposes\n");
+		std::printf("                              false sharing between them) or padded apart (default: both)\n");
+		std::printf("    --runs n                  Number of runs per configuration and queue (default: 3)\n");
+		std::printf("    --scale factor            Multiplies the number of elements per pair (default: 1)\n");
+		std::printf("    --initial-size n          Initial capacity of every queue (default: 256, so that\n");
+		std::printf("                              the growable queues allocate blocks as they go)\n");
+		std::printf("    --format table|json|csv   Output format (default: table)\n");
+		std::printf("    --output file             Writes results to a file instead of stdout\n");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string progName = argv[0];
+	auto slash = progName.find_last_of("/\\");
+	if (slash != std::string::npos)
+	{
+		progName = progName.substr(slash + 1);
+	}
+
+	std::vector<std::size_t> pairCounts;
+	std::vector<Layout> layouts;
+	double scale = 1;
+	std::size_t initialSize = 256;
+	int runCount = 3;
+	std::string format = "table";
+	const char *outputPath = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		bool hasArg = i + 1 < argc;
+		if (std::strcmp(argv[i], "--help") == 0)
+		{
+			printUsage(progName.c_str());
+			return 0;
+		}
+		else if (std::strcmp(argv[i], "--pairs") == 0 && hasArg && parseList(argv[i + 1], pairCounts))
+			++i;
+		else if (std::strcmp(argv[i], "--layout") == 0 && hasArg && (std::strcmp(argv[i + 1], "packed") == 0 || std::strcmp(argv[i + 1], "separate") == 0 || std::strcmp(argv[i + 1], "both") == 0))
+		{
+			++i;
+			layouts.clear();
+			if (std::strcmp(argv[i], "separate") != 0)
+				layouts.push_back(layout_packed);
+			if (std::strcmp(argv[i], "packed") != 0)
+				layouts.push_back(layout_separate);
+		}
+		else if (std::strcmp(argv[i], "--runs") == 0 && hasArg)
+			runCount = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--scale") == 0 && hasArg)
+			scale = std::atof(argv[++i]);
+		else if (std::strcmp(argv[i], "--initial-size") == 0 && hasArg)
+			initialSize = static_cast<std::size_t>(std::atol(argv[++i]));
+		else if (std::strcmp(argv[i], "--format") == 0 && hasArg && (std::strcmp(argv[i + 1], "table") == 0 || std::strcmp(argv[i + 1], "json") == 0 || std::strcmp(argv[i + 1], "csv") == 0))
+			format = argv[++i];
+		else if (std::strcmp(argv[i], "--output") == 0 && hasArg)
+			outputPath = argv[++i];
+		else
+		{
+			std::printf("Unrecognized option '%s' (or missing/invalid argument).\n\n", argv[i]);
+			printUsage(progName.c_str());
+			return -1;
+		}
+	}
+	if (pairCounts.empty())
+	{
+		std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		for (std::size_t n = 1; n < cores; n *= 2)
+			pairCounts.push_back(n);
+		pairCounts.push_back(cores);
+	}
+	if (layouts.empty())
+	{
+		layouts.push_back(layout_packed);
+		layouts.push_back(layout_separate);
+	}
+
+	QueueUnderTest queues[] = {
+		{"RWQ", &runPairs<GrowableAdapter<ReaderWriterQueue<Msg>>>},
+		{"BRWQ", &runPairs<GrowableAdapter<BlockingReaderWriterQueue<Msg>>>},
+		{"BRWCB", &runPairs<CircularAdapter>},
+	};
+
+	std::ofstream file;
+	if (outputPath != nullptr)
+	{
+		file.open(outputPath);
+		if (!file)
+		{
+			std::fprintf(stderr, "Could not open '%s' for writing\n", outputPath);
+			return 2;
+		}
+	}
+	std::ostream &out = outputPath != nullptr ? file : std::cout;
+
+	if (format == "table")
+	{
+		out << "Metrics are averaged over " << runCount << " run(s); throughput in millions of elements/s, latencies in microseconds\n\n";
+		out << std::left << std::setw(10) << "Layout" << std::setw(7) << "Queue" << std::right << std::setw(6) << "Pairs"
+			<< std::setw(10) << "Total" << std::setw(10) << "Per pair" << std::setw(10) << "Pair min" << std::setw(10) << "Pair max"
+			<< std::setw(9) << "Lat p50" << std::setw(9) << "Lat p99" << std::setw(11) << "Worst p99" << std::setw(8) << "Blocks" << "\n";
+		out << std::string(100, '-') << "\n";
+	}
+
+	std::vector<benchreport::Run> runs;
+	for (Layout layout : layouts)
+	{
+		for (auto const &queue : queues)
+		{
+			for (std::size_t pairs : pairCounts)
+			{
+				Parameters params;
+				params.pairs = pairs;
+				params.count = std::max<std::size_t>(1, static_cast<std::size_t>(200000 * scale));
+				params.initialSize = initialSize;
+				params.layout = layout;
+
+				std::vector<benchreport::Run> these;
+				for (int i = 0; i != runCount; ++i)
+				{
+					benchreport::Run run = queue.run(params);
+					run.queue = queue.shortName;
+					run.run = i;
+					these.push_back(run);
+					runs.push_back(run);
+				}
+
+				if (format == "table")
+				{
+					auto avg = [&](const char *name)
+					{
+						double sum = 0;
+						for (auto const &r : these)
+							sum += metric(r, name);
+						return sum / these.size();
+					};
+					double opsPerSec = 0;
+					for (auto const &r : these)
+						opsPerSec += r.opsPerSec();
+					opsPerSec /= these.size();
+
+					out << std::left << std::setw(10) << (layout == layout_packed ? "packed" : "separate") << std::setw(7) << queue.shortName
+						<< std::right << std::setw(6) << pairs
+						<< std::fixed << std::setprecision(2) << std::setw(10) << opsPerSec / 1000000 << std::setw(10) << opsPerSec / pairs / 1000000
+						<< std::setw(10) << avg("pair_min_ops_per_sec") / 1000000 << std::setw(10) << avg("pair_max_ops_per_sec") / 1000000
+						<< std::setprecision(1) << std::setw(9) << avg("latency_p50_us") << std::setw(9) << avg("latency_p99_us") << std::setw(11) << avg("worst_pair_p99_us")
+						<< std::setprecision(0) << std::setw(8) << avg("block_allocations")
+						<< std::endl;
+				}
+			}
+		}
+	}
+
+	if (format == "json")
+		benchreport::writeJson(out, benchreport::currentEnvironment(), runs);
+	else if (format == "csv")
+		benchreport::writeCsv(out, benchreport::currentEnvironment(), runs);
+	return 0;
+}
@@ -4,6 +4,9 @@
 
 // Provides a C++11 implementation of a single-producer, single-consumer wait-free concurrent
 // circular buffer (fixed-size queue).
+// The number of elements in the buffer is derived from the producer's and the consumer's
+// indices, each written only by its owner (on its own cache line); the semaphores are only
+// used to put a thread that has to wait to sleep, and to wake it up again.
 
 #pragma once
 
@@ -13,29 +16,43 @@
 #include <cstdlib>
 #include <cstdint>
 #include <cassert>
+#include <atomic>
 
 // Note that this implementation is fully modern C++11 (not compatible with old MSVC versions)
-// but we still include atomicops.h for its LightweightSemaphore implementation.
+// but we still include atomicops.h for its fences and semaphores (spsc_sema::ParkingSpot).
 #include "atomicops.h"
 
-#ifndef MOODYCAMEL_CACHE_LINE_SIZE
-#define MOODYCAMEL_CACHE_LINE_SIZE 64
+// The buffer sleeps on ParkingSpots and keeps its closed flag in a std::atomic, neither of which
+// exists where atomicops.h can't use <atomic> (MSVC before 2012, and C++/CLI)
+#ifndef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+#error "readerwritercircularbuffer.h requires <atomic> (MSVC 2012 or later, and not C++/CLI)"
+#endif
+
+#ifndef MOODYCAMEL_EXCEPTIONS_ENABLED
+#if (defined(_MSC_VER) && defined(_CPPUNWIND)) || (defined(__GNUC__) && defined(__EXCEPTIONS)) || (!defined(_MSC_VER) && !defined(__GNUC__))
+#define MOODYCAMEL_EXCEPTIONS_ENABLED
+#endif
 #endif
 
 namespace moodycamel
 {
-    template <typename T>
+    // The buffer's memory comes from `Allocator`, an allocator of chars (see malloc_allocator).
+    template <typename T, typename Allocator = malloc_allocator<char>>
     class BlockingReaderWriterCircularBuffer
     {
+        static_assert(std::is_same<typename std::allocator_traits<Allocator>::value_type, char>::value,
+                      "Allocator must allocate chars (e.g. std::allocator<char>)");
+
     public:
         typedef T value_type;
+        typedef Allocator allocator_type;
 
     public:
-        explicit BlockingReaderWriterCircularBuffer(std::size_t capacity)
-            : maxcap(capacity), mask(), rawData(), data(),
-              slots_(new spsc_sema::LightweightSemaphore(static_cast<spsc_sema::LightweightSemaphore::ssize_t>(capacity))),
-              items(new spsc_sema::LightweightSemaphore(0)),
-              nextSlot(0), nextItem(0)
+        explicit BlockingReaderWriterCircularBuffer(std::size_t capacity, Allocator const &allocator_ = Allocator())
+            : maxcap(capacity), mask(), rawData(), data(), selectSpot(nullptr), closed(false), memoryLocked(false),
+              nextSlot(), localNextItem(0),
+              nextItem(), localNextSlot(0),
+              allocator(allocator_)
         {
             // Round capacity up to power of two to compute modulo mask.
             // 将 capcity 四舍五入至 2 的幂来计算 mask
@@ -61,15 +78,29 @@ namespace moodycamel
             // std::alignment_of<T>::value  返回 T 类型内存对齐的大小
             // 在这里已经完成了内存分配，后续元素入队时候的内存分配都是 placement new 的方式
             // 分配内存的时候多分配了 std::alignment_of<T>::value - 1 的内存
-            rawData = static_cast<char *>(std::malloc(capacity * sizeof(T) + std::alignment_of<T>::value - 1));
+            auto memory = std::allocator_traits<Allocator>::allocate(allocator, raw_bytes());
+            rawData = memory != nullptr ? &*memory : nullptr;
             data = align_for<T>(rawData);
         }
 
+        // Like the constructor above, but also has the OS map in (and optionally lock) the
+        // buffer's memory right away (see prefault_t), so that the first pass through it
+        // doesn't page fault
+        BlockingReaderWriterCircularBuffer(std::size_t capacity, prefault_t options, Allocator const &allocator_ = Allocator())
+            : BlockingReaderWriterCircularBuffer(capacity, allocator_)
+        {
+            if (rawData == nullptr)
+                return;
+            details::prefault_pages(data, (mask + 1) * sizeof(T));
+            memoryLocked = options.lock && details::lock_pages(rawData, raw_bytes());
+        }
+
+        // Doesn't allocate: the moved-from buffer is left empty, with a capacity of zero
         BlockingReaderWriterCircularBuffer(BlockingReaderWriterCircularBuffer &&other)
-            : maxcap(0), mask(0), rawData(nullptr), data(nullptr),
-              slots_(new spsc_sema::LightweightSemaphore(0)),
-              items(new spsc_sema::LightweightSemaphore(0)),
-              nextSlot(), nextItem()
+            : maxcap(0), mask(0), rawData(nullptr), data(nullptr), selectSpot(nullptr), closed(false), memoryLocked(false),
+              nextSlot(), localNextItem(0),
+              nextItem(), localNextSlot(0),
+              allocator(other.allocator)
         {
             swap(other);
         }
@@ -80,9 +111,15 @@ namespace moodycamel
         // being deleted. It's up to the user to synchronize this.
         ~BlockingReaderWriterCircularBuffer()
         {
-            for (std::size_t i = 0, n = items->availableApprox(); i != n; ++i)
-                reinterpret_cast<T *>(data)[(nextItem + i) & mask].~T();
-            std::free(rawData);
+            for (std::size_t i = nextItem.load(), end = nextSlot.load(); i != end; ++i)
+                reinterpret_cast<T *>(data)[i & mask].~T();
+            if (memoryLocked)
+                details::unlock_pages(rawData, raw_bytes());
+            if (rawData != nullptr)
+            {
+                typedef typename std::allocator_traits<Allocator>::pointer AllocatorPointer;
+                std::allocator_traits<Allocator>::deallocate(allocator, std::pointer_traits<AllocatorPointer>::pointer_to(*rawData), raw_bytes());
+            }
         }
 
         BlockingReaderWriterCircularBuffer &operator=(BlockingReaderWriterCircularBuffer &&other) noexcept
@@ -94,81 +131,142 @@ namespace moodycamel
         BlockingReaderWriterCircularBuffer &operator=(BlockingReaderWriterCircularBuffer const &) = delete;
 
         // Swaps the contents of this buffer with the contents of another.
-        // Not thread-safe.
+        // Not thread-safe (and no thread may be waiting on either buffer).
+        // Unless the allocators propagate on swap, they must be equal.
         void swap(BlockingReaderWriterCircularBuffer &other) noexcept
         {
             std::swap(maxcap, other.maxcap);
             std::swap(mask, other.mask);
             std::swap(rawData, other.rawData);
             std::swap(data, other.data);
-            std::swap(slots_, other.slots_);
-            std::swap(items, other.items);
+            std::swap(memoryLocked, other.memoryLocked);
+            details::swap_allocators(allocator, other.allocator);
+            bool wasClosed = closed.load(std::memory_order_relaxed);
+            closed.store(other.closed.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            other.closed.store(wasClosed, std::memory_order_relaxed);
             std::swap(nextSlot, other.nextSlot);
+            std::swap(localNextItem, other.localNextItem);
             std::swap(nextItem, other.nextItem);
+            std::swap(localNextSlot, other.localNextSlot);
+            wake_hysteresis hysteresis = itemWaiter.hysteresis();
+            itemWaiter.setHysteresis(other.itemWaiter.hysteresis());
+            other.itemWaiter.setHysteresis(hysteresis);
+        }
+
+        // Sets when the producer wakes up the consumer while it's asleep waiting for an
+        // element (see wake_hysteresis); by default, right away. Not thread-safe (no thread
+        // may be using the buffer).
+        void set_wake_hysteresis(wake_hysteresis const &hysteresis)
+        {
+            itemWaiter.setHysteresis(hysteresis);
+        }
+
+        // Wakes up the consumer right away if it's asleep, regardless of the wake-up
+        // hysteresis (e.g. after enqueueing an element that mustn't wait).
+        // Thread-safe when called by producer thread.
+        void wake_consumer()
+        {
+            itemWaiter.notify(true);
         }
 
         // Enqueues a single item (by copying it).
-        // Fails if not enough room to enqueue.
+        // Fails if not enough room to enqueue, or if the buffer is closed.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
         bool try_enqueue(T const &item)
         {
-            // 等待逻辑：
-            // 1. 判断队列中空闲 slots 的数量是否大于0
-            //     1.1 如果队列中空闲 slots 的数量大于0，则将队列中空闲 slot 的数量减一，然后返回 true
-            //     1.2 如果队列中空闲 slots 的数量不大于 0，说明队列已满，直接返回 false
-            if (!slots_->tryWait())
+            if (is_closed() || !has_free_slot())
                 return false;
             // 入队逻辑：
-            // 1. 将下一个空闲 slot 位置加一
-            // 2. new 元素
-            // 3. 当前已入队元素加一
+            // 1. new 元素
+            // 2. 将下一个空闲 slot 位置加一（发布给消费者）
+            // 3. 如果消费者在等待元素，唤醒它
             inner_enqueue(item);
             return true;
         }
 
         // Enqueues a single item (by moving it, if possible).
-        // Fails if not enough room to enqueue.
+        // Fails if not enough room to enqueue, or if the buffer is closed.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
         bool try_enqueue(T &&item)
         {
-            if (!slots_->tryWait())
+            if (is_closed() || !has_free_slot())
                 return false;
             inner_enqueue(std::move(item));
             return true;
         }
 
+        // Enqueues an item that fill(T &) sets up in place: the slot's element is
+        // default-constructed (so a trivial T is left uninitialized), passed to fill, and
+        // only then handed to the consumer. Saves moving in a temporary, for large items.
+        // Fails if not enough room to enqueue, or if the buffer is closed.
+        // If fill throws, the element is destroyed again and nothing is enqueued.
+        // Thread-safe when called by producer thread.
+        // No exception guarantee (state will be corrupted) if constructor of T throws.
+        template <typename F>
+        bool try_enqueue_with(F &&fill)
+        {
+            if (is_closed() || !has_free_slot())
+                return false;
+            inner_enqueue_with(fill);
+            return true;
+        }
+
         // Blocks the current thread until there's enough space to enqueue the given item,
-        // then enqueues it (via copy).
+        // then enqueues it (via copy) and returns true. Returns false without enqueueing
+        // the item if the buffer is (or gets) closed.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
-        void wait_enqueue(T const &item)
+        bool wait_enqueue(T const &item)
         {
-            while (!slots_->wait())
+            while (!wait_for_free_slot(-1))
                 ;
+            if (is_closed())
+                return false;
             inner_enqueue(item);
+            return true;
         }
 
         // Blocks the current thread until there's enough space to enqueue the given item,
-        // then enqueues it (via move, if possible).
+        // then enqueues it (via move, if possible) and returns true. Returns false without enqueueing
+        // the item if the buffer is (or gets) closed.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
-        void wait_enqueue(T &&item)
+        bool wait_enqueue(T &&item)
         {
-            while (!slots_->wait())
+            while (!wait_for_free_slot(-1))
                 ;
+            if (is_closed())
+                return false;
             inner_enqueue(std::move(item));
+            return true;
+        }
+
+        // Like try_enqueue_with, but blocks the current thread until there's enough space
+        // (see wait_enqueue). Returns false without calling fill if the buffer is (or gets) closed.
+        // If fill throws, the element is destroyed again and nothing is enqueued.
+        // Thread-safe when called by producer thread.
+        // No exception guarantee (state will be corrupted) if constructor of T throws.
+        template <typename F>
+        bool wait_enqueue_with(F &&fill)
+        {
+            while (!wait_for_free_slot(-1))
+                ;
+            if (is_closed())
+                return false;
+            inner_enqueue_with(fill);
+            return true;
         }
 
         // Blocks the current thread until there's enough space to enqueue the given item,
         // or the timeout expires. Returns false without enqueueing the item if the timeout
-        // expires, otherwise enqueues the item (via copy) and returns true.
+        // expires (or the buffer is closed), otherwise enqueues the item (via copy) and returns true.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
         bool wait_enqueue_timed(T const &item, std::int64_t timeout_usecs)
         {
-            if (!slots_->wait(timeout_usecs))
+            if (!wait_for_free_slot(timeout_usecs) || is_closed())
                 return false;
             inner_enqueue(item);
             return true;
@@ -176,12 +274,12 @@ namespace moodycamel
 
         // Blocks the current thread until there's enough space to enqueue the given item,
         // or the timeout expires. Returns false without enqueueing the item if the timeout
-        // expires, otherwise enqueues the item (via move, if possible) and returns true.
+        // expires (or the buffer is closed), otherwise enqueues the item (via move, if possible) and returns true.
         // Thread-safe when called by producer thread.
         // No exception guarantee (state will be corrupted) if constructor of T throws.
         bool wait_enqueue_timed(T &&item, std::int64_t timeout_usecs)
         {
-            if (!slots_->wait(timeout_usecs))
+            if (!wait_for_free_slot(timeout_usecs) || is_closed())
                 return false;
             inner_enqueue(std::move(item));
             return true;
@@ -216,39 +314,44 @@ namespace moodycamel
         template <typename U>
         bool try_dequeue(U &item)
         {
-            if (!items->tryWait())
+            if (!has_item())
                 return false;
             inner_dequeue(item);
             return true;
         }
 
-        // Blocks the current thread until there's something to dequeue, then dequeues it.
+        // Blocks the current thread until there's something to dequeue, then dequeues it and
+        // returns true. Returns false without setting `item` if the buffer is closed and empty.
         // Thread-safe when called by consumer thread.
         // No exception guarantee (state will be corrupted) if assignment operator of U throws.
         template <typename U>
-        void wait_dequeue(U &item)
+        bool wait_dequeue(U &item)
         {
             /*
              * 出队逻辑：
-             * 1. 判断队列中已入队元素的数量是否大于0
-             *      1.1 如果已入队元素数量大于 0，则将已入队元素数量减一
-             *      1.2 如果已入队元素数量不大于 0，说明此时队列为空，则进入自旋，等待元素入队
+             * 1. 判断 nextItem 是否落后于生产者的 nextSlot（即队列中是否有元素）
+             *      1.1 如果有元素，直接出队
+             *      1.2 如果没有元素，先自旋，之后在信号量上睡眠，等待生产者入队后唤醒
              */
 
-            while (!items->wait())
+            while (!wait_for_item(-1))
                 ;
+            if (!has_item())
+                return false;
             inner_dequeue(item);
+            return true;
         }
 
         // Blocks the current thread until either there's something to dequeue
         // or the timeout expires. Returns false without setting `item` if the
-        // timeout expires, otherwise assigns to `item` and returns true.
+        // timeout expires (or the buffer is closed and empty), otherwise assigns
+        // to `item` and returns true.
         // Thread-safe when called by consumer thread.
         // No exception guarantee (state will be corrupted) if assignment operator of U throws.
         template <typename U>
         bool wait_dequeue_timed(U &item, std::int64_t timeout_usecs)
         {
-            if (!items->wait(timeout_usecs))
+            if (!wait_for_item(timeout_usecs) || !has_item())
                 return false;
             inner_dequeue(item);
             return true;
@@ -265,11 +368,100 @@ namespace moodycamel
             return wait_dequeue_timed(item, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
         }
 
+        // Attempts to consume a single item in place: calls f(T &) on it where it is in the
+        // buffer, then destroys it (saves moving out large items that are only read once).
+        // Returns false without calling f if the buffer is empty.
+        // Thread-safe when called by consumer thread.
+        // No exception guarantee (state will be corrupted) if f throws.
+        template <typename F>
+        bool try_consume(F &&f)
+        {
+            if (!has_item())
+                return false;
+            inner_consume(f);
+            return true;
+        }
+
+        // Like try_consume, but blocks the current thread until there's something to consume.
+        // Returns false without calling f if the buffer is closed and empty.
+        // Thread-safe when called by consumer thread.
+        // No exception guarantee (state will be corrupted) if f throws.
+        template <typename F>
+        bool wait_consume(F &&f)
+        {
+            while (!wait_for_item(-1))
+                ;
+            if (!has_item())
+                return false;
+            inner_consume(f);
+            return true;
+        }
+
+        // Like wait_consume, but gives up when the timeout expires (returning false).
+        // Thread-safe when called by consumer thread.
+        // No exception guarantee (state will be corrupted) if f throws.
+        template <typename F>
+        bool wait_consume_timed(F &&f, std::int64_t timeout_usecs)
+        {
+            if (!wait_for_item(timeout_usecs) || !has_item())
+                return false;
+            inner_consume(f);
+            return true;
+        }
+
+        // Like wait_dequeue_timed, but returns how the wait went: whether an element was
+        // available right away, turned up while spinning or only after sleeping, or the
+        // timeout expired (outcome.success is false, `item` isn't set), and how long it took.
+        // If the buffer is closed and empty, outcome.closed is set (and success isn't).
+        // A negative timeout waits indefinitely.
+        // Thread-safe when called by consumer thread.
+        // No exception guarantee (state will be corrupted) if assignment operator of U throws.
+        template <typename U>
+        wait_outcome wait_dequeue_outcome(U &item, std::int64_t timeout_usecs)
+        {
+            wait_outcome outcome;
+            if (has_item())
+            {
+                outcome.success = true;
+            }
+            else
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                while (!itemWaiter.waitUntil([this]()
+                                             { return has_item() || is_closed(); },
+                                             timeout_usecs, &outcome) &&
+                       timeout_usecs < 0)
+                    continue;
+                outcome.success = !outcome.timed_out;
+                outcome.wait_usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                if (!outcome.success)
+                    return outcome;
+                if (!has_item())
+                {
+                    outcome.success = false;
+                    outcome.closed = true;
+                    return outcome;
+                }
+            }
+            inner_dequeue(item);
+            return outcome;
+        }
+
+        // Like wait_dequeue_timed, but returns how the wait went (see above).
+        template <typename U, typename Rep, typename Period>
+        inline wait_outcome wait_dequeue_outcome(U &item, std::chrono::duration<Rep, Period> const &timeout)
+        {
+            return wait_dequeue_outcome(item, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+        }
+
         // Returns a (possibly outdated) snapshot of the total number of elements currently in the buffer.
         // Thread-safe.
         inline std::size_t size_approx() const
         {
-            return items->availableApprox();
+            // Read the consumer's index first: the producer's can only be ahead of it
+            std::size_t front = nextItem.load();
+            fence(memory_order_acquire);
+            return nextSlot.load() - front;
         }
 
         // Returns the maximum number of elements that this circular buffer can hold at once.
@@ -279,29 +471,150 @@ namespace moodycamel
             return maxcap;
         }
 
+        // Whether the buffer's memory is locked into RAM (see prefault_t)
+        inline bool memory_locked() const
+        {
+            return memoryLocked;
+        }
+
+        allocator_type get_allocator() const
+        {
+            return allocator;
+        }
+
+        // Closes the buffer: from then on, enqueues fail, and once the elements already in
+        // it have been dequeued, so do dequeues (wait_dequeue returns false instead of
+        // blocking). Wakes up both threads if they're waiting. May be called from any
+        // thread, more than once; an enqueue that races with it may or may not succeed.
+        void close()
+        {
+            if (!closed.exchange(true))
+            {
+                slotWaiter.wake();
+                itemWaiter.wake();
+                if (selectSpot != nullptr)
+                    selectSpot->wake();
+            }
+        }
+
+        // Returns whether close() has been called.
+        // Thread-safe.
+        inline bool is_closed() const
+        {
+            return closed.load(std::memory_order_relaxed);
+        }
+
+        // Used by QueueSet: `spot` (if not null) is woken up after every enqueue, and by
+        // close(). Not thread-safe (the producer must not be enqueueing). Not swapped.
+        void set_select_spot(spsc_sema::ParkingSpot *spot)
+        {
+            selectSpot = spot;
+        }
+
     private:
+        // Producer only
+        bool has_free_slot()
+        {
+            std::size_t i = nextSlot.load();
+            if (i - localNextItem < maxcap)
+                return true;
+            localNextItem = nextItem.load();
+            fence(memory_order_acquire); // The consumer is done with the slot before it advances nextItem past it
+            return i - localNextItem < maxcap;
+        }
+
+        // Consumer only
+        bool has_item()
+        {
+            std::size_t i = nextItem.load();
+            if (i != localNextSlot)
+                return true;
+            localNextSlot = nextSlot.load();
+            fence(memory_order_acquire); // The element is constructed before nextSlot advances past it
+            return i != localNextSlot;
+        }
+
+        bool wait_for_free_slot(std::int64_t timeout_usecs)
+        {
+            return slotWaiter.waitUntil([this]()
+                                        { return has_free_slot() || is_closed(); },
+                                        timeout_usecs);
+        }
+
+        bool wait_for_item(std::int64_t timeout_usecs)
+        {
+            return itemWaiter.waitUntil([this]()
+                                        { return has_item() || is_closed(); },
+                                        timeout_usecs);
+        }
+
         template <typename U>
         void inner_enqueue(U &&item)
         {
-            std::size_t i = nextSlot++;
+            std::size_t i = nextSlot.load();
             // nextSlot 会不断递增，但是 & mask 之后仍然在 capacity 的范围内
-            // std::cout << "nextSlot = " << nextSlot << std::endl;
             new (reinterpret_cast<T *>(data) + (i & mask)) T(std::forward<U>(item));
-            // 队列中已入队元素加一
-            items->signal();
+            publish_slot(i);
+        }
+
+        template <typename F>
+        void inner_enqueue_with(F &fill)
+        {
+            std::size_t i = nextSlot.load();
+            T *element = new (reinterpret_cast<T *>(data) + (i & mask)) T;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            try
+            {
+                fill(*element);
+            }
+            catch (...)
+            {
+                element->~T();
+                throw;
+            }
+#else
+            fill(*element);
+#endif
+            publish_slot(i);
+        }
+
+        // Hands the element constructed in slot i over to the consumer
+        void publish_slot(std::size_t i)
+        {
+            fence(memory_order_release);
+            nextSlot = i + 1;
+            itemWaiter.notify();
+            if (selectSpot != nullptr)
+                selectSpot->wake();
         }
 
         template <typename U>
         void inner_dequeue(U &item)
         {
-            std::size_t i = nextItem++;
-            // std::cout << "nextItem = " << nextItem << std::endl;
+            std::size_t i = nextItem.load();
             // nextItem 会不断递增，但是 & mask 之后仍然在 capacity 的范围内
             T &element = reinterpret_cast<T *>(data)[i & mask];
             item = std::move(element);
             element.~T();
-            // 队列中的空闲 spot 加一
-            slots_->signal();
+            release_slot(i);
+        }
+
+        template <typename F>
+        void inner_consume(F &f)
+        {
+            std::size_t i = nextItem.load();
+            T &element = reinterpret_cast<T *>(data)[i & mask];
+            f(element);
+            element.~T();
+            release_slot(i);
+        }
+
+        // Hands slot i back to the producer, once its element has been destroyed
+        void release_slot(std::size_t i)
+        {
+            fence(memory_order_release);
+            nextItem = i + 1;
+            slotWaiter.notify();
         }
 
         template <typename U>
@@ -311,6 +624,12 @@ namespace moodycamel
             return ptr + (alignment - (reinterpret_cast<std::uintptr_t>(ptr) % alignment)) % alignment;
         }
 
+        // The size of rawData: the buffer, plus room to align it
+        std::size_t raw_bytes() const
+        {
+            return (mask + 1) * sizeof(T) + std::alignment_of<T>::value - 1;
+        }
+
     private:
         /*
          * 为什么队列的底层不使用普通链表结构：
@@ -320,16 +639,39 @@ namespace moodycamel
          * 2. 固定内存分配
          * 上面的要求很容易联想到循环队列，队列基于数组实现
          */
-        std::size_t maxcap;                                      // actual (non-power-of-two) capacity
-        std::size_t mask;                                        // circular buffer capacity mask (for cheap modulo)
-        char *rawData;                                           // raw circular buffer memory
-        char *data;                                              // circular buffer memory aligned to element alignment
-        std::unique_ptr<spsc_sema::LightweightSemaphore> slots_; // number of slots currently free (named with underscore to accommodate Qt's 'slots' macro)
-        std::unique_ptr<spsc_sema::LightweightSemaphore> items;  // number of elements currently enqueued
-        char cachelineFiller0[MOODYCAMEL_CACHE_LINE_SIZE - sizeof(char *) * 2 - sizeof(std::size_t) * 2 - sizeof(std::unique_ptr<spsc_sema::LightweightSemaphore>) * 2];
-        std::size_t nextSlot; // index of next free slot to enqueue into
-        char cachelineFiller1[MOODYCAMEL_CACHE_LINE_SIZE - sizeof(std::size_t)];
-        std::size_t nextItem; // index of next element to dequeue from
+        std::size_t maxcap; // actual (non-power-of-two) capacity
+        std::size_t mask;   // circular buffer capacity mask (for cheap modulo)
+        char *rawData;      // raw circular buffer memory
+        char *data;         // circular buffer memory aligned to element alignment
+        spsc_sema::ParkingSpot slotWaiter; // where the producer sleeps while the buffer is full
+        spsc_sema::ParkingSpot itemWaiter; // where the consumer sleeps while the buffer is empty
+        spsc_sema::ParkingSpot *selectSpot; // the QueueSet's, if the buffer is in one
+        std::atomic<bool> closed;           // set by close()
+        bool memoryLocked;                  // whether rawData is locked into RAM (see prefault_t)
+        // (the lines above are only written when a thread goes to sleep or is woken up)
+        char cachelineFiller0[MOODYCAMEL_CACHE_LINE_SIZE - (sizeof(char *) * 2 + sizeof(std::size_t) * 2 + sizeof(spsc_sema::ParkingSpot) * 2 + sizeof(spsc_sema::ParkingSpot *) + sizeof(std::atomic<bool>) + sizeof(bool)) % MOODYCAMEL_CACHE_LINE_SIZE];
+
+        // The number of elements in the buffer is nextSlot - nextItem; each side only writes its
+        // own index (on its own cache line) and keeps a shadow copy of the other's, which it only
+        // refreshes when the copy says it can't proceed.
+        // The class isn't over-aligned (so that plain new works before C++17, and every
+        // translation unit agrees on its layout); instead, a whole line of padding follows
+        // each index pair, which keeps the two a line apart wherever the object is placed.
+        weak_atomic<std::size_t> nextSlot; // (Atomic) index of next free slot to enqueue into, written by the producer
+        std::size_t localNextItem;         // the producer's shadow copy of nextItem
+        char cachelineFiller1[MOODYCAMEL_CACHE_LINE_SIZE];
+        weak_atomic<std::size_t> nextItem; // (Atomic) index of next element to dequeue from, written by the consumer
+        std::size_t localNextSlot;         // the consumer's shadow copy of nextSlot
+        char cachelineFiller2[MOODYCAMEL_CACHE_LINE_SIZE]; // keeps whatever follows the buffer in memory off these lines
+        Allocator allocator; // where rawData comes from (only used when it's allocated and freed)
     };
 
+#if MOODYCAMEL_HAS_PMR
+    namespace pmr
+    {
+        // A circular buffer whose memory comes from a std::pmr::memory_resource
+        template <typename T>
+        using BlockingReaderWriterCircularBuffer = ::moodycamel::BlockingReaderWriterCircularBuffer<T, std::pmr::polymorphic_allocator<char>>;
+    }
+#endif
 }
@@ -14,6 +14,7 @@
 #include <cstdint>
 #include <cstdlib> // For malloc/free/abort & size_t
 #include <memory>
+#include <vector>
 #if __cplusplus > 199711L || _MSC_VER >= 1700 // C++11 or VS2012
 #include <chrono>
 #endif
@@ -31,10 +32,6 @@
 // one role, is not safe unless properly synchronized.
 // Using the queue exclusively from one thread is fine, though a bit silly.
 
-#ifndef MOODYCAMEL_CACHE_LINE_SIZE
-#define MOODYCAMEL_CACHE_LINE_SIZE 64
-#endif
-
 #ifndef MOODYCAMEL_EXCEPTIONS_ENABLED
 #if (defined(_MSC_VER) && defined(_CPPUNWIND)) || (defined(__GNUC__) && defined(__EXCEPTIONS)) || (!defined(_MSC_VER) && !defined(__GNUC__))
 #define MOODYCAMEL_EXCEPTIONS_ENABLED
@@ -47,19 +44,14 @@
 #endif
 #endif
 
-#ifndef MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
-#if defined(__APPLE__) && defined(__MACH__) && __cplusplus >= 201703L
-// This is required to find out what deployment target we are using
-#include <CoreFoundation/CoreFoundation.h>
-#if !defined(MAC_OS_X_VERSION_MIN_REQUIRED) || MAC_OS_X_VERSION_MIN_REQUIRED < MAC_OS_X_VERSION_10_14
-// C++17 new(size_t, align_val_t) is not backwards-compatible with older versions of macOS, so we can't support over-alignment in this case
-#define MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
-#endif
+#ifndef MOODYCAMEL_HAS_BLOCK_CACHE
+#if !defined(_MSC_VER) || _MSC_VER >= 1900 // thread_local: either a non-MS compiler or VS >= 2015
+#define MOODYCAMEL_HAS_BLOCK_CACHE 1
 #endif
 #endif
 
-#ifndef MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE
-#define MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE AE_ALIGN(MOODYCAMEL_CACHE_LINE_SIZE)
+#if MOODYCAMEL_HAS_BLOCK_CACHE
+#include <mutex>
 #endif
 
 #ifdef AE_VCPP
@@ -71,8 +63,262 @@
 
 namespace moodycamel
 {
+    // Pass `defer_allocation` as the second constructor argument of a queue to have it
+    // allocate its initial blocks on the first enqueue instead of in the constructor
+    struct defer_allocation_t
+    {
+    };
+    static const defer_allocation_t defer_allocation = {};
+
+#if MOODYCAMEL_HAS_BLOCK_CACHE
+    // A process-wide cache of the memory of freed blocks, which the queues take from before
+    // calling malloc when they grow, and give to when they shrink (see shrink_to) or are
+    // destroyed. In a process with many queues that are mostly idle, this lets the memory
+    // held track the overall load rather than the sum of every queue's peak.
+    // Blocks are kept by their size in bytes, so queues of the same element type and block
+    // size (or of element types of the same size) share them. Each thread keeps a few blocks
+    // of a few sizes at hand, so that a queue that shrinks and grows again from the same
+    // thread doesn't take the lock; a thread hands those back on its first take or give
+    // after set_limit is called (or when it exits). Off until set_limit is called.
+    class BlockCache
+    {
+    public:
+        // Lets the cache hold up to `max_bytes` of free blocks (not counting the few each
+        // thread keeps at hand), freeing what's beyond that. 0 turns it off. Thread-safe.
+        static void set_limit(size_t max_bytes)
+        {
+            Shared &cache = shared();
+            cache.limit = max_bytes;
+            // Has every thread hand back the blocks it keeps at hand, so that they're
+            // held to the new limit too (this one's right away, so they're trimmed below)
+            cache.epoch.fetch_add_release(1);
+            local();
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            for (size_t i = 0; i != SHARED_CLASSES && cache.bytes > max_bytes; ++i)
+            {
+                SizeClass &c = cache.classes[i];
+                while (c.head != nullptr && cache.bytes > max_bytes)
+                {
+                    std::free(c.pop());
+                    cache.bytes -= c.bytes;
+                }
+            }
+        }
+
+        static size_t limit()
+        {
+            return shared().limit.load();
+        }
+
+        // The memory held by the cache, in bytes (not counting the blocks threads keep at hand)
+        static size_t cached_bytes()
+        {
+            Shared &cache = shared();
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            return cache.bytes;
+        }
+
+        // Returns the memory of a free block of `bytes` bytes, or nullptr if the cache has none
+        static void *take(size_t bytes)
+        {
+            Shared &cache = shared();
+            Local *local_ = cache.epoch.load() != 0 ? local() : nullptr; // (no thread keeps anything before the first set_limit)
+            if (cache.limit.load() == 0)
+            {
+                return nullptr;
+            }
+            if (local_ != nullptr)
+            {
+                SizeClass *c = find(local_->classes, LOCAL_CLASSES, bytes, false);
+                if (c != nullptr && c->head != nullptr)
+                {
+                    return c->pop();
+                }
+            }
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            SizeClass *c = find(cache.classes, SHARED_CLASSES, bytes, false);
+            if (c == nullptr || c->head == nullptr)
+            {
+                return nullptr;
+            }
+            cache.bytes -= bytes;
+            return c->pop();
+        }
+
+        // Keeps `memory`, a free block of `bytes` bytes from malloc, for reuse; frees it
+        // if the cache is off or full
+        static void give(void *memory, size_t bytes)
+        {
+            Shared &cache = shared();
+            Local *local_ = cache.epoch.load() != 0 ? local() : nullptr;
+            if (cache.limit.load() == 0)
+            {
+                std::free(memory);
+                return;
+            }
+            if (local_ != nullptr)
+            {
+                SizeClass *c = find(local_->classes, LOCAL_CLASSES, bytes, true);
+                if (c != nullptr && c->count < LOCAL_BLOCKS)
+                {
+                    c->push(memory);
+                    return;
+                }
+            }
+            give_shared(memory, bytes);
+        }
+
+    private:
+        enum
+        {
+            SHARED_CLASSES = 64, // Sizes the cache keeps blocks of; blocks of other sizes are freed
+            LOCAL_CLASSES = 8,   // Sizes each thread keeps blocks of
+            LOCAL_BLOCKS = 4     // Blocks of each size each thread keeps
+        };
+
+        struct FreeBlock
+        {
+            FreeBlock *next;
+        };
+
+        struct SizeClass
+        {
+            size_t bytes;
+            FreeBlock *head;
+            size_t count;
+
+            void push(void *memory)
+            {
+                FreeBlock *block = static_cast<FreeBlock *>(memory);
+                block->next = head;
+                head = block;
+                ++count;
+            }
+
+            void *pop()
+            {
+                FreeBlock *block = head;
+                head = block->next;
+                --count;
+                return block;
+            }
+        };
+
+        struct Shared
+        {
+            std::mutex mutex;
+            weak_atomic<size_t> limit;
+            weak_atomic<unsigned> epoch; // Bumped by every set_limit
+            size_t bytes;
+            SizeClass classes[SHARED_CLASSES];
+
+            Shared() : limit(static_cast<size_t>(0)), epoch(0u), bytes(0), classes() {}
+        };
+
+        struct Local
+        {
+            SizeClass classes[LOCAL_CLASSES];
+            unsigned epoch; // Shared::epoch as of the last flush
+
+            Local() : classes(), epoch(0) {}
 
-    template <typename T, size_t MAX_BLOCK_SIZE = 512>
+            ~Local()
+            {
+                flush();
+                gone() = true;
+            }
+
+            void flush()
+            {
+                for (size_t i = 0; i != LOCAL_CLASSES; ++i)
+                {
+                    while (classes[i].head != nullptr)
+                    {
+                        give_shared(classes[i].pop(), classes[i].bytes);
+                    }
+                }
+            }
+        };
+
+        // Never destroyed, since queues with static storage duration may give it blocks
+        // after static destructors have run
+        static Shared &shared()
+        {
+            static Shared *cache = new Shared();
+            return *cache;
+        }
+
+        // This thread's blocks, or nullptr once the thread's cache has been destroyed.
+        // They're handed back first if set_limit has been called since the last time.
+        static Local *local()
+        {
+            if (gone())
+            {
+                return nullptr;
+            }
+            static thread_local Local cache;
+            unsigned epoch = shared().epoch.load();
+            if (cache.epoch != epoch)
+            {
+                cache.epoch = epoch;
+                cache.flush();
+            }
+            return &cache;
+        }
+
+        static bool &gone()
+        {
+            static thread_local bool result = false;
+            return result;
+        }
+
+        // The class of `bytes` among `classes`; if there's none and `claim`, an empty
+        // class is taken over for `bytes`. Returns nullptr if there's no such class.
+        static SizeClass *find(SizeClass *classes, size_t count, size_t bytes, bool claim)
+        {
+            SizeClass *unused = nullptr;
+            for (size_t i = 0; i != count; ++i)
+            {
+                if (classes[i].bytes == bytes)
+                {
+                    return &classes[i];
+                }
+                if (unused == nullptr && classes[i].head == nullptr)
+                {
+                    unused = &classes[i];
+                }
+            }
+            if (!claim || unused == nullptr)
+            {
+                return nullptr;
+            }
+            unused->bytes = bytes;
+            return unused;
+        }
+
+        static void give_shared(void *memory, size_t bytes)
+        {
+            Shared &cache = shared();
+            {
+                std::lock_guard<std::mutex> lock(cache.mutex);
+                if (bytes <= cache.limit.load() && cache.bytes <= cache.limit.load() - bytes)
+                {
+                    SizeClass *c = find(cache.classes, SHARED_CLASSES, bytes, true);
+                    if (c != nullptr)
+                    {
+                        c->push(memory);
+                        cache.bytes += bytes;
+                        return;
+                    }
+                }
+            }
+            std::free(memory);
+        }
+    };
+#endif
+
+    // The queue's memory comes from `Allocator`, an allocator of chars (see malloc_allocator).
+    template <typename T, size_t MAX_BLOCK_SIZE = 512, typename Allocator = malloc_allocator<char>>
     class MOODYCAMEL_MAYBE_ALIGN_TO_CACHELINE ReaderWriterQueue
     {
         // Design: Based on a queue-of-queues. The low-level queues are just
@@ -93,7 +339,9 @@ namespace moodycamel
         // consumer is done dequeuing an object, but the consumer knows the tail
         // will never go backwards, only forwards.
         // If there is no room to enqueue an object, an additional block (of
-        // equal size to the last block) is added. Blocks are never removed.
+        // equal size to the last block) is added. Blocks are only removed on
+        // request (see shrink_to), and then only the empty ones between the
+        // tail block and the front block, which only the producer touches.
 
         // 低级队列是一个循环缓冲区，front 和 tail 分别指示下一个元素要出队的地方和下一个元素要入队的地方。每一个低级队列就是一个 block。
         // 为了保持设计的简洁性，每个 block 只浪费一个元素的空间（如果 front == tail，那么队列是空的，不是满的）
@@ -106,16 +354,24 @@ namespace moodycamel
         // 2. 每个 block 是一个环形缓冲区，维护着两个指针，front 和 tail。分别指向每个 block 中具体元素入队和出队的位置。每个 block 中可以存储很多的元素
         // 3. 高级队列的环状链表的形成是由于每个 block 都有一个 next 指针，指向下一个 block
 
+        static_assert(std::is_same<typename std::allocator_traits<Allocator>::value_type, char>::value,
+                      "Allocator must allocate chars (e.g. std::allocator<char>)");
+
     public:
         typedef T value_type;
+        typedef Allocator allocator_type;
 
         // Constructs a queue that can hold at least `size` elements without further
         // allocations. If more than MAX_BLOCK_SIZE elements are requested,
         // then several blocks of MAX_BLOCK_SIZE each are reserved (including
         // at least one extra buffer block).
-        AE_NO_TSAN explicit ReaderWriterQueue(size_t size = 15)
+        AE_NO_TSAN explicit ReaderWriterQueue(size_t size = 15, Allocator const &allocator_ = Allocator())
+            : shrinkTarget(static_cast<size_t>(0)), shrinkRequests(static_cast<size_t>(0)),
+              initialSize(size), allocatedSlots(static_cast<size_t>(0)), allocatedBytes(0), maxSlots(static_cast<size_t>(-1)), maxBytes(static_cast<size_t>(-1)),
+              shrinkRequestsSeen(0), memoryLocked(false), allocator(allocator_)
 #ifndef NDEBUG
-            : enqueuing(false), dequeuing(false)
+              ,
+              enqueuing(false), dequeuing(false)
 #endif
         {
             // auto result = ceilToPow2(MAX_BLOCK_SIZE);
@@ -124,102 +380,90 @@ namespace moodycamel
             assert(MAX_BLOCK_SIZE == ceilToPow2(MAX_BLOCK_SIZE) && "MAX_BLOCK_SIZE must be a power of 2");
             assert(MAX_BLOCK_SIZE >= 2 && "MAX_BLOCK_SIZE must be at least 2");
 
-            Block *firstBlock = nullptr;
-
-            largestBlockSize = ceilToPow2(size + 1); // We need a spare slot to fit size elements in the block
-            /**
-             * 如果 size 大于 MAX_BLOCK_SIZE * 2：则会拆分成多个 block（size 为 MAX_BLOCK_SIZE），并且会多分配一个 block
-             * 举例：
-             * 假如 size 为 2000， 则 largestBlockSize == 2048，此时 MAX_BLOCK_SIZE * 2 == 1024。所以按照每个 block size 为 MAX_BLOCK_SIZE
-             * 分配 block 的话，需要分配 4 个 block。但是在这种情况下会多分配一个 block，即分配 5 个 block。分配的多个 block 形成环形链表（next 指针）
-             *
-             * 但是如果 size 大于 MAX_BLOCK_SIZE 且小于 MAX_BLOCK_SIZE * 2，会分配一个 block，且大小为 size（注意：并不是 MAX_BLOCK_SIZE）
-             **/
-            if (largestBlockSize > MAX_BLOCK_SIZE * 2)
-            {
-                // We need a spare block in case the producer is writing to a different block the consumer is reading from, and
-                // wants to enqueue the maximum number of elements. We also need a spare element in each block to avoid the ambiguity
-                // between front == tail meaning "empty" and "full".
-                // So the effective number of slots that are guaranteed to be usable at any time is the block size - 1 times the
-                // number of blocks - 1. Solving for size and applying a ceiling to the division gives us (after simplifying):
-                // 我们需要一个空闲 block，以防生产者正在写入消费者正在读取的另一个 block，并希望将最大数量的元素放入队列
-                // 我们还需要在每个 block 中添加一个空闲元素，以避免front == tail表示“空”和“满”之间的歧义（make_block 中分配内存的时候分配了多余的内存）
-                // 因此，保证在任何时候可用的插槽的有效数量是 block 的大小 - 1 乘以block数量 - 1。求出大小，然后给除法加一个上限
-                size_t initialBlockCount = (size + MAX_BLOCK_SIZE * 2 - 3) / (MAX_BLOCK_SIZE - 1);
-                largestBlockSize = MAX_BLOCK_SIZE;
-                Block *lastBlock = nullptr;
-                for (size_t i = 0; i != initialBlockCount; ++i)
-                {
-                    auto block = make_block(largestBlockSize);
-                    if (block == nullptr)
-                    {
-#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
-                        throw std::bad_alloc();
-#else
-                        abort();
-#endif
-                    }
-                    if (firstBlock == nullptr)
-                    {
-                        firstBlock = block;
-                    }
-                    else
-                    {
-                        lastBlock->next = block;
-                    }
-                    lastBlock = block;
-                    block->next = firstBlock;
-                }
-            }
-            else
+            frontBlock = nullptr;
+            tailBlock = nullptr;
+            if (!allocate_initial_blocks(size))
             {
-                firstBlock = make_block(largestBlockSize);
-                if (firstBlock == nullptr)
-                {
 #ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
-                    throw std::bad_alloc();
+                throw std::bad_alloc();
 #else
-                    abort();
+                abort();
 #endif
-                }
-                firstBlock->next = firstBlock;
             }
-            frontBlock = firstBlock;
-            tailBlock = firstBlock;
+            frontBlock = initialBlock;
 
             // Make sure the reader/writer threads will have the initialized memory setup above:
             fence(memory_order_sync);
         }
 
+        // Like the constructor above, but allocates nothing until the first enqueue, so that
+        // a queue that is never used costs only the object itself. Note that this first
+        // enqueue allocates the initial blocks even if it's a try_enqueue.
+        AE_NO_TSAN ReaderWriterQueue(size_t size, defer_allocation_t, Allocator const &allocator_ = Allocator())
+            : shrinkTarget(static_cast<size_t>(0)), shrinkRequests(static_cast<size_t>(0)),
+              initialBlock(nullptr), largestBlockSize(size), initialSize(size),
+              allocatedSlots(static_cast<size_t>(0)), allocatedBytes(0), maxSlots(static_cast<size_t>(-1)), maxBytes(static_cast<size_t>(-1)),
+              shrinkRequestsSeen(0), memoryLocked(false), allocator(allocator_)
+#ifndef NDEBUG
+              ,
+              enqueuing(false), dequeuing(false)
+#endif
+        {
+            assert(MAX_BLOCK_SIZE == ceilToPow2(MAX_BLOCK_SIZE) && "MAX_BLOCK_SIZE must be a power of 2");
+            assert(MAX_BLOCK_SIZE >= 2 && "MAX_BLOCK_SIZE must be at least 2");
+
+            frontBlock = nullptr;
+            tailBlock = nullptr;
+            fence(memory_order_sync);
+        }
+
+        // Like the first constructor, but also has the OS map in (and optionally lock) the
+        // memory reserved for elements right away (see prefault_t), so that the first pass
+        // through it doesn't page fault. Blocks that enqueue() adds later are locked too.
+        AE_NO_TSAN ReaderWriterQueue(size_t size, prefault_t options, Allocator const &allocator_ = Allocator())
+            : ReaderWriterQueue(size, allocator_)
+        {
+            prefault_blocks(options.lock);
+        }
+
         // Note: The queue should not be accessed concurrently while it's
         // being moved. It's up to the user to synchronize this.
+        // The moved-from queue is left empty without any blocks (the move never
+        // allocates); it reserves room for 31 elements on its first enqueue, with
+        // a copy of the allocator.
         AE_NO_TSAN ReaderWriterQueue(ReaderWriterQueue &&other)
             : frontBlock(other.frontBlock.load()),
+              shrinkTarget(other.shrinkTarget.load()), shrinkRequests(other.shrinkRequests.load()),
               tailBlock(other.tailBlock.load()),
-              largestBlockSize(other.largestBlockSize)
+              initialBlock(other.initialBlock),
+              largestBlockSize(other.largestBlockSize), initialSize(other.initialSize),
+              allocatedSlots(other.allocatedSlots.load()), allocatedBytes(other.allocatedBytes),
+              maxSlots(other.maxSlots), maxBytes(other.maxBytes),
+              shrinkRequestsSeen(other.shrinkRequestsSeen), memoryLocked(other.memoryLocked),
+              allocator(other.allocator)
 #ifndef NDEBUG
               ,
               enqueuing(false), dequeuing(false)
 #endif
         {
-            // 疑问：为什么需要给 other 分配新的 block
-            other.largestBlockSize = 32;
-            Block *b = other.make_block(other.largestBlockSize);
-            if (b == nullptr)
-            {
-#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
-                throw std::bad_alloc();
-#else
-                abort();
-#endif
-            }
-            b->next = b;
-            other.frontBlock = b;
-            other.tailBlock = b;
+            other.frontBlock = nullptr;
+            other.tailBlock = nullptr;
+            other.initialBlock = nullptr;
+            other.largestBlockSize = 31;
+            other.initialSize = 31;
+            other.allocatedSlots = static_cast<size_t>(0);
+            other.allocatedBytes = 0;
+            other.maxSlots = static_cast<size_t>(-1);
+            other.maxBytes = static_cast<size_t>(-1);
+            other.shrinkTarget = static_cast<size_t>(0);
+            other.shrinkRequests = static_cast<size_t>(0);
+            other.shrinkRequestsSeen = 0;
+            other.memoryLocked = false;
         }
 
         // Note: The queue should not be accessed concurrently while it's
         // being moved. It's up to the user to synchronize this.
+        // Unless the allocators propagate on swap, they must be equal.
         ReaderWriterQueue &operator=(ReaderWriterQueue &&other) AE_NO_TSAN
         {
             Block *b = frontBlock.load();
@@ -228,7 +472,24 @@ namespace moodycamel
             b = tailBlock.load();
             tailBlock = other.tailBlock.load();
             other.tailBlock = b;
+            std::swap(initialBlock, other.initialBlock);
             std::swap(largestBlockSize, other.largestBlockSize);
+            std::swap(initialSize, other.initialSize);
+            size_t n = allocatedSlots.load();
+            allocatedSlots = other.allocatedSlots.load();
+            other.allocatedSlots = n;
+            std::swap(allocatedBytes, other.allocatedBytes);
+            std::swap(maxSlots, other.maxSlots);
+            std::swap(maxBytes, other.maxBytes);
+            n = shrinkTarget.load();
+            shrinkTarget = other.shrinkTarget.load();
+            other.shrinkTarget = n;
+            n = shrinkRequests.load();
+            shrinkRequests = other.shrinkRequests.load();
+            other.shrinkRequests = n;
+            std::swap(shrinkRequestsSeen, other.shrinkRequestsSeen);
+            std::swap(memoryLocked, other.memoryLocked);
+            details::swap_allocators(allocator, other.allocator);
             return *this;
         }
 
@@ -241,6 +502,15 @@ namespace moodycamel
 
             // Destroy any remaining objects in queue and free memory
             Block *frontBlock_ = frontBlock;
+            if (frontBlock_ == nullptr)
+            {
+                // The consumer never looked at the blocks (if there are any)
+                frontBlock_ = tailBlock.load() != nullptr ? initialBlock : nullptr;
+                if (frontBlock_ == nullptr)
+                {
+                    return;
+                }
+            }
             Block *block = frontBlock_;
             do
             {
@@ -255,16 +525,15 @@ namespace moodycamel
                     (void)element;
                 }
 
-                auto rawBlock = block->rawThis;
-                block->~Block();
-                std::free(rawBlock);
+                destroy_block(block, memoryLocked);
                 block = nextBlock;
             } while (block != frontBlock_);
         }
 
         // Enqueues a copy of element if there is room in the queue.
         // Returns true if the element was enqueued, false otherwise.
-        // Does not allocate memory.
+        // Does not allocate memory (other than the initial blocks of a queue
+        // constructed with defer_allocation, or of a moved-from queue).
         AE_FORCEINLINE bool try_enqueue(T const &element) AE_NO_TSAN
         {
             return inner_enqueue<CannotAlloc>(element);
@@ -272,7 +541,8 @@ namespace moodycamel
 
         // Enqueues a moved copy of element if there is room in the queue.
         // Returns true if the element was enqueued, false otherwise.
-        // Does not allocate memory.
+        // Does not allocate memory (other than the initial blocks of a queue
+        // constructed with defer_allocation, or of a moved-from queue).
         AE_FORCEINLINE bool try_enqueue(T &&element) AE_NO_TSAN
         {
             return inner_enqueue<CannotAlloc>(std::forward<T>(element));
@@ -312,6 +582,51 @@ namespace moodycamel
         }
 #endif
 
+        // Enqueues copies of the count elements starting at first (wrap the iterator in
+        // std::make_move_iterator to move them instead), as many as there is room for.
+        // Returns how many were enqueued; these are always the first ones of the range.
+        // Does not allocate memory (see try_enqueue).
+        // The elements are constructed in place and handed to the consumer a block at a
+        // time. If a constructor throws, the elements constructed before it are still
+        // enqueued (so the queue holds a prefix of the range), and the exception is passed on.
+        template <typename It>
+        size_t try_enqueue_bulk(It first, size_t count) AE_NO_TSAN
+        {
+            size_t done = 0;
+            inner_enqueue_bulk<CannotAlloc>(first, count, done);
+            return done;
+        }
+
+        // Like try_enqueue_bulk, but allocates additional blocks of memory as needed;
+        // only enqueues fewer than count elements if memory allocation fails.
+        template <typename It>
+        size_t enqueue_bulk(It first, size_t count) AE_NO_TSAN
+        {
+            size_t done = 0;
+            inner_enqueue_bulk<CanAlloc>(first, count, done);
+            return done;
+        }
+
+        // Enqueues an element that fill(T &) sets up in place, if there is room in the queue:
+        // the slot's element is default-constructed (so a trivial T is left uninitialized),
+        // passed to fill, and only then handed to the consumer. For large elements, this
+        // saves building a temporary and moving it in. Returns true if the element was enqueued.
+        // If fill throws, the element is destroyed again and nothing is enqueued.
+        // Does not allocate memory (see try_enqueue).
+        template <typename F>
+        AE_FORCEINLINE bool try_enqueue_with(F &&fill) AE_NO_TSAN
+        {
+            return inner_enqueue<CannotAlloc>(SlotFiller<F>(fill));
+        }
+
+        // Like try_enqueue_with, but allocates an additional block of memory if needed.
+        // Only fails (returns false) if memory allocation fails.
+        template <typename F>
+        AE_FORCEINLINE bool enqueue_with(F &&fill) AE_NO_TSAN
+        {
+            return inner_enqueue<CanAlloc>(SlotFiller<F>(fill));
+        }
+
         // Attempts to dequeue an element; if the queue is empty,
         // returns false instead. If the queue has at least one element,
         // moves front to result using operator=, then returns true.
@@ -341,6 +656,10 @@ namespace moodycamel
 
             // 先读取 frontBlock ，出队元素要从 frontBlock 中出队
             Block *frontBlock_ = frontBlock.load();
+            if (frontBlock_ == nullptr && (frontBlock_ = adopt_initial_block()) == nullptr)
+            {
+                return false;
+            }
             /**
              * 注意：这是一个 SPSC 队列，同时只会有一个生产者线程在入队，并且只会有一个消费者线程在出队。
              *
@@ -368,8 +687,7 @@ namespace moodycamel
             non_empty_front_block:
                 // Front block not empty, dequeue from here
                 auto element = reinterpret_cast<T *>(frontBlock_->data + blockFront * sizeof(T));
-                result = std::move(*element);
-                element->~T();
+                take_slot(element, result);
 
                 // 更新 block front
                 blockFront = (blockFront + 1) & frontBlock_->sizeMask;
@@ -421,8 +739,7 @@ namespace moodycamel
 
                 auto element = reinterpret_cast<T *>(frontBlock_->data + nextBlockFront * sizeof(T));
 
-                result = std::move(*element);
-                element->~T();
+                take_slot(element, result);
 
                 nextBlockFront = (nextBlockFront + 1) & frontBlock_->sizeMask;
 
@@ -440,6 +757,30 @@ namespace moodycamel
             return true;
         }
 
+        // Like try_dequeue, but instead of moving the front element out, calls f(T &) on it
+        // where it is in the queue, then destroys it; for large elements that are only read
+        // once, this saves a move. Returns false (without calling f) if the queue is empty.
+        // If f throws, the element stays at the front of the queue.
+        template <typename F>
+        AE_FORCEINLINE bool try_consume(F &&f) AE_NO_TSAN
+        {
+            SlotConsumer<F> consumer(f);
+            return try_dequeue(consumer);
+        }
+
+        // Dequeues up to max elements, moving them one after the other to *out++ (out can
+        // be a pointer into an array, or e.g. a std::back_insert_iterator). Returns how many
+        // were dequeued. The slots are handed back to the producer a block at a time.
+        // If an assignment to *out throws, the elements before it are still dequeued, the
+        // one being assigned stays at the front of the queue, and the exception is passed on.
+        template <typename It>
+        size_t try_dequeue_bulk(It out, size_t max) AE_NO_TSAN
+        {
+            size_t done = 0;
+            inner_dequeue_bulk(out, max, done);
+            return done;
+        }
+
         // Returns a pointer to the front element in the queue (the one that
         // would be removed next by a call to `try_dequeue` or `pop`). If the
         // queue appears empty at the time the method is called, nullptr is
@@ -453,6 +794,10 @@ namespace moodycamel
             // See try_dequeue() for reasoning
 
             Block *frontBlock_ = frontBlock.load();
+            if (frontBlock_ == nullptr && (frontBlock_ = adopt_initial_block()) == nullptr)
+            {
+                return nullptr;
+            }
             size_t blockTail = frontBlock_->localTail;
             size_t blockFront = frontBlock_->front.load();
 
@@ -498,6 +843,10 @@ namespace moodycamel
             // See try_dequeue() for reasoning
 
             Block *frontBlock_ = frontBlock.load();
+            if (frontBlock_ == nullptr && (frontBlock_ = adopt_initial_block()) == nullptr)
+            {
+                return false;
+            }
             size_t blockTail = frontBlock_->localTail;
             size_t blockFront = frontBlock_->front.load();
 
@@ -564,16 +913,27 @@ namespace moodycamel
         inline size_t size_approx() const AE_NO_TSAN
         {
             size_t result = 0;
-            Block *frontBlock_ = frontBlock.load();
+            Block *frontBlock_ = any_front_block();
+            if (frontBlock_ == nullptr)
+            {
+                return 0;
+            }
+            // Only the blocks from the front block to the tail block can hold elements; the
+            // others may be freed by shrink_to at any moment, so they're not looked at
+            Block *tailBlock_ = tailBlock.load();
             Block *block = frontBlock_;
-            do
+            while (true)
             {
                 fence(memory_order_acquire);
                 size_t blockFront = block->front.load();
                 size_t blockTail = block->tail.load();
                 result += (blockTail - blockFront) & block->sizeMask; // 不用循环，可一次性计算一个 block 中现有的元素数量
+                if (block == tailBlock_)
+                {
+                    break;
+                }
                 block = block->next.load();
-            } while (block != frontBlock_);
+            }
             return result;
         }
 
@@ -588,34 +948,154 @@ namespace moodycamel
         //       reading from the whole time.
         inline size_t max_capacity() const
         {
-            size_t result = 0;
-            Block *frontBlock_ = frontBlock.load();
-            Block *block = frontBlock_;
-            do
+            if (tailBlock.load() == nullptr)
             {
-                fence(memory_order_acquire);
-                result += block->sizeMask;
-                block = block->next.load();
-            } while (block != frontBlock_);
-            return result;
+                // Nothing allocated yet; report what the first enqueue will reserve
+                return initial_capacity(initialSize);
+            }
+            fence(memory_order_acquire);
+            return allocatedSlots.load();
         }
 
-    private:
-        enum AllocationMode
+        // Caps how far enqueue() may grow the queue: instead of allocating a block that would
+        // take the total room for elements past `max_elements`, or the memory held by the
+        // queue's blocks past `max_bytes`, it allocates a smaller one that fits, or fails.
+        // (What the constructor reserves is allocated regardless.) Pass size_t(-1) for no limit.
+        // Must be called from the producer thread (or before the queue is shared).
+        void set_growth_limit(size_t max_elements, size_t max_bytes = static_cast<size_t>(-1)) AE_NO_TSAN
         {
-            CanAlloc,
-            CannotAlloc
-        };
+            maxSlots = max_elements;
+            maxBytes = max_bytes;
+        }
 
-#if MOODYCAMEL_HAS_EMPLACE
-        template <AllocationMode canAlloc, typename... Args>
-        bool inner_enqueue(Args &&...args) AE_NO_TSAN
-#else
-        template <AllocationMode canAlloc, typename U>
-        bool inner_enqueue(U &&element) AE_NO_TSAN
-#endif
+        // Returns the memory held by the queue's blocks, in bytes (what set_growth_limit's
+        // max_bytes applies to).
+        // Must be called from the producer thread.
+        inline size_t allocated_bytes() const AE_NO_TSAN
         {
-#ifndef NDEBUG
+            return allocatedBytes;
+        }
+
+        // Whether the queue's memory is locked into RAM (see prefault_t)
+        inline bool memory_locked() const AE_NO_TSAN
+        {
+            return memoryLocked;
+        }
+
+        allocator_type get_allocator() const AE_NO_TSAN
+        {
+            return allocator;
+        }
+
+        // Frees the blocks that hold no elements, as long as that leaves room for at least
+        // `target_capacity` elements (as reported by max_capacity()), to give back the memory
+        // a burst made the queue grow into. Blocks the elements are in are never freed, so the
+        // capacity may stay above the target. Returns the new max_capacity().
+        // Must be called from the producer thread; see request_shrink for the consumer.
+        size_t shrink_to(size_t target_capacity) AE_NO_TSAN
+        {
+#ifndef NDEBUG
+            ReentrantGuard guard(this->enqueuing);
+#endif
+            release_free_blocks(target_capacity);
+            return max_capacity();
+        }
+
+        // Like shrink_to, but for the consumer thread: the blocks are freed by the producer,
+        // the next time an enqueue fills up a block (so not at all if nothing is enqueued).
+        // Only the latest request is carried out.
+        void request_shrink(size_t target_capacity) AE_NO_TSAN
+        {
+            shrinkTarget = target_capacity;
+            fence(memory_order_release);
+            shrinkRequests = shrinkRequests.load() + 1;
+        }
+
+    private:
+        // For the bulk operations, which need to know how far they got if an exception is thrown
+        template <typename, size_t, typename>
+        friend class BlockingReaderWriterQueue;
+
+        enum AllocationMode
+        {
+            CanAlloc,
+            CannotAlloc
+        };
+
+        // What enqueue_with passes to inner_enqueue in place of the element
+        template <typename F>
+        struct SlotFiller
+        {
+            explicit SlotFiller(F &fill_) : fill(fill_) {}
+            F &fill;
+        };
+
+        // What try_consume passes to try_dequeue in place of the result
+        template <typename F>
+        struct SlotConsumer
+        {
+            explicit SlotConsumer(F &consume_) : consume(consume_) {}
+            F &consume;
+        };
+
+        // Moves the front element to try_dequeue's result, and destroys it
+        template <typename U>
+        static AE_FORCEINLINE void take_slot(T *element, U &result) AE_NO_TSAN
+        {
+            result = std::move(*element);
+            element->~T();
+        }
+
+        template <typename F>
+        static AE_FORCEINLINE void take_slot(T *element, SlotConsumer<F> &consumer) AE_NO_TSAN
+        {
+            consumer.consume(*element);
+            element->~T();
+        }
+
+        // Constructs the element inner_enqueue was given in a free slot
+#if MOODYCAMEL_HAS_EMPLACE
+        template <typename... Args>
+        static AE_FORCEINLINE void construct_slot(char *location, Args &&...args) AE_NO_TSAN
+        {
+            new (location) T(std::forward<Args>(args)...);
+        }
+#else
+        template <typename U>
+        static AE_FORCEINLINE void construct_slot(char *location, U &&element) AE_NO_TSAN
+        {
+            new (location) T(std::forward<U>(element));
+        }
+#endif
+
+        template <typename F>
+        static AE_FORCEINLINE void construct_slot(char *location, SlotFiller<F> &&filler) AE_NO_TSAN
+        {
+            T *element = new (location) T;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            try
+            {
+                filler.fill(*element);
+            }
+            catch (...)
+            {
+                element->~T();
+                throw;
+            }
+#else
+            filler.fill(*element);
+#endif
+        }
+
+#if MOODYCAMEL_HAS_EMPLACE
+        template <AllocationMode canAlloc, typename... Args>
+        bool inner_enqueue(Args &&...args) AE_NO_TSAN
+#else
+        template <AllocationMode canAlloc, typename U>
+        bool inner_enqueue(U &&element) AE_NO_TSAN
+#endif
+        {
+#ifndef NDEBUG
             ReentrantGuard guard(this->enqueuing);
 #endif
 
@@ -628,6 +1108,16 @@ namespace moodycamel
 
             // 获取环形链表的最后一个 block
             Block *tailBlock_ = tailBlock.load();
+            if (tailBlock_ == nullptr)
+            {
+                // No blocks yet (allocation was deferred, or the queue was moved from); reserve
+                // the initial ones now, whether or not we're otherwise allowed to allocate
+                if (!allocate_initial_blocks(initialSize))
+                {
+                    return false;
+                }
+                tailBlock_ = tailBlock.load();
+            }
             // 读取 tail block 的 front 和 tail
             size_t blockFront = tailBlock_->localFront;
             // tail 是入队的位置
@@ -653,9 +1143,9 @@ namespace moodycamel
                 // 移动指针，空出空间，以便后续可以使用 placement new 的方式创建元素
                 char *location = tailBlock_->data + blockTail * sizeof(T);
 #if MOODYCAMEL_HAS_EMPLACE
-                new (location) T(std::forward<Args>(args)...);
+                construct_slot(location, std::forward<Args>(args)...);
 #else
-                new (location) T(std::forward<U>(element));
+                construct_slot(location, std::forward<U>(element));
 #endif
 
                 fence(memory_order_release);
@@ -665,9 +1155,20 @@ namespace moodycamel
             else
             {
                 // tail block 已满
+                size_t shrinkRequests_ = shrinkRequests.load();
+                if (shrinkRequests_ != shrinkRequestsSeen)
+                {
+                    // The consumer asked for memory back (see request_shrink)
+                    shrinkRequestsSeen = shrinkRequests_;
+                    fence(memory_order_acquire);
+                    release_free_blocks(shrinkTarget.load());
+                }
                 fence(memory_order_acquire);
                 // tail block 后面有空闲 block
-                if (tailBlock_->next.load() != frontBlock)
+                // (until the consumer first looks at the blocks, frontBlock is still null and the
+                // consumer is logically at initialBlock)
+                Block *frontBlock_ = frontBlock.load();
+                if (tailBlock_->next.load() != (frontBlock_ != nullptr ? frontBlock_ : initialBlock))
                 {
                     // Note that the reason we can't advance to the frontBlock and start adding new entries there
                     // is because if we did, then dequeue would stay in that block, eventually reading the new values,
@@ -692,9 +1193,9 @@ namespace moodycamel
 
                     char *location = tailBlockNext->data + nextBlockTail * sizeof(T);
 #if MOODYCAMEL_HAS_EMPLACE
-                    new (location) T(std::forward<Args>(args)...);
+                    construct_slot(location, std::forward<Args>(args)...);
 #else
-                    new (location) T(std::forward<U>(element));
+                    construct_slot(location, std::forward<U>(element));
 #endif
 
                     // 更新 block 的 tail 值
@@ -709,19 +1210,50 @@ namespace moodycamel
                 {
                     // tailBlock is full and there's no free block ahead; create a new block
                     auto newBlockSize = largestBlockSize >= MAX_BLOCK_SIZE ? largestBlockSize : largestBlockSize * 2;
+                    while (!within_growth_limit(newBlockSize))
+                    {
+                        // Settle for a smaller block, if one fits
+                        if (newBlockSize <= 2)
+                        {
+                            return false;
+                        }
+                        newBlockSize >>= 1;
+                    }
                     auto newBlock = make_block(newBlockSize);
                     if (newBlock == nullptr)
                     {
                         // Could not allocate a block!
                         return false;
                     }
-                    largestBlockSize = newBlockSize;
 
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+                    try
+                    {
+#endif
 #if MOODYCAMEL_HAS_EMPLACE
-                    new (newBlock->data) T(std::forward<Args>(args)...);
+                        construct_slot(newBlock->data, std::forward<Args>(args)...);
 #else
-                    new (newBlock->data) T(std::forward<U>(element));
+                        construct_slot(newBlock->data, std::forward<U>(element));
+#endif
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+                    }
+                    catch (...)
+                    {
+                        // Nothing was enqueued, so the queue doesn't keep the block either
+                        destroy_block(newBlock);
+                        throw;
+                    }
 #endif
+                    if (newBlockSize > largestBlockSize)
+                    {
+                        largestBlockSize = newBlockSize;
+                    }
+                    if (memoryLocked)
+                    {
+                        details::lock_pages(newBlock->rawThis, block_bytes(newBlockSize));
+                    }
+                    allocatedSlots = allocatedSlots.load() + (newBlockSize - 1);
+                    allocatedBytes += block_bytes(newBlockSize);
                     assert(newBlock->front == 0);
                     newBlock->tail = newBlock->localTail = 1;
 
@@ -754,6 +1286,181 @@ namespace moodycamel
             return true;
         }
 
+        // The bulk operations work a block at a time: all the elements that fit in the
+        // current block are constructed (or moved out) first, and then published with a
+        // single store to the block's tail (or front). Moving on to the next block is left
+        // to inner_enqueue (or try_dequeue), one element at a time. `done` is kept up to
+        // date even if an exception is thrown, so that BlockingReaderWriterQueue can count
+        // what went through.
+        template <AllocationMode canAlloc, typename It>
+        void inner_enqueue_bulk(It &first, size_t count, size_t &done) AE_NO_TSAN
+        {
+            while (done != count)
+            {
+                fill_tail_block(first, count, done);
+                if (done == count)
+                {
+                    break;
+                }
+                // The tail block is full (or there are no blocks yet)
+                if (!inner_enqueue<canAlloc>(*first))
+                {
+                    break;
+                }
+                ++first;
+                ++done;
+            }
+        }
+
+        template <typename It>
+        void fill_tail_block(It &first, size_t count, size_t &done) AE_NO_TSAN
+        {
+#ifndef NDEBUG
+            ReentrantGuard guard(this->enqueuing);
+#endif
+            Block *tailBlock_ = tailBlock.load();
+            if (tailBlock_ == nullptr)
+            {
+                return;
+            }
+            size_t blockTail = tailBlock_->tail.load();
+            size_t wanted = count - done;
+            // One slot always stays empty (see inner_enqueue)
+            size_t room = (tailBlock_->localFront - blockTail - 1) & tailBlock_->sizeMask;
+            if (room < wanted)
+            {
+                tailBlock_->localFront = tailBlock_->front.load();
+                room = (tailBlock_->localFront - blockTail - 1) & tailBlock_->sizeMask;
+            }
+            size_t n = room < wanted ? room : wanted;
+            if (n == 0)
+            {
+                return;
+            }
+            fence(memory_order_acquire);
+
+            size_t i = 0;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            if (!std::is_nothrow_constructible<T, decltype(*first)>::value)
+            {
+                try
+                {
+                    while (i != n)
+                    {
+                        new (tailBlock_->data + ((blockTail + i) & tailBlock_->sizeMask) * sizeof(T)) T(*first);
+                        ++i;
+                        ++first;
+                    }
+                }
+                catch (...)
+                {
+                    fence(memory_order_release);
+                    tailBlock_->tail = (blockTail + i) & tailBlock_->sizeMask;
+                    done += i;
+                    throw;
+                }
+            }
+            else
+#endif
+            {
+                // Nothing can throw, so there's nothing to keep track of
+                for (; i != n; ++i, ++first)
+                {
+                    new (tailBlock_->data + ((blockTail + i) & tailBlock_->sizeMask) * sizeof(T)) T(*first);
+                }
+            }
+
+            fence(memory_order_release);
+            tailBlock_->tail = (blockTail + n) & tailBlock_->sizeMask;
+            done += n;
+        }
+
+        template <typename It>
+        void inner_dequeue_bulk(It &out, size_t max, size_t &done) AE_NO_TSAN
+        {
+            while (done != max)
+            {
+                drain_front_block(out, max, done);
+                if (done == max)
+                {
+                    break;
+                }
+                // The front block looks empty; there may be another block ahead
+                auto &&result = *out;
+                if (!try_dequeue(result))
+                {
+                    break;
+                }
+                ++out;
+                ++done;
+            }
+        }
+
+        template <typename It>
+        void drain_front_block(It &out, size_t max, size_t &done) AE_NO_TSAN
+        {
+#ifndef NDEBUG
+            ReentrantGuard guard(this->dequeuing);
+#endif
+            Block *frontBlock_ = frontBlock.load();
+            if (frontBlock_ == nullptr)
+            {
+                return;
+            }
+            size_t blockFront = frontBlock_->front.load();
+            size_t wanted = max - done;
+            size_t available = (frontBlock_->localTail - blockFront) & frontBlock_->sizeMask;
+            if (available < wanted)
+            {
+                frontBlock_->localTail = frontBlock_->tail.load();
+                available = (frontBlock_->localTail - blockFront) & frontBlock_->sizeMask;
+            }
+            size_t n = available < wanted ? available : wanted;
+            if (n == 0)
+            {
+                return;
+            }
+            fence(memory_order_acquire);
+
+            size_t i = 0;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            if (!std::is_nothrow_assignable<decltype(*out), T &&>::value)
+            {
+                try
+                {
+                    while (i != n)
+                    {
+                        auto element = reinterpret_cast<T *>(frontBlock_->data + ((blockFront + i) & frontBlock_->sizeMask) * sizeof(T));
+                        *out = std::move(*element);
+                        element->~T();
+                        ++i;
+                        ++out;
+                    }
+                }
+                catch (...)
+                {
+                    fence(memory_order_release);
+                    frontBlock_->front = (blockFront + i) & frontBlock_->sizeMask;
+                    done += i;
+                    throw;
+                }
+            }
+            else
+#endif
+            {
+                for (; i != n; ++i, ++out)
+                {
+                    auto element = reinterpret_cast<T *>(frontBlock_->data + ((blockFront + i) & frontBlock_->sizeMask) * sizeof(T));
+                    *out = std::move(*element);
+                    element->~T();
+                }
+            }
+
+            fence(memory_order_release);
+            frontBlock_->front = (blockFront + n) & frontBlock_->sizeMask;
+            done += n;
+        }
+
         // Disable copying
         // ReaderWriterQueue(ReaderWriterQueue const &) = delete;
         ReaderWriterQueue(ReaderWriterQueue const &) {}
@@ -786,6 +1493,12 @@ namespace moodycamel
             return ptr + (alignment - (reinterpret_cast<std::uintptr_t>(ptr) % alignment)) % alignment;
         }
 
+        static AE_FORCEINLINE char *align_to_cacheline(char *ptr) AE_NO_TSAN
+        {
+            const std::size_t alignment = MOODYCAMEL_CACHE_LINE_SIZE;
+            return ptr + (alignment - (reinterpret_cast<std::uintptr_t>(ptr) % alignment)) % alignment;
+        }
+
     private:
 #ifndef NDEBUG
         struct ReentrantGuard
@@ -841,122 +1554,500 @@ namespace moodycamel
             char *rawThis; // 指向 block 内存的指针
         };
 
-        static Block *make_block(size_t capacity) AE_NO_TSAN
+        // The size of the allocation that make_block(capacity) makes
+        static size_t block_bytes(size_t capacity) AE_NO_TSAN
         {
-            // Allocate enough memory for the block itself, as well as all the elements it will contain
-            // >>>>>>>>>>>> sizeof(Block) = 160
-            // std::cout << "sizeof(Block) = " << sizeof(Block) << std::endl;
-            // >>>>>>>>>>>> std::alignment_of<Block>::value = 8
-            // std::cout << "std::alignment_of<Block>::value = " << std::alignment_of<Block>::value << std::endl;
             // 为 block 本身分配内存
-            auto size = sizeof(Block) + std::alignment_of<Block>::value - 1;
+            size_t size = sizeof(Block) + MOODYCAMEL_CACHE_LINE_SIZE - 1;
             // 为 block 中存储的所有元素分配内存
             // 疑问：为什么分配内存的时候需要用到内存对齐 std::alignment_of<T>::value？多分配了内存？
             // ans: 为了保持设计的简洁性（即为了 front == tail 时，队列是空的，不是满的），所以每一个 block 都浪费了一个元素的空间
             // ans: 在每个块中添加一个空闲元素，以避免front == tail表示“空”和“满”之间的歧义
-            size += sizeof(T) * capacity + std::alignment_of<T>::value - 1;
-            auto newBlockRaw = static_cast<char *>(std::malloc(size));
-            if (newBlockRaw == nullptr)
-            {
-                return nullptr;
-            }
-
-            // 移动指针，计算 block 在刚分配的内存空间的偏移地址
-            auto newBlockAligned = align_for<Block>(newBlockRaw);
-            // 移动指针，计算 每个元素 在刚分配的内存空间的偏移地址
-            auto newBlockData = align_for<T>(newBlockAligned + sizeof(Block));
-            return new (newBlockAligned) Block(capacity, newBlockRaw, newBlockData);
-        }
-
-    private:
-        weak_atomic<Block *> frontBlock; // (Atomic) Elements are dequeued from this block
-
-        char cachelineFiller[MOODYCAMEL_CACHE_LINE_SIZE - sizeof(weak_atomic<Block *>)];
-        weak_atomic<Block *> tailBlock; // (Atomic) Elements are enqueued to this block
-
-        size_t largestBlockSize;
-
-#ifndef NDEBUG
-        weak_atomic<bool> enqueuing;
-        mutable weak_atomic<bool> dequeuing;
-#endif
-    };
-
-    // Like ReaderWriterQueue, but also providees blocking operations
-    template <typename T, size_t MAX_BLOCK_SIZE = 512>
-    class BlockingReaderWriterQueue
-    {
-    private:
-        typedef ::moodycamel::ReaderWriterQueue<T, MAX_BLOCK_SIZE> ReaderWriterQueue;
-
-    public:
-        explicit BlockingReaderWriterQueue(size_t size = 15) AE_NO_TSAN
-            : inner(size),
-              sema(new spsc_sema::LightweightSemaphore())
-        {
-        }
-
-        BlockingReaderWriterQueue(BlockingReaderWriterQueue &&other) AE_NO_TSAN
-            : inner(std::move(other.inner)),
-              sema(std::move(other.sema))
-        {
+            size += MOODYCAMEL_CACHE_LINE_SIZE - 1 + sizeof(T) * capacity + std::alignment_of<T>::value - 1;
+            return size;
         }
 
-        BlockingReaderWriterQueue &operator=(BlockingReaderWriterQueue &&other) AE_NO_TSAN
+        // Whether a new block of `capacity` stays within set_growth_limit's limits
+        bool within_growth_limit(size_t capacity) const AE_NO_TSAN
         {
-            std::swap(sema, other.sema);
-            std::swap(inner, other.inner);
-            return *this;
+            size_t allocatedSlots_ = allocatedSlots.load();
+            return allocatedSlots_ <= maxSlots && capacity - 1 <= maxSlots - allocatedSlots_ &&
+                   allocatedBytes <= maxBytes && block_bytes(capacity) <= maxBytes - allocatedBytes;
         }
 
-        // Enqueues a copy of element if there is room in the queue.
-        // Returns true if the element was enqueued, false otherwise.
-        // Does not allocate memory.
-        AE_FORCEINLINE bool try_enqueue(T const &element) AE_NO_TSAN
+        Block *make_block(size_t capacity) AE_NO_TSAN
         {
-            if (inner.try_enqueue(element))
+            // Allocate enough memory for the block itself, as well as all the elements it will contain
+            // >>>>>>>>>>>> sizeof(Block) = 160
+            // std::cout << "sizeof(Block) = " << sizeof(Block) << std::endl;
+            // >>>>>>>>>>>> std::alignment_of<Block>::value = 8
+            // std::cout << "std::alignment_of<Block>::value = " << std::alignment_of<Block>::value << std::endl;
+            auto newBlockRaw = allocate_bytes(block_bytes(capacity));
+            if (newBlockRaw == nullptr)
             {
-                sema->signal();
-                return true;
+                return nullptr;
             }
-            return false;
-        }
 
-        // Enqueues a moved copy of element if there is room in the queue.
-        // Returns true if the element was enqueued, false otherwise.
-        // Does not allocate memory.
-        AE_FORCEINLINE bool try_enqueue(T &&element) AE_NO_TSAN
-        {
-            if (inner.try_enqueue(std::forward<T>(element)))
-            {
-                sema->signal();
-                return true;
-            }
-            return false;
+            // 移动指针，计算 block 在刚分配的内存空间的偏移地址
+            // The block header and the elements each start on their own cache line, so that
+            // neither shares a line with the other (nor with unrelated heap data)
+            auto newBlockAligned = align_to_cacheline(newBlockRaw);
+            // 移动指针，计算 每个元素 在刚分配的内存空间的偏移地址
+            auto newBlockData = align_for<T>(align_to_cacheline(newBlockAligned + sizeof(Block)));
+            return new (newBlockAligned) Block(capacity, newBlockRaw, newBlockData);
         }
 
-#if MOODYCAMEL_HAS_EMPLACE
-        // Like try_enqueue() but with emplace semantics (i.e. construct-in-place).
-        template <typename... Args>
-        AE_FORCEINLINE bool try_emplace(Args &&...args) AE_NO_TSAN
+        // Allocates the ring of blocks that holds at least `size` elements, and makes it the
+        // queue's (empty) contents. Called by the constructor, and by the producer on the
+        // first enqueue into a queue that has no blocks yet (see defer_allocation_t, and
+        // the move constructor).
+        // Returns false if memory allocation fails.
+        bool allocate_initial_blocks(size_t size) AE_NO_TSAN
         {
-            if (inner.try_emplace(std::forward<Args>(args)...))
-            {
-                sema->signal();
-                return true;
-            }
-            return false;
-        }
-#endif
+            Block *firstBlock = nullptr;
 
-        // Enqueues a copy of element on the queue.
-        // Allocates an additional block of memory if needed.
-        // Only fails (returns false) if memory allocation fails.
+            size_t blockSize = ceilToPow2(size + 1); // We need a spare slot to fit size elements in the block
+            /**
+             * 如果 size 大于 MAX_BLOCK_SIZE * 2：则会拆分成多个 block（size 为 MAX_BLOCK_SIZE），并且会多分配一个 block
+             * 举例：
+             * 假如 size 为 2000， 则 largestBlockSize == 2048，此时 MAX_BLOCK_SIZE * 2 == 1024。所以按照每个 block size 为 MAX_BLOCK_SIZE
+             * 分配 block 的话，需要分配 4 个 block。但是在这种情况下会多分配一个 block，即分配 5 个 block。分配的多个 block 形成环形链表（next 指针）
+             *
+             * 但是如果 size 大于 MAX_BLOCK_SIZE 且小于 MAX_BLOCK_SIZE * 2，会分配一个 block，且大小为 size（注意：并不是 MAX_BLOCK_SIZE）
+             **/
+            if (blockSize > MAX_BLOCK_SIZE * 2)
+            {
+                // We need a spare block in case the producer is writing to a different block the consumer is reading from, and
+                // wants to enqueue the maximum number of elements. We also need a spare element in each block to avoid the ambiguity
+                // between front == tail meaning "empty" and "full".
+                // So the effective number of slots that are guaranteed to be usable at any time is the block size - 1 times the
+                // number of blocks - 1. Solving for size and applying a ceiling to the division gives us (after simplifying):
+                // 我们需要一个空闲 block，以防生产者正在写入消费者正在读取的另一个 block，并希望将最大数量的元素放入队列
+                // 我们还需要在每个 block 中添加一个空闲元素，以避免front == tail表示“空”和“满”之间的歧义（make_block 中分配内存的时候分配了多余的内存）
+                // 因此，保证在任何时候可用的插槽的有效数量是 block 的大小 - 1 乘以block数量 - 1。求出大小，然后给除法加一个上限
+                size_t initialBlockCount = (size + MAX_BLOCK_SIZE * 2 - 3) / (MAX_BLOCK_SIZE - 1);
+                blockSize = MAX_BLOCK_SIZE;
+                Block *lastBlock = nullptr;
+                for (size_t i = 0; i != initialBlockCount; ++i)
+                {
+                    auto block = make_block(blockSize);
+                    if (block == nullptr)
+                    {
+                        if (firstBlock != nullptr)
+                        {
+                            free_blocks(firstBlock);
+                        }
+                        return false;
+                    }
+                    if (firstBlock == nullptr)
+                    {
+                        firstBlock = block;
+                    }
+                    else
+                    {
+                        lastBlock->next = block;
+                    }
+                    lastBlock = block;
+                    block->next = firstBlock;
+                }
+            }
+            else
+            {
+                firstBlock = make_block(blockSize);
+                if (firstBlock == nullptr)
+                {
+                    return false;
+                }
+                firstBlock->next = firstBlock;
+            }
+            largestBlockSize = blockSize;
+            initialBlock = firstBlock;
+            size_t slots = 0;
+            allocatedBytes = 0;
+            Block *block = firstBlock;
+            do
+            {
+                slots += block->sizeMask;
+                allocatedBytes += block_bytes(block->sizeMask + 1);
+                block = block->next;
+            } while (block != firstBlock);
+            allocatedSlots = slots;
+
+            // Publish the blocks; the consumer adopts initialBlock once it sees tailBlock set
+            fence(memory_order_release);
+            tailBlock = firstBlock;
+            return true;
+        }
+
+        // The number of elements allocate_initial_blocks(size) makes room for
+        static size_t initial_capacity(size_t size)
+        {
+            size_t blockSize = ceilToPow2(size + 1);
+            if (blockSize > MAX_BLOCK_SIZE * 2)
+            {
+                return (size + MAX_BLOCK_SIZE * 2 - 3) / (MAX_BLOCK_SIZE - 1) * (MAX_BLOCK_SIZE - 1);
+            }
+            return blockSize - 1;
+        }
+
+        // Called by the consumer when frontBlock is null: if the producer has allocated the
+        // initial blocks by now, starts dequeuing from the first of them and returns it;
+        // otherwise returns nullptr (the queue is empty).
+        Block *adopt_initial_block() const AE_NO_TSAN
+        {
+            if (tailBlock.load() == nullptr)
+            {
+                return nullptr;
+            }
+            fence(memory_order_acquire);
+            frontBlock = initialBlock;
+            return initialBlock;
+        }
+
+        // Like adopt_initial_block, but doesn't update frontBlock, so that it may be called
+        // from either thread. Returns the block holding the front of the queue, or nullptr
+        // if no blocks have been allocated yet.
+        Block *any_front_block() const AE_NO_TSAN
+        {
+            Block *frontBlock_ = frontBlock.load();
+            if (frontBlock_ == nullptr && tailBlock.load() != nullptr)
+            {
+                fence(memory_order_acquire);
+                frontBlock_ = initialBlock;
+            }
+            return frontBlock_;
+        }
+
+        // Unlinks and frees empty blocks for as long as the room left for elements stays at least
+        // `target`. The candidates are the blocks after tailBlock up to (not including) frontBlock:
+        // the consumer has left them, and won't look at them again until the producer has moved
+        // tailBlock into them, while the links between them are only ever written by the producer
+        // (the consumer follows `next` only from blocks before tailBlock). Nothing else walks over
+        // them either (see size_approx). Producer only.
+        void release_free_blocks(size_t target) AE_NO_TSAN
+        {
+            Block *frontBlock_ = frontBlock.load();
+            Block *tailBlock_ = tailBlock.load();
+            if (frontBlock_ == nullptr || tailBlock_ == nullptr)
+            {
+                // Until the consumer has adopted initialBlock, all of the blocks are its
+                return;
+            }
+            fence(memory_order_acquire); // The consumer is done with the blocks before frontBlock
+
+            Block *prevBlock = tailBlock_;
+            Block *block = tailBlock_->next.load();
+            while (block != frontBlock_)
+            {
+                Block *nextBlock = block->next.load();
+                size_t slots = block->sizeMask;
+                if (allocatedSlots.load() - slots >= target)
+                {
+                    assert(block->front.load() == block->tail.load());
+                    prevBlock->next = nextBlock;
+                    allocatedSlots = allocatedSlots.load() - slots;
+                    allocatedBytes -= block_bytes(slots + 1);
+                    // (initialBlock may be freed: it's not looked at once frontBlock is set)
+                    destroy_block(block, memoryLocked);
+                }
+                else
+                {
+                    prevBlock = block;
+                }
+                block = nextBlock;
+            }
+            fence(memory_order_release);
+        }
+
+        // Frees a ring of (empty) blocks
+        void free_blocks(Block *first) AE_NO_TSAN
+        {
+            Block *block = first;
+            do
+            {
+                Block *nextBlock = block->next;
+                destroy_block(block);
+                block = nextBlock;
+            } while (block != first && block != nullptr);
+        }
+
+        // Frees the memory of a block made by make_block, unlocking it first if it was
+        // locked into RAM (only the pages no other block can share; see unlock_pages)
+        void destroy_block(Block *block, bool locked = false) AE_NO_TSAN
+        {
+            auto rawBlock = block->rawThis;
+            size_t bytes = block_bytes(block->sizeMask + 1);
+            if (locked)
+            {
+                details::unlock_pages(rawBlock, bytes);
+            }
+            block->~Block();
+            deallocate_bytes(rawBlock, bytes);
+        }
+
+        // Allocates `bytes` bytes for a block from the allocator (with the default allocator,
+        // from the BlockCache if it has a block of that size). Returns nullptr on failure.
+        char *allocate_bytes(size_t bytes) AE_NO_TSAN
+        {
+#if MOODYCAMEL_HAS_BLOCK_CACHE
+            if (std::is_same<Allocator, malloc_allocator<char>>::value)
+            {
+                void *memory = BlockCache::take(bytes);
+                if (memory != nullptr)
+                {
+                    return static_cast<char *>(memory);
+                }
+            }
+#endif
+            typename std::allocator_traits<Allocator>::pointer memory;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            try
+            {
+                memory = std::allocator_traits<Allocator>::allocate(allocator, bytes);
+            }
+            catch (std::bad_alloc const &)
+            {
+                return nullptr;
+            }
+#else
+            memory = std::allocator_traits<Allocator>::allocate(allocator, bytes);
+#endif
+            if (memory == nullptr)
+            {
+                return nullptr;
+            }
+            return &*memory;
+        }
+
+        void deallocate_bytes(char *memory, size_t bytes) AE_NO_TSAN
+        {
+#if MOODYCAMEL_HAS_BLOCK_CACHE
+            if (std::is_same<Allocator, malloc_allocator<char>>::value)
+            {
+                BlockCache::give(memory, bytes);
+                return;
+            }
+#endif
+            typedef typename std::allocator_traits<Allocator>::pointer AllocatorPointer;
+            std::allocator_traits<Allocator>::deallocate(allocator, std::pointer_traits<AllocatorPointer>::pointer_to(*memory), bytes);
+        }
+
+        // Writes to every page of the blocks' element memory, and locks the blocks into RAM if
+        // `lock` (all of them, or none). Only while the queue is empty and not yet shared.
+        void prefault_blocks(bool lock) AE_NO_TSAN
+        {
+            Block *first = tailBlock.load();
+            Block *block = first;
+            bool locked = lock;
+            do
+            {
+                details::prefault_pages(block->data, sizeof(T) * (block->sizeMask + 1));
+                if (locked && !details::lock_pages(block->rawThis, block_bytes(block->sizeMask + 1)))
+                {
+                    locked = false;
+                    for (Block *b = first; b != block; b = b->next)
+                    {
+                        details::unlock_pages(b->rawThis, block_bytes(b->sizeMask + 1));
+                    }
+                }
+                block = block->next;
+            } while (block != first);
+            memoryLocked = locked;
+        }
+
+    private:
+        // (Atomic) Elements are dequeued from this block. Null while the queue has no blocks,
+        // and after the producer allocates them until the consumer first looks at them
+        // (mutable since peek() may do that)
+        mutable weak_atomic<Block *> frontBlock;
+        // Written by the consumer only: the latest request_shrink target, and the number of requests
+        weak_atomic<size_t> shrinkTarget;
+        weak_atomic<size_t> shrinkRequests;
+
+        char cachelineFiller[MOODYCAMEL_CACHE_LINE_SIZE - sizeof(weak_atomic<Block *>) - sizeof(weak_atomic<size_t>) * 2];
+        weak_atomic<Block *> tailBlock; // (Atomic) Elements are enqueued to this block; null while the queue has no blocks
+        Block *initialBlock;            // The first block allocated by allocate_initial_blocks
+
+        size_t largestBlockSize; // Producer only: the size of the largest block allocated so far
+        // While the queue has no blocks, the number of elements to reserve on the first enqueue.
+        // Only changed by construction and moves, so max_capacity may read it from either thread.
+        size_t initialSize;
+
+        // Producer only: the room for elements and the memory in the blocks allocated so far,
+        // and the caps on them (see set_growth_limit). (allocatedSlots is read by max_capacity.)
+        weak_atomic<size_t> allocatedSlots;
+        size_t allocatedBytes;
+        size_t maxSlots;
+        size_t maxBytes;
+        size_t shrinkRequestsSeen; // Producer only: the number of request_shrink calls handled
+        bool memoryLocked;         // Whether the blocks are locked into RAM (see prefault_t)
+        Allocator allocator;       // Where the blocks' memory comes from
+
+#ifndef NDEBUG
+        weak_atomic<bool> enqueuing;
+        mutable weak_atomic<bool> dequeuing;
+#endif
+    };
+
+    // Like ReaderWriterQueue, but also providees blocking operations
+    template <typename T, size_t MAX_BLOCK_SIZE = 512, typename Allocator = malloc_allocator<char>>
+    class BlockingReaderWriterQueue
+    {
+    private:
+        typedef ::moodycamel::ReaderWriterQueue<T, MAX_BLOCK_SIZE, Allocator> ReaderWriterQueue;
+
+    public:
+        typedef Allocator allocator_type;
+
+        explicit BlockingReaderWriterQueue(size_t size = 15, Allocator const &allocator = Allocator()) AE_NO_TSAN
+            : inner(size, allocator),
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+              selectSpot(nullptr),
+              closed(0),
+              growthLimited(false),
+              lastFrontBlock(nullptr)
+#else
+              closed(0)
+#endif
+        {
+        }
+
+        // Allocates nothing until the first enqueue (see ReaderWriterQueue)
+        BlockingReaderWriterQueue(size_t size, defer_allocation_t, Allocator const &allocator = Allocator()) AE_NO_TSAN
+            : inner(size, defer_allocation, allocator),
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+              selectSpot(nullptr),
+              closed(0),
+              growthLimited(false),
+              lastFrontBlock(nullptr)
+#else
+              closed(0)
+#endif
+        {
+        }
+
+        // Pre-faults (and optionally locks) the memory it reserves (see prefault_t)
+        BlockingReaderWriterQueue(size_t size, prefault_t options, Allocator const &allocator = Allocator()) AE_NO_TSAN
+            : inner(size, options, allocator),
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+              selectSpot(nullptr),
+              closed(0),
+              growthLimited(false),
+              lastFrontBlock(nullptr)
+#else
+              closed(0)
+#endif
+        {
+        }
+
+        // Note: The queue should not be accessed concurrently while it's
+        // being moved. It's up to the user to synchronize this.
+        BlockingReaderWriterQueue(BlockingReaderWriterQueue &&other) AE_NO_TSAN
+            : inner(std::move(other.inner)),
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+              selectSpot(nullptr),
+              closed(0),
+              growthLimited(false),
+              lastFrontBlock(nullptr)
+#else
+              closed(0)
+#endif
+        {
+            sema.swapCount(other.sema);
+            closed = other.closed.load();
+            other.closed = 0;
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            itemWaiter.setHysteresis(other.itemWaiter.hysteresis());
+            growthLimited = other.growthLimited;
+#endif
+        }
+
+        BlockingReaderWriterQueue &operator=(BlockingReaderWriterQueue &&other) AE_NO_TSAN
+        {
+            sema.swapCount(other.sema);
+            std::swap(inner, other.inner);
+            int otherClosed = other.closed.load();
+            other.closed = closed.load();
+            closed = otherClosed;
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            wake_hysteresis hysteresis = itemWaiter.hysteresis();
+            itemWaiter.setHysteresis(other.itemWaiter.hysteresis());
+            other.itemWaiter.setHysteresis(hysteresis);
+            std::swap(growthLimited, other.growthLimited);
+            lastFrontBlock = nullptr;
+            other.lastFrontBlock = nullptr;
+#endif
+            return *this;
+        }
+
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        // Sets when the producer wakes up the consumer while it's asleep waiting for an
+        // element (see wake_hysteresis); by default, right away. Not thread-safe (no thread
+        // may be using the queue).
+        void set_wake_hysteresis(wake_hysteresis const &hysteresis) AE_NO_TSAN
+        {
+            itemWaiter.setHysteresis(hysteresis);
+        }
+
+        // Wakes up the consumer right away if it's asleep, regardless of the wake-up
+        // hysteresis (e.g. after enqueueing an element that mustn't wait).
+        // Must be called only from the producer thread.
+        AE_FORCEINLINE void wake_consumer() AE_NO_TSAN
+        {
+            itemWaiter.notify(true);
+        }
+#endif
+
+        // Enqueues a copy of element if there is room in the queue.
+        // Returns true if the element was enqueued, false otherwise
+        // (also if the queue is closed).
+        // Does not allocate memory.
+        AE_FORCEINLINE bool try_enqueue(T const &element) AE_NO_TSAN
+        {
+            if (!is_closed() && inner.try_enqueue(element))
+            {
+                signal_item();
+                return true;
+            }
+            return false;
+        }
+
+        // Enqueues a moved copy of element if there is room in the queue.
+        // Returns true if the element was enqueued, false otherwise
+        // (also if the queue is closed).
+        // Does not allocate memory.
+        AE_FORCEINLINE bool try_enqueue(T &&element) AE_NO_TSAN
+        {
+            if (!is_closed() && inner.try_enqueue(std::forward<T>(element)))
+            {
+                signal_item();
+                return true;
+            }
+            return false;
+        }
+
+#if MOODYCAMEL_HAS_EMPLACE
+        // Like try_enqueue() but with emplace semantics (i.e. construct-in-place).
+        template <typename... Args>
+        AE_FORCEINLINE bool try_emplace(Args &&...args) AE_NO_TSAN
+        {
+            if (!is_closed() && inner.try_emplace(std::forward<Args>(args)...))
+            {
+                signal_item();
+                return true;
+            }
+            return false;
+        }
+#endif
+
+        // Enqueues a copy of element on the queue.
+        // Allocates an additional block of memory if needed.
+        // Only fails (returns false) if memory allocation fails or the queue is closed.
         AE_FORCEINLINE bool enqueue(T const &element) AE_NO_TSAN
         {
-            if (inner.enqueue(element))
+            if (!is_closed() && inner.enqueue(element))
             {
-                sema->signal();
+                signal_item();
                 return true;
             }
             return false;
@@ -964,12 +2055,12 @@ namespace moodycamel
 
         // Enqueues a moved copy of element on the queue.
         // Allocates an additional block of memory if needed.
-        // Only fails (returns false) if memory allocation fails.
+        // Only fails (returns false) if memory allocation fails or the queue is closed.
         AE_FORCEINLINE bool enqueue(T &&element) AE_NO_TSAN
         {
-            if (inner.enqueue(std::forward<T>(element)))
+            if (!is_closed() && inner.enqueue(std::forward<T>(element)))
             {
-                sema->signal();
+                signal_item();
                 return true;
             }
             return false;
@@ -980,13 +2071,121 @@ namespace moodycamel
         template <typename... Args>
         AE_FORCEINLINE bool emplace(Args &&...args) AE_NO_TSAN
         {
-            if (inner.emplace(std::forward<Args>(args)...))
+            if (!is_closed() && inner.emplace(std::forward<Args>(args)...))
+            {
+                signal_item();
+                return true;
+            }
+            return false;
+        }
+#endif
+
+        // Enqueues copies of the count elements starting at first, as many as there is
+        // room for (see ReaderWriterQueue::try_enqueue_bulk); returns how many were
+        // enqueued (none if the queue is closed). Does not allocate memory.
+        template <typename It>
+        AE_FORCEINLINE size_t try_enqueue_bulk(It first, size_t count) AE_NO_TSAN
+        {
+            return is_closed() ? 0 : inner_enqueue_bulk<ReaderWriterQueue::CannotAlloc>(first, count);
+        }
+
+        // Like try_enqueue_bulk, but allocates additional blocks of memory as needed.
+        template <typename It>
+        AE_FORCEINLINE size_t enqueue_bulk(It first, size_t count) AE_NO_TSAN
+        {
+            return is_closed() ? 0 : inner_enqueue_bulk<ReaderWriterQueue::CanAlloc>(first, count);
+        }
+
+        // Enqueues an element that fill(T &) sets up in place, if there is room in the queue
+        // (see ReaderWriterQueue::try_enqueue_with). Returns true if the element was enqueued,
+        // false otherwise (also if the queue is closed). Does not allocate memory.
+        template <typename F>
+        AE_FORCEINLINE bool try_enqueue_with(F &&fill) AE_NO_TSAN
+        {
+            if (!is_closed() && inner.try_enqueue_with(std::forward<F>(fill)))
             {
-                sema->signal();
+                signal_item();
                 return true;
             }
             return false;
         }
+
+        // Like try_enqueue_with, but allocates an additional block of memory if needed.
+        template <typename F>
+        AE_FORCEINLINE bool enqueue_with(F &&fill) AE_NO_TSAN
+        {
+            if (!is_closed() && inner.enqueue_with(std::forward<F>(fill)))
+            {
+                signal_item();
+                return true;
+            }
+            return false;
+        }
+
+        // Caps how far enqueue() may grow the queue (see ReaderWriterQueue::set_growth_limit);
+        // once it's reached, enqueue() fails, and wait_enqueue() waits for the consumer to
+        // make room. Not thread-safe: no thread may be using the queue.
+        void set_growth_limit(size_t max_elements, size_t max_bytes = static_cast<size_t>(-1)) AE_NO_TSAN
+        {
+            inner.set_growth_limit(max_elements, max_bytes);
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            growthLimited = true;
+#endif
+        }
+
+        // Frees empty blocks down to `target_capacity` (see ReaderWriterQueue::shrink_to).
+        // Must be called from the producer thread.
+        AE_FORCEINLINE size_t shrink_to(size_t target_capacity) AE_NO_TSAN
+        {
+            return inner.shrink_to(target_capacity);
+        }
+
+        // Asks the producer to shrink_to `target_capacity` (see ReaderWriterQueue::request_shrink).
+        // Must be called from the consumer thread.
+        AE_FORCEINLINE void request_shrink(size_t target_capacity) AE_NO_TSAN
+        {
+            inner.request_shrink(target_capacity);
+        }
+
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        // Like enqueue(), but if there's no room (within the growth limit, or memory
+        // allocation fails), blocks until the consumer makes some. Returns false if the
+        // queue is (or gets) closed, true once the element is enqueued.
+        bool wait_enqueue(T const &element) AE_NO_TSAN
+        {
+            return wait_enqueue_timed(element, -1);
+        }
+
+        // Like enqueue(T &&), but blocks while there's no room (see above).
+        bool wait_enqueue(T &&element) AE_NO_TSAN
+        {
+            return wait_enqueue_timed(std::move(element), -1);
+        }
+
+        // Like wait_enqueue(), but gives up (returns false without enqueueing the
+        // element) if the timeout expires. A negative timeout waits indefinitely.
+        bool wait_enqueue_timed(T const &element, std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            return inner_wait_enqueue(element, timeout_usecs);
+        }
+
+        // Like wait_enqueue(T &&), but gives up if the timeout expires (see above).
+        bool wait_enqueue_timed(T &&element, std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            return inner_wait_enqueue(std::move(element), timeout_usecs);
+        }
+
+        template <typename Rep, typename Period>
+        inline bool wait_enqueue_timed(T const &element, std::chrono::duration<Rep, Period> const &timeout) AE_NO_TSAN
+        {
+            return wait_enqueue_timed(element, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+        }
+
+        template <typename Rep, typename Period>
+        inline bool wait_enqueue_timed(T &&element, std::chrono::duration<Rep, Period> const &timeout) AE_NO_TSAN
+        {
+            return wait_enqueue_timed(std::move(element), std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+        }
 #endif
 
         // Attempts to dequeue an element; if the queue is empty,
@@ -995,47 +2194,71 @@ namespace moodycamel
         template <typename U>
         bool try_dequeue(U &result) AE_NO_TSAN
         {
-            if (sema->tryWait())
+            if (sema.tryWait())
             {
-                bool success = inner.try_dequeue(result);
-                assert(success);
-                AE_UNUSED(success);
-                return true;
+                return dequeue_counted(result);
             }
             return false;
         }
 
         // Attempts to dequeue an element; if the queue is empty,
         // waits until an element is available, then dequeues it.
+        // Returns false (without touching result) if the queue is closed
+        // and empty, true otherwise.
         template <typename U>
-        void wait_dequeue(U &result) AE_NO_TSAN
+        bool wait_dequeue(U &result) AE_NO_TSAN
         {
-            while (!sema->wait())
+            while (!wait_for_item(-1))
                 ;
-            bool success = inner.try_dequeue(result);
-            AE_UNUSED(result);
-            assert(success);
-            AE_UNUSED(success);
+            return dequeue_counted(result);
         }
 
         // Attempts to dequeue an element; if the queue is empty,
         // waits until an element is available up to the specified timeout,
         // then dequeues it and returns true, or returns false if the timeout
-        // expires before an element can be dequeued.
+        // expires before an element can be dequeued (or the queue is closed
+        // and empty).
         // Using a negative timeout indicates an indefinite timeout,
         // and is thus functionally equivalent to calling wait_dequeue.
         template <typename U>
         bool wait_dequeue_timed(U &result, std::int64_t timeout_usecs) AE_NO_TSAN
         {
-            if (!sema->wait(timeout_usecs))
+            if (!wait_for_item(timeout_usecs))
             {
                 return false;
             }
-            bool success = inner.try_dequeue(result);
-            AE_UNUSED(result);
-            assert(success);
-            AE_UNUSED(success);
-            return true;
+            return dequeue_counted(result);
+        }
+
+        // Dequeues up to max elements to *out++ (see ReaderWriterQueue::try_dequeue_bulk)
+        // without waiting. Returns how many were dequeued.
+        template <typename It>
+        size_t try_dequeue_bulk(It out, size_t max) AE_NO_TSAN
+        {
+            size_t taken = sema.tryWaitMany(max);
+            return taken != 0 ? dequeue_counted_bulk(out, taken) : 0;
+        }
+
+        // Like try_dequeue_bulk, but if the queue is empty, waits for an element first
+        // (up to timeout_usecs, if that isn't negative). Returns how many were dequeued:
+        // none only if the timeout expires or the queue is closed and empty.
+        template <typename It>
+        size_t wait_dequeue_bulk(It out, size_t max, std::int64_t timeout_usecs = -1) AE_NO_TSAN
+        {
+            if (max == 0)
+            {
+                return 0;
+            }
+            if (timeout_usecs < 0)
+            {
+                while (!wait_for_item(-1))
+                    ;
+            }
+            else if (!wait_for_item(timeout_usecs))
+            {
+                return 0;
+            }
+            return dequeue_counted_bulk(out, 1 + sema.tryWaitMany(max - 1));
         }
 
 #if __cplusplus > 199711L || _MSC_VER >= 1700
@@ -1050,8 +2273,80 @@ namespace moodycamel
         {
             return wait_dequeue_timed(result, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
         }
+
+        // Like wait_dequeue_timed, but returns how the wait went: whether an element
+        // was available right away, turned up while spinning or only after sleeping,
+        // or the timeout expired (outcome.success is false), and how long it took.
+        // If the queue is closed and empty, outcome.closed is set (and success isn't).
+        template <typename U>
+        wait_outcome wait_dequeue_outcome(U &result, std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            wait_outcome outcome;
+            if (sema.tryWait())
+            {
+                outcome.success = true;
+            }
+            else
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                while (!wait_for_item(timeout_usecs, &outcome) && timeout_usecs < 0)
+                    ;
+                outcome.wait_usecs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                if (!outcome.success)
+                {
+                    return outcome;
+                }
+            }
+            if (!dequeue_counted(result))
+            {
+                outcome.success = false;
+                outcome.closed = true;
+            }
+            return outcome;
+        }
+
+        // Like wait_dequeue_timed, but returns how the wait went (see above).
+        template <typename U, typename Rep, typename Period>
+        inline wait_outcome wait_dequeue_outcome(U &result, std::chrono::duration<Rep, Period> const &timeout) AE_NO_TSAN
+        {
+            return wait_dequeue_outcome(result, std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+        }
 #endif
 
+        // Calls f(T &) on the front element in place, then removes it, if the queue
+        // isn't empty (see ReaderWriterQueue::try_consume). Returns false otherwise.
+        template <typename F>
+        bool try_consume(F &&f) AE_NO_TSAN
+        {
+            if (sema.tryWait())
+            {
+                return consume_counted(f);
+            }
+            return false;
+        }
+
+        // Like try_consume, but if the queue is empty, waits until an element is available.
+        // Returns false (without calling f) if the queue is closed and empty.
+        template <typename F>
+        bool wait_consume(F &&f) AE_NO_TSAN
+        {
+            while (!wait_for_item(-1))
+                ;
+            return consume_counted(f);
+        }
+
+        // Like wait_consume, but waits at most timeout_usecs (a negative timeout waits
+        // indefinitely). Returns false if the timeout expires (or the queue is closed and empty).
+        template <typename F>
+        bool wait_consume_timed(F &&f, std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            if (!wait_for_item(timeout_usecs))
+            {
+                return false;
+            }
+            return consume_counted(f);
+        }
+
         // Returns a pointer to the front element in the queue (the one that
         // would be removed next by a call to `try_dequeue` or `pop`). If the
         // queue appears empty at the time the method is called, nullptr is
@@ -1067,12 +2362,15 @@ namespace moodycamel
         // `pop` was called.
         AE_FORCEINLINE bool pop() AE_NO_TSAN
         {
-            if (sema->tryWait())
+            if (sema.tryWait())
             {
-                bool result = inner.pop();
-                assert(result);
-                AE_UNUSED(result);
-                return true;
+                if (inner.pop())
+                {
+                    slot_freed();
+                    return true;
+                }
+                assert(is_closed());
+                sema.signal(); // Put close()'s marker back (see dequeue_counted)
             }
             return false;
         }
@@ -1081,7 +2379,9 @@ namespace moodycamel
         // Safe to call from both the producer and consumer threads.
         AE_FORCEINLINE size_t size_approx() const AE_NO_TSAN
         {
-            return sema->availableApprox();
+            size_t count = sema.availableApprox();
+            // Leave out close()'s marker
+            return count != 0 && is_closed() ? count - 1 : count;
         }
 
         // Returns the total number of items that could be enqueued without incurring
@@ -1098,16 +2398,441 @@ namespace moodycamel
             return inner.max_capacity();
         }
 
+        // Whether the queue's memory is locked into RAM (see prefault_t)
+        AE_FORCEINLINE bool memory_locked() const AE_NO_TSAN
+        {
+            return inner.memory_locked();
+        }
+
+        allocator_type get_allocator() const AE_NO_TSAN
+        {
+            return inner.get_allocator();
+        }
+
+        // Closes the queue: from then on, enqueues fail, and once the elements already in
+        // it have been dequeued, so do dequeues (wait_dequeue returns false instead of
+        // blocking). Wakes up the consumer if it's waiting. May be called from any thread,
+        // more than once; an enqueue that races with it may or may not succeed.
+        void close() AE_NO_TSAN
+        {
+            if (closed.fetch_add_release(1) == 0)
+            {
+                // A unit of the count without an element behind it: it wakes up the consumer,
+                // and tells it the queue is closed once there's nothing left to dequeue
+                sema.signal();
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+                itemWaiter.wake();
+                slotWaiter.wake();
+                if (selectSpot != nullptr)
+                {
+                    selectSpot->wake();
+                }
+#endif
+            }
+        }
+
+        // Returns whether close() has been called.
+        // Safe to call from any thread.
+        AE_FORCEINLINE bool is_closed() const AE_NO_TSAN
+        {
+            return closed.load() != 0;
+        }
+
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        // Used by QueueSet: `spot` (if not null) is woken up after every enqueue, and by
+        // close(). Not thread-safe (the producer must not be enqueueing). Not carried
+        // over when the queue is moved.
+        void set_select_spot(spsc_sema::ParkingSpot *spot) AE_NO_TSAN
+        {
+            selectSpot = spot;
+        }
+#endif
+
     private:
+        // Counts a newly enqueued element, and wakes up the consumer if it's asleep waiting for one
+        AE_FORCEINLINE void signal_item(size_t count = 1) AE_NO_TSAN
+        {
+            sema.signal(static_cast<spsc_sema::LightweightSemaphore::ssize_t>(count));
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            if (itemWaiter.throttled())
+            {
+                itemWaiter.notify();
+            }
+            if (selectSpot != nullptr)
+            {
+                selectSpot->wake();
+            }
+#endif
+        }
+
+        // Takes one from the element count, waiting for it if need be. With a wake-up
+        // hysteresis, the consumer never blocks on sema (so signal() never has to wake it);
+        // it sleeps on itemWaiter instead, which the producer wakes at its discretion.
+        // `outcome`, if not null, is filled in with how the wait went (but wait_usecs).
+        bool wait_for_item(std::int64_t timeout_usecs, wait_outcome *outcome = nullptr) AE_NO_TSAN
+        {
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            if (itemWaiter.throttled())
+            {
+                bool success = itemWaiter.waitUntil([this]()
+                                                    { return sema.tryWait(); },
+                                                    timeout_usecs, outcome);
+                if (outcome != nullptr)
+                {
+                    outcome->success = success;
+                }
+                return success;
+            }
+#endif
+            if (outcome != nullptr)
+            {
+                return sema.wait(timeout_usecs, *outcome);
+            }
+            return sema.wait(timeout_usecs);
+        }
+
+        // Wakes up the producer if it's waiting in wait_enqueue for room under a growth limit
+        // (without one, it retries on its own; see inner_wait_enqueue). A dequeue only makes
+        // room the producer can use when the consumer moves on to the next block (the one it
+        // leaves becomes free), or when the queue is a single block; otherwise the producer
+        // would just fail to enqueue and go back to sleep.
+        AE_FORCEINLINE void slot_freed() AE_NO_TSAN
+        {
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+            if (!growthLimited)
+            {
+                return;
+            }
+            auto front = inner.frontBlock.load();
+            if (front != lastFrontBlock || front->next.load() == front)
+            {
+                lastFrontBlock = front;
+                slotWaiter.notify();
+            }
+#endif
+        }
+
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        template <typename U>
+        bool inner_wait_enqueue(U &&element, std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            bool enqueued = false;
+            auto ready = [&]()
+            { return is_closed() || (enqueued = inner.enqueue(std::forward<U>(element))); };
+            if (growthLimited)
+            {
+                slotWaiter.waitUntil(ready, timeout_usecs);
+            }
+            else
+            {
+                // Only a failed allocation can hold the producer up, and the consumer doesn't
+                // notify slotWaiter then (that would put a fence on every dequeue), so retry
+                // every retryUsecs instead; close() still wakes the producer right away
+                const std::int64_t retryUsecs = 1000;
+                typedef std::chrono::steady_clock Clock;
+                Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout_usecs < 0 ? 0 : timeout_usecs);
+                std::int64_t remaining = timeout_usecs;
+                while (!slotWaiter.waitUntil(ready, remaining < 0 || remaining > retryUsecs ? retryUsecs : remaining))
+                {
+                    if (timeout_usecs >= 0)
+                    {
+                        remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - Clock::now()).count();
+                        if (remaining <= 0)
+                        {
+                            break;
+                        }
+                    }
+                }
+            }
+            if (enqueued)
+            {
+                signal_item();
+            }
+            return enqueued;
+        }
+#endif
+
+        // Dequeues the element that a unit taken from sema stands for. Fails if it was
+        // close()'s marker instead (the queue is closed and empty), which is put back so
+        // that every later dequeue fails too.
+        template <typename U>
+        bool dequeue_counted(U &result) AE_NO_TSAN
+        {
+            if (inner.try_dequeue(result))
+            {
+                slot_freed();
+                return true;
+            }
+            assert(is_closed());
+            sema.signal();
+            return false;
+        }
+
+        // Like dequeue_counted, for try_consume
+        template <typename F>
+        bool consume_counted(F &f) AE_NO_TSAN
+        {
+            if (inner.try_consume(f))
+            {
+                slot_freed();
+                return true;
+            }
+            assert(is_closed());
+            sema.signal();
+            return false;
+        }
+
+        template <typename ReaderWriterQueue::AllocationMode canAlloc, typename It>
+        size_t inner_enqueue_bulk(It first, size_t count) AE_NO_TSAN
+        {
+            size_t done = 0;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            try
+            {
+                inner.template inner_enqueue_bulk<canAlloc>(first, count, done);
+            }
+            catch (...)
+            {
+                // The elements enqueued before the exception are in the queue all the same
+                if (done != 0)
+                {
+                    signal_item(done);
+                }
+                throw;
+            }
+#else
+            inner.template inner_enqueue_bulk<canAlloc>(first, count, done);
+#endif
+            if (done != 0)
+            {
+                signal_item(done);
+            }
+            return done;
+        }
+
+        // Like dequeue_counted, for `taken` elements already taken from the count: gives
+        // back whatever isn't dequeued (the close marker, or what's left after an exception)
+        template <typename It>
+        size_t dequeue_counted_bulk(It out, size_t taken) AE_NO_TSAN
+        {
+            size_t done = 0;
+#ifdef MOODYCAMEL_EXCEPTIONS_ENABLED
+            try
+            {
+                inner.inner_dequeue_bulk(out, taken, done);
+            }
+            catch (...)
+            {
+                sema.signal(static_cast<spsc_sema::LightweightSemaphore::ssize_t>(taken - done));
+                if (done != 0)
+                {
+                    slot_freed();
+                }
+                throw;
+            }
+#else
+            inner.inner_dequeue_bulk(out, taken, done);
+#endif
+            if (done != taken)
+            {
+                assert(is_closed());
+                sema.signal(static_cast<spsc_sema::LightweightSemaphore::ssize_t>(taken - done));
+            }
+            if (done != 0)
+            {
+                slot_freed();
+            }
+            return done;
+        }
+
         // Disable copying & assignment
         BlockingReaderWriterQueue(BlockingReaderWriterQueue const &) {}
         BlockingReaderWriterQueue &operator=(BlockingReaderWriterQueue const &) {}
 
     private:
         ReaderWriterQueue inner;
-        std::unique_ptr<spsc_sema::LightweightSemaphore> sema;
+
+        // Counts the enqueued elements. Stored inline, so that blocking operations don't have to
+        // load a pointer to it first, and on its own cache line(s): it's written by both threads
+        // (inner is cache-line aligned, so sema starts on a new line)
+        spsc_sema::LightweightSemaphore sema;
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+        // Where the consumer sleeps instead when there's a wake-up hysteresis
+        spsc_sema::ParkingSpot itemWaiter;
+        // Where the producer sleeps in wait_enqueue while the queue can't grow
+        spsc_sema::ParkingSpot slotWaiter;
+        spsc_sema::ParkingSpot *selectSpot; // The QueueSet's, if the queue is in one
+        weak_atomic<int> closed;            // The number of close() calls
+        bool growthLimited;                 // Whether set_growth_limit has been called
+        void const *lastFrontBlock;         // The front block as of the last slot_freed() (consumer only)
+        char cachelineFiller[MOODYCAMEL_CACHE_LINE_SIZE - (sizeof(spsc_sema::LightweightSemaphore) + sizeof(spsc_sema::ParkingSpot) * 2 + sizeof(spsc_sema::ParkingSpot *) + sizeof(weak_atomic<int>) + sizeof(bool) + sizeof(void const *)) % MOODYCAMEL_CACHE_LINE_SIZE];
+#else
+        weak_atomic<int> closed; // The number of close() calls
+        char cachelineFiller[MOODYCAMEL_CACHE_LINE_SIZE - (sizeof(spsc_sema::LightweightSemaphore) + sizeof(weak_atomic<int>)) % MOODYCAMEL_CACHE_LINE_SIZE];
+#endif
     };
 
+#ifdef AE_USE_STD_ATOMIC_FOR_WEAK_ATOMIC
+    // Lets one consumer wait on several blocking queues (BlockingReaderWriterQueue and/or
+    // BlockingReaderWriterCircularBuffer, of any element types) at once: select() blocks
+    // until one of them has an element (or has been closed) and returns its index, after
+    // which the element is dequeued from that queue as usual. The queues' producers wake
+    // up the set directly, so there's no polling. Queues are checked round-robin, so that
+    // a busy one doesn't starve the others.
+    // The queues must outlive the set, and may not be moved while in it; a queue can only
+    // be in one set at a time. Only the consumer may use the set.
+    class QueueSet
+    {
+    public:
+        QueueSet() AE_NO_TSAN : next(0)
+        {
+        }
+
+        ~QueueSet() AE_NO_TSAN
+        {
+            for (size_t i = 0; i != queues.size(); ++i)
+            {
+                if (queues[i].queue != nullptr)
+                {
+                    queues[i].attach(queues[i].queue, nullptr);
+                }
+            }
+        }
+
+        // Adds a queue to the set, and returns its index (what select() returns when it's
+        // ready). Not thread-safe: the queue's producer must not be enqueueing.
+        template <typename TQueue>
+        int add(TQueue &q) AE_NO_TSAN
+        {
+            Entry entry = {&q, &state<TQueue>, &attach<TQueue>, false};
+            queues.push_back(entry);
+            q.set_select_spot(&spot);
+            return static_cast<int>(queues.size() - 1);
+        }
+
+        // Takes a queue out of the set, so that select() no longer looks at it (and its
+        // producer no longer wakes the set up); the other queues keep their indices.
+        // Not thread-safe: the queue's producer must not be enqueueing.
+        void remove(int index) AE_NO_TSAN
+        {
+            Entry &entry = queues[static_cast<size_t>(index)];
+            if (entry.queue != nullptr)
+            {
+                entry.attach(entry.queue, nullptr);
+                entry.queue = nullptr;
+            }
+        }
+
+        // Returns the index of a queue that has an element, or -1 if none does, without
+        // blocking. A queue that is closed and empty is returned once more (so that the
+        // consumer finds out it's done), and then left out like a removed one.
+        int try_select() AE_NO_TSAN
+        {
+            size_t count = queues.size();
+            for (size_t i = 0; i != count; ++i)
+            {
+                size_t index = next + i < count ? next + i : next + i - count;
+                Entry &entry = queues[index];
+                if (entry.queue == nullptr || entry.finished)
+                {
+                    continue;
+                }
+                queue_state state_ = entry.state(entry.queue);
+                if (state_ != queue_empty)
+                {
+                    // (a finished queue's producer may still be in close(), about to wake the
+                    // set, so it stays attached until remove() or the set's destruction)
+                    entry.finished = state_ == queue_finished;
+                    next = index + 1 < count ? index + 1 : 0;
+                    return static_cast<int>(index);
+                }
+            }
+            return -1;
+        }
+
+        // Blocks until one of the queues has an element (or is closed), and returns its index.
+        int select() AE_NO_TSAN
+        {
+            int index;
+            while ((index = select_timed(-1)) < 0)
+                continue;
+            return index;
+        }
+
+        // Like select(), but returns -1 if the timeout expires first.
+        // A negative timeout waits indefinitely.
+        int select_timed(std::int64_t timeout_usecs) AE_NO_TSAN
+        {
+            int index = -1;
+            spot.waitUntil([&]()
+                           { return (index = try_select()) >= 0; },
+                           timeout_usecs);
+            return index;
+        }
+
+        template <typename Rep, typename Period>
+        inline int select_timed(std::chrono::duration<Rep, Period> const &timeout) AE_NO_TSAN
+        {
+            return select_timed(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+        }
+
+    private:
+        QueueSet(QueueSet const &);
+        QueueSet &operator=(QueueSet const &);
+
+        enum queue_state
+        {
+            queue_empty,
+            queue_ready,   // has an element
+            queue_finished // closed and empty: nothing will ever be enqueued again
+        };
+
+        template <typename TQueue>
+        static queue_state state(void *q) AE_NO_TSAN
+        {
+            TQueue &queue = *static_cast<TQueue *>(q);
+            // Checked first: once the queue is closed, it can only get emptier
+            bool closed = queue.is_closed();
+            if (queue.size_approx() != 0)
+            {
+                return queue_ready;
+            }
+            return closed ? queue_finished : queue_empty;
+        }
+
+        template <typename TQueue>
+        static void attach(void *q, spsc_sema::ParkingSpot *spot) AE_NO_TSAN
+        {
+            static_cast<TQueue *>(q)->set_select_spot(spot);
+        }
+
+        struct Entry
+        {
+            void *queue; // null once removed
+            queue_state (*state)(void *);
+            void (*attach)(void *, spsc_sema::ParkingSpot *);
+            bool finished; // returned by try_select() after it was closed and drained
+        };
+
+        std::vector<Entry> queues;
+        size_t next; // Where try_select() starts looking
+        spsc_sema::ParkingSpot spot;
+    };
+#endif
+
+#if MOODYCAMEL_HAS_PMR
+    namespace pmr
+    {
+        // Queues whose memory comes from a std::pmr::memory_resource, e.g.
+        // moodycamel::pmr::ReaderWriterQueue<int> q(100, &arena);
+        template <typename T, size_t MAX_BLOCK_SIZE = 512>
+        using ReaderWriterQueue = ::moodycamel::ReaderWriterQueue<T, MAX_BLOCK_SIZE, std::pmr::polymorphic_allocator<char>>;
+
+        template <typename T, size_t MAX_BLOCK_SIZE = 512>
+        using BlockingReaderWriterQueue = ::moodycamel::BlockingReaderWriterQueue<T, MAX_BLOCK_SIZE, std::pmr::polymorphic_allocator<char>>;
+    }
+#endif
+
 } // end namespace moodycamel
 
 #ifdef AE_VCPP
@@ -1,13 +1,27 @@
 #include "../../readerwriterqueue.h"
+#include "../../readerwritercircularbuffer.h"
 #include "../common/simplethread.h"
 
 using namespace moodycamel;
 
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <exception>
 #include <fstream>
 #include <cstdlib>		// rand()
 //#include <unistd.h>		// usleep()
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>		// sysconf()
+#endif
 
 void unpredictableDelay(int extra = 0)
 {
@@ -16,11 +30,427 @@ void unpredictableDelay(int extra = 0)
 	}*/
 }
 
+//////// Soak mode ////////
+// Runs randomized rounds for a fixed number of hours: each round picks a queue type,
+// an element size, blocking or non-blocking operations on either side, and whether
+// to inject random delays, then streams elements through a fresh queue for a few
+// seconds while checking their order and contents. Memory use (RSS), queue growth
+// and latency percentiles are reported periodically so that leaks or gradual
+// degradation show up as drift between reports.
+
+namespace soak {
+
+typedef std::chrono::steady_clock Clock;
+
+inline std::int64_t nowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Resident set size of the process, in kilobytes (0 where unsupported)
+std::size_t residentKB()
+{
+#if defined(__linux__)
+	std::ifstream statm("/proc/self/statm");
+	std::size_t size = 0, resident = 0;
+	if (statm >> size >> resident) {
+		return resident * (std::size_t)sysconf(_SC_PAGESIZE) / 1024;
+	}
+#endif
+	return 0;
+}
+
+const std::uint64_t END_OF_ROUND = ~0ULL;
+
+// Elements carry their sequence number and send time, padded out to Size bytes with a
+// byte pattern derived from the sequence number, so that torn copies are detected too
+template<std::size_t Size>
+struct Element {
+	std::uint64_t seq;
+	std::int64_t sentNs;
+	unsigned char fill[Size - 16];
+
+	void stamp(std::uint64_t s)
+	{
+		seq = s;
+		sentNs = nowNs();
+		std::memset(fill, (int)(s & 0xff), sizeof(fill));
+	}
+
+	bool intact() const
+	{
+		for (std::size_t i = 0; i != sizeof(fill); ++i) {
+			if (fill[i] != (unsigned char)(seq & 0xff)) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+enum QueueType { queue_rwq, queue_brwq, queue_brwcb, QUEUE_TYPE_COUNT };
+const char* queueNames[] = { "ReaderWriterQueue", "BlockingReaderWriterQueue", "BlockingReaderWriterCircularBuffer" };
+
+struct RoundConfig {
+	int queueType;
+	int elementSize;		// 24, 64 or 256 bytes
+	int producerMode;		// 0: enqueue/wait_enqueue, 1: try_enqueue (retried while full), 2: timed wait
+	int consumerMode;		// 0: try_dequeue (polling), 1: wait_dequeue (peek/pop for the non-blocking queue), 2: timed wait
+	bool delays;			// randomly sleep now and then on both sides
+	std::size_t initialSize;
+	double seconds;
+};
+
+// Latencies in buckets 1/16 of an octave (about 4%) wide, so that recording them takes
+// the same memory however long the run is
+struct LatencyHistogram {
+	static const int BUCKETS_PER_OCTAVE = 16;
+	static const int BUCKET_COUNT = BUCKETS_PER_OCTAVE * 40;	// up to 2^40 us
+
+	std::uint64_t counts[BUCKET_COUNT];
+	std::uint64_t total;
+	double maxUs;
+
+	LatencyHistogram() : total(0), maxUs(0) { std::fill(counts, counts + BUCKET_COUNT, (std::uint64_t)0); }
+
+	void record(double us)
+	{
+		int i = (int)(std::log2(us + 1) * BUCKETS_PER_OCTAVE);
+		++counts[std::min(std::max(i, 0), BUCKET_COUNT - 1)];
+		++total;
+		maxUs = std::max(maxUs, us);
+	}
+
+	void merge(LatencyHistogram const& other)
+	{
+		for (int i = 0; i != BUCKET_COUNT; ++i) {
+			counts[i] += other.counts[i];
+		}
+		total += other.total;
+		maxUs = std::max(maxUs, other.maxUs);
+	}
+
+	// The upper bound of the bucket the p-th percentile falls in
+	double percentile(double p) const
+	{
+		if (total == 0) {
+			return 0;
+		}
+		std::uint64_t rank = (std::uint64_t)(p / 100 * (double)(total - 1)) + 1;
+		std::uint64_t seen = 0;
+		for (int i = 0; i != BUCKET_COUNT; ++i) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return std::min(std::exp2((double)(i + 1) / BUCKETS_PER_OCTAVE) - 1, maxUs);
+			}
+		}
+		return maxUs;
+	}
+};
+
+// Accumulated over one report interval
+struct Stats {
+	std::uint64_t rounds;
+	std::uint64_t elements;
+	std::uint64_t errors;
+	std::uint64_t blockAllocations;
+	std::size_t peakCapacity;
+	LatencyHistogram latencies;	// of every 64th element
+
+	Stats() : rounds(0), elements(0), errors(0), blockAllocations(0), peakCapacity(0) { }
+};
+
+void randomDelay(std::minstd_rand& rng, int extra = 0)
+{
+	if ((rng() & 4095) == 0) {
+		std::this_thread::sleep_for(std::chrono::microseconds(2000 + extra));
+	}
+}
+
+// Producer side; returns true if the queue had to grow (allocate a block)
+template<typename TQueue, typename E>
+bool produceGrowable(TQueue& q, E const& element, int mode)
+{
+	if (q.try_enqueue(element)) {
+		return false;
+	}
+	if (mode == 0) {
+		std::size_t capacity = q.max_capacity();
+		q.enqueue(element);
+		return q.max_capacity() != capacity;
+	}
+	do {
+		std::this_thread::yield();
+	} while (!q.try_enqueue(element));
+	return false;
+}
+
+template<typename E>
+bool produce(ReaderWriterQueue<E>& q, E const& element, int mode) { return produceGrowable(q, element, mode); }
+
+template<typename E>
+bool produce(BlockingReaderWriterQueue<E>& q, E const& element, int mode) { return produceGrowable(q, element, mode); }
+
+template<typename E>
+bool produce(BlockingReaderWriterCircularBuffer<E>& q, E const& element, int mode)
+{
+	if (mode == 0) {
+		q.wait_enqueue(element);
+	}
+	else if (mode == 1) {
+		while (!q.try_enqueue(element)) {
+			std::this_thread::yield();
+		}
+	}
+	else {
+		while (!q.wait_enqueue_timed(element, 100)) {
+			continue;
+		}
+	}
+	return false;
+}
+
+// Consumer side
+template<typename E>
+void consume(ReaderWriterQueue<E>& q, E& element, int mode)
+{
+	if (mode == 1) {
+		E* front;
+		while ((front = q.peek()) == nullptr) {
+			std::this_thread::yield();
+		}
+		element = *front;
+		q.pop();
+		return;
+	}
+	while (!q.try_dequeue(element)) {
+		std::this_thread::yield();
+	}
+}
+
+template<typename TQueue, typename E>
+void consumeBlocking(TQueue& q, E& element, int mode)
+{
+	if (mode == 0) {
+		while (!q.try_dequeue(element)) {
+			std::this_thread::yield();
+		}
+	}
+	else if (mode == 1) {
+		q.wait_dequeue(element);
+	}
+	else {
+		while (!q.wait_dequeue_timed(element, 100)) {
+			continue;
+		}
+	}
+}
+
+template<typename E>
+void consume(BlockingReaderWriterQueue<E>& q, E& element, int mode) { consumeBlocking(q, element, mode); }
+
+template<typename E>
+void consume(BlockingReaderWriterCircularBuffer<E>& q, E& element, int mode) { consumeBlocking(q, element, mode); }
+
+template<typename TQueue, typename E>
+void runRound(RoundConfig const& config, unsigned int seed, Stats& stats, std::ofstream& log)
+{
+	TQueue q(config.initialSize);
+	std::size_t peakCapacity = q.max_capacity();
+	std::uint64_t blockAllocations = 0;
+	std::uint64_t received = 0;
+	std::uint64_t errors = 0;
+	LatencyHistogram latencies;
+	std::int64_t deadline = nowNs() + (std::int64_t)(config.seconds * 1e9);
+	// The growable queues would otherwise grow without bound whenever the consumer falls
+	// behind (e.g. while it sleeps); let the producer wait once ~64MB are queued
+	const std::size_t MAX_BACKLOG = (64 << 20) / sizeof(E);
+
+	SimpleThread writer([&]() {
+		std::minstd_rand rng(seed);
+		E element;
+		for (std::uint64_t j = 0; nowNs() < deadline; ++j) {
+			if (config.delays) {
+				randomDelay(rng, 500);
+			}
+			if ((j & 1023) == 0) {
+				while (q.size_approx() > MAX_BACKLOG) {
+					std::this_thread::yield();
+				}
+			}
+			element.stamp(j);
+			if (produce(q, element, config.producerMode)) {
+				++blockAllocations;
+				peakCapacity = std::max(peakCapacity, q.max_capacity());
+			}
+		}
+		element.stamp(END_OF_ROUND);
+		produce(q, element, config.producerMode);
+	});
+
+	SimpleThread reader([&]() {
+		std::minstd_rand rng(seed * 3 + 1);
+		E element;
+		for (std::uint64_t j = 0; ; ++j) {
+			if (config.delays) {
+				randomDelay(rng);
+			}
+			consume(q, element, config.consumerMode);
+			if (element.seq == END_OF_ROUND) {
+				break;
+			}
+			if (element.seq != j || !element.intact()) {
+				if (errors++ < 10) {
+					log << "  ERROR DETECTED: Expected to read " << j << " but found " << element.seq << (element.intact() ? "" : " (corrupted)") << std::endl;
+					std::printf("  ERROR DETECTED: Expected to read %llu but found %llu%s\n", (unsigned long long)j, (unsigned long long)element.seq, element.intact() ? "" : " (corrupted)");
+				}
+				j = element.seq;
+			}
+			if ((j & 63) == 0) {
+				latencies.record((double)(nowNs() - element.sentNs) / 1000.0);
+			}
+			++received;
+		}
+		if (q.try_dequeue(element)) {
+			++errors;
+			log << "  ERROR DETECTED: Expected queue to be empty" << std::endl;
+			std::printf("  ERROR DETECTED: Expected queue to be empty\n");
+		}
+	});
+
+	writer.join();
+	reader.join();
+
+	++stats.rounds;
+	stats.elements += received;
+	stats.errors += errors;
+	stats.blockAllocations += blockAllocations;
+	stats.peakCapacity = std::max(stats.peakCapacity, peakCapacity);
+	stats.latencies.merge(latencies);
+}
+
+template<std::size_t Size>
+void runRoundOfSize(RoundConfig const& config, unsigned int seed, Stats& stats, std::ofstream& log)
+{
+	switch (config.queueType) {
+	case queue_rwq: runRound<ReaderWriterQueue<Element<Size>>, Element<Size>>(config, seed, stats, log); break;
+	case queue_brwq: runRound<BlockingReaderWriterQueue<Element<Size>>, Element<Size>>(config, seed, stats, log); break;
+	default: runRound<BlockingReaderWriterCircularBuffer<Element<Size>>, Element<Size>>(config, seed, stats, log); break;
+	}
+}
+
+}	// namespace soak
+
+int runSoak(double hours, double reportSeconds, unsigned int seed)
+{
+	using namespace soak;
+
+	std::printf("Running soak test for moodycamel::ReaderWriterQueue and friends (%g hours, seed %u).\n", hours, seed);
+	std::printf("Logging to 'log.txt'. Press CTRL+C to quit.\n\n");
+	std::ofstream log("log.txt");
+	log << "Soak test: " << hours << " hours, seed " << seed << std::endl;
+
+	std::minstd_rand rng(seed);
+	std::uniform_int_distribution<int> pickQueue(0, QUEUE_TYPE_COUNT - 1);
+	std::uniform_int_distribution<int> pickMode(0, 2);
+	std::uniform_int_distribution<int> pickSize(0, 2);
+	std::uniform_int_distribution<int> pickInitialSize(1, 4096);
+	std::uniform_real_distribution<double> pickSeconds(0.2, 3.0);
+
+	std::int64_t start = nowNs();
+	std::int64_t end = start + (std::int64_t)(hours * 3600e9);
+	std::int64_t nextReport = start + (std::int64_t)(reportSeconds * 1e9);
+	std::size_t firstRss = 0;
+	double firstP99 = -1;
+	std::uint64_t totalErrors = 0;
+	Stats stats;
+	for (std::int64_t now = start; now < end; now = nowNs()) {
+		RoundConfig config;
+		config.queueType = pickQueue(rng);
+		config.elementSize = pickSize(rng);
+		config.producerMode = pickMode(rng);
+		config.consumerMode = pickMode(rng);
+		config.delays = (rng() & 1) != 0;
+		config.initialSize = (std::size_t)pickInitialSize(rng);
+		config.seconds = std::min(pickSeconds(rng), (double)(end - now) / 1e9);
+		log << "Round " << stats.rounds << ": " << queueNames[config.queueType] << ", " << (config.elementSize == 0 ? 24 : config.elementSize == 1 ? 64 : 256)
+			<< "-byte elements, producer mode " << config.producerMode << ", consumer mode " << config.consumerMode
+			<< (config.delays ? ", random delays" : "") << ", initial size " << config.initialSize << std::endl;
+
+		unsigned int roundSeed = (unsigned int)rng();
+		switch (config.elementSize) {
+		case 0: runRoundOfSize<24>(config, roundSeed, stats, log); break;
+		case 1: runRoundOfSize<64>(config, roundSeed, stats, log); break;
+		default: runRoundOfSize<256>(config, roundSeed, stats, log); break;
+		}
+
+		now = nowNs();
+		if (now >= nextReport || now >= end) {
+			std::size_t rss = residentKB();
+			// Only this interval's latencies, so that drift shows against the first interval's
+			double p50 = stats.latencies.percentile(50);
+			double p99 = stats.latencies.percentile(99);
+			double p999 = stats.latencies.percentile(99.9);
+			double max = stats.latencies.maxUs;
+			if (firstP99 < 0) {
+				firstRss = rss;
+				firstP99 = p99;
+			}
+			long long elapsed = (long long)((now - start) / 1000000000);
+			char line[512];
+			std::snprintf(line, sizeof(line),
+				"[%lld:%02lld:%02lld] rounds %llu, elements %llu, errors %llu | RSS %llu KB (%+lld KB since first report) | "
+				"block allocations %llu, peak capacity %llu | latency us p50 %.1f p99 %.1f (first interval: %.1f) p99.9 %.1f max %.1f",
+				elapsed / 3600, elapsed / 60 % 60, elapsed % 60,
+				(unsigned long long)stats.rounds, (unsigned long long)stats.elements, (unsigned long long)stats.errors,
+				(unsigned long long)rss, (long long)rss - (long long)firstRss,
+				(unsigned long long)stats.blockAllocations, (unsigned long long)stats.peakCapacity,
+				p50, p99, firstP99, p999, max);
+			std::printf("%s\n", line);
+			log << line << std::endl;
+
+			totalErrors += stats.errors;
+			stats = Stats();
+			nextReport = now + (std::int64_t)(reportSeconds * 1e9);
+		}
+	}
+
+	std::printf("\nSoak test finished: %llu error(s) detected.\n", (unsigned long long)totalErrors);
+	log << "Soak test finished: " << totalErrors << " error(s) detected." << std::endl;
+	return totalErrors == 0 ? 0 : 1;
+}
+
 int main(int argc, char** argv)
 {
 	// Disable buffering (so that when run in, e.g., Sublime Text, the output appears as it is written)
 	std::setvbuf(stdout, nullptr, _IONBF, 0);
 	
+	double soakHours = 0;
+	double reportSeconds = 60;
+	unsigned int seed = (unsigned int)std::time(nullptr);
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--soak") == 0 && i + 1 < argc) {
+			soakHours = std::atof(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+			reportSeconds = std::atof(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = (unsigned int)std::strtoul(argv[++i], nullptr, 10);
+		}
+		else {
+			std::printf("Usage: %s [--soak hours [--report seconds] [--seed n]]\n", argv[0]);
+			std::printf("  Without --soak, runs the ordering test forever.\n");
+			std::printf("  With --soak, runs randomized rounds (queue type, element size, blocking and\n");
+			std::printf("  non-blocking operations, random delays) for the given number of hours,\n");
+			std::printf("  reporting memory use, capacity and latency every 'report' seconds (default 60).\n");
+			return 1;
+		}
+	}
+	if (soakHours > 0) {
+		return runSoak(soakHours, reportSeconds, seed);
+	}
+	
 	std::printf("Running stability test for moodycamel::ReaderWriterQueue.\n");
 	std::printf("Logging to 'log.txt'. Press CTRL+C to quit.\n\n");
 	
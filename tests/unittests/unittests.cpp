@@ -6,6 +6,12 @@
 #include <cstring>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
 
 #include "minitest.h"
 #include "../common/simplethread.h"
@@ -93,6 +99,89 @@ private:
 };
 #endif
 
+// Keeps count of the bytes it has outstanding, and throws std::bad_alloc past `limit` of them
+template <typename T>
+struct CountingAllocator
+{
+    typedef T value_type;
+
+    explicit CountingAllocator(size_t *bytes_, size_t limit_ = static_cast<size_t>(-1)) : bytes(bytes_), limit(limit_) {}
+    template <typename U>
+    CountingAllocator(CountingAllocator<U> const &other) : bytes(other.bytes), limit(other.limit) {}
+
+    T *allocate(size_t n)
+    {
+        if (n * sizeof(T) > limit - *bytes)
+            throw std::bad_alloc();
+        *bytes += n * sizeof(T);
+        return static_cast<T *>(std::malloc(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        *bytes -= n * sizeof(T);
+        std::free(p);
+    }
+
+    size_t *bytes;
+    size_t limit;
+};
+
+template <typename T, typename U>
+bool operator==(CountingAllocator<T> const &a, CountingAllocator<U> const &b) { return a.bytes == b.bytes; }
+template <typename T, typename U>
+bool operator!=(CountingAllocator<T> const &a, CountingAllocator<U> const &b) { return a.bytes != b.bytes; }
+
+// Copying (or copy-assigning) it throws once budget() copies have been made; a negative
+// budget never runs out
+struct ThrowingCopy
+{
+    ThrowingCopy(int value_ = 0) : value(value_) {}
+    ThrowingCopy(ThrowingCopy const &other) : value(other.value) { spend(); }
+    ThrowingCopy &operator=(ThrowingCopy const &other)
+    {
+        spend();
+        value = other.value;
+        return *this;
+    }
+
+    static int &budget()
+    {
+        static int b = -1;
+        return b;
+    }
+
+    int value;
+
+private:
+    static void spend()
+    {
+        if (budget() == 0)
+            throw std::runtime_error("out of copies");
+        if (budget() > 0)
+            --budget();
+    }
+};
+
+// A message that's filled in field by field; counts how many are alive
+struct Message
+{
+    Message() { ++live(); }
+    Message(Message const &other) : id(other.id), size(other.size) { ++live(); }
+    Message &operator=(Message const &) = default;
+    ~Message() { --live(); }
+
+    static int &live()
+    {
+        static int n = 0;
+        return n;
+    }
+
+    int id;
+    size_t size;
+    char payload[240];
+};
+
 /// Extracted from private static method of ReaderWriterQueue
 static size_t ceilToPow2(size_t x)
 {
@@ -127,12 +216,28 @@ public:
         REGISTER_TEST(threaded);
         REGISTER_TEST(blocking);
         REGISTER_TEST(vector);
+        REGISTER_TEST(moved_from);
+        REGISTER_TEST(deferred_allocation);
 #if MOODYCAMEL_HAS_EMPLACE
         REGISTER_TEST(emplace);
         REGISTER_TEST(try_enqueue_fail_workaround);
         REGISTER_TEST(try_emplace_fail);
 #endif
         REGISTER_TEST(blocking_circular_buffer);
+        REGISTER_TEST(circular_buffer_sleep);
+        REGISTER_TEST(wait_outcome);
+        REGISTER_TEST(wake_hysteresis);
+        REGISTER_TEST(low_power_wait);
+        REGISTER_TEST(close);
+        REGISTER_TEST(queue_set);
+        REGISTER_TEST(growth_limit);
+        REGISTER_TEST(shrink);
+        REGISTER_TEST(block_cache);
+        REGISTER_TEST(prefault);
+        REGISTER_TEST(allocator);
+        REGISTER_TEST(bulk);
+        REGISTER_TEST(enqueue_with);
+        REGISTER_TEST(try_consume);
     }
 
     bool create_empty_queue()
@@ -738,6 +843,207 @@ public:
         return true;
     }
 
+    bool moved_from()
+    {
+        {
+            // A moved-from queue has no blocks, behaves as an empty queue, and allocates
+            // its blocks on the first enqueue (try_enqueue included)
+            ReaderWriterQueue<int> q(100);
+            q.enqueue(1);
+            ReaderWriterQueue<int> q2(std::move(q));
+
+            int item;
+            ASSERT_OR_FAIL(q.size_approx() == 0);
+            ASSERT_OR_FAIL(q.max_capacity() == 31);
+            ASSERT_OR_FAIL(q.peek() == nullptr);
+            ASSERT_OR_FAIL(!q.pop());
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+
+            ASSERT_OR_FAIL(q.try_enqueue(2));
+            ASSERT_OR_FAIL(q.max_capacity() == 31);
+            for (int i = 3; i != 40; ++i)
+                ASSERT_OR_FAIL(q.enqueue(i));
+            ASSERT_OR_FAIL(q.size_approx() == 38);
+            for (int i = 2; i != 40; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item));
+                ASSERT_OR_FAIL(item == i);
+            }
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+
+            ASSERT_OR_FAIL(q2.try_dequeue(item));
+            ASSERT_OR_FAIL(item == 1);
+
+            // Moving the moved-from queue around doesn't allocate either
+            ReaderWriterQueue<int> q3(std::move(q2));
+            ReaderWriterQueue<int> q4(std::move(q2));
+            q2 = std::move(q3);
+            ASSERT_OR_FAIL(q2.max_capacity() == 127);
+            ASSERT_OR_FAIL(q4.max_capacity() == 31);
+            ASSERT_OR_FAIL(q4.size_approx() == 0);
+        }
+
+        Foo::reset();
+        {
+            // Elements enqueued into a moved-from queue are destroyed with it, even if the
+            // consumer never looked at them
+            ReaderWriterQueue<Foo> q;
+            ReaderWriterQueue<Foo> q2(std::move(q));
+            for (int i = 0; i != 40; ++i)
+                q.enqueue(Foo());
+        }
+        ASSERT_OR_FAIL(Foo::destroy_count() == 40);
+        ASSERT_OR_FAIL(Foo::destroyed_in_order());
+
+        {
+            // The producer allocates the blocks while the consumer is already polling
+            weak_atomic<int> result;
+            result = 1;
+            ReaderWriterQueue<int> q(2000);
+            ReaderWriterQueue<int> q2(std::move(q));
+            SimpleThread reader([&]()
+                                {
+                                    int item;
+                                    for (int i = 0; i != 100000; ++i)
+                                    {
+                                        while (!q.try_dequeue(item))
+                                            continue;
+                                        if (item != i)
+                                            result = 0;
+                                    }
+                                });
+            SimpleThread writer([&]()
+                                {
+                                    for (int i = 0; i != 100000; ++i)
+                                        q.enqueue(i);
+                                });
+            writer.join();
+            reader.join();
+            ASSERT_OR_FAIL(result.load());
+        }
+
+        {
+            // Moving a circular buffer doesn't allocate semaphores for the moved-from one
+            BlockingReaderWriterCircularBuffer<int> q(4);
+            ASSERT_OR_FAIL(q.try_enqueue(1));
+            BlockingReaderWriterCircularBuffer<int> q2(std::move(q));
+            int item;
+            ASSERT_OR_FAIL(q.max_capacity() == 0);
+            ASSERT_OR_FAIL(q.size_approx() == 0);
+            ASSERT_OR_FAIL(!q.try_enqueue(2));
+            ASSERT_OR_FAIL(!q.wait_enqueue_timed(2, 100));
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+            ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 100));
+            q = std::move(q2);
+            ASSERT_OR_FAIL(q.try_dequeue(item));
+            ASSERT_OR_FAIL(item == 1);
+        }
+        return true;
+    }
+
+    bool deferred_allocation()
+    {
+        {
+            // Same capacity as an eagerly allocated queue, reserved on the first enqueue
+            for (size_t size : {size_t(0), size_t(1), size_t(15), size_t(100), size_t(1023), size_t(1024), size_t(5000)})
+            {
+                ReaderWriterQueue<int> eager(size);
+                ReaderWriterQueue<int> q(size, defer_allocation);
+                ASSERT_OR_FAIL(q.max_capacity() == eager.max_capacity());
+                ASSERT_OR_FAIL(q.size_approx() == 0);
+                ASSERT_OR_FAIL(q.peek() == nullptr);
+
+                int item;
+                ASSERT_OR_FAIL(!q.try_dequeue(item));
+                for (size_t i = 0; i != eager.max_capacity(); ++i)
+                    ASSERT_OR_FAIL(q.try_enqueue(static_cast<int>(i)));
+                ASSERT_OR_FAIL(!q.try_enqueue(-1));
+                ASSERT_OR_FAIL(q.max_capacity() == eager.max_capacity());
+                for (size_t i = 0; i != eager.max_capacity(); ++i)
+                {
+                    ASSERT_OR_FAIL(q.try_dequeue(item));
+                    ASSERT_OR_FAIL(item == static_cast<int>(i));
+                }
+                ASSERT_OR_FAIL(!q.try_dequeue(item));
+            }
+        }
+
+        {
+            // Never used
+            ReaderWriterQueue<Foo> q(100, defer_allocation);
+            BlockingReaderWriterQueue<Foo> bq(100, defer_allocation);
+        }
+
+        {
+            // The semaphore moves along with the elements
+            BlockingReaderWriterQueue<int> q(15, defer_allocation);
+            int item;
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+            q.enqueue(1);
+            q.enqueue(2);
+            BlockingReaderWriterQueue<int> q2(std::move(q));
+            ASSERT_OR_FAIL(q.size_approx() == 0);
+            ASSERT_OR_FAIL(q2.size_approx() == 2);
+            ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 0));
+            q.enqueue(3);
+            q2 = std::move(q);
+            ASSERT_OR_FAIL(q.size_approx() == 2);
+            ASSERT_OR_FAIL(q2.size_approx() == 1);
+            q2.wait_dequeue(item);
+            ASSERT_OR_FAIL(item == 3);
+            q.wait_dequeue(item);
+            ASSERT_OR_FAIL(item == 1);
+            ASSERT_OR_FAIL(q.try_dequeue(item));
+            ASSERT_OR_FAIL(item == 2);
+        }
+
+        weak_atomic<int> result;
+        result = 1;
+        {
+            // The consumer blocks before the producer has allocated anything
+            BlockingReaderWriterQueue<int> q(15, defer_allocation);
+            SimpleThread reader([&]()
+                                {
+                                    int item;
+                                    for (int i = 0; i != 100000; ++i)
+                                    {
+                                        if (!q.wait_dequeue(item) || item != i)
+                                            result = 0;
+                                    }
+                                });
+            SimpleThread writer([&]()
+                                {
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                                    for (int i = 0; i != 100000; ++i)
+                                        q.enqueue(i);
+                                });
+            writer.join();
+            reader.join();
+            ASSERT_OR_FAIL(q.size_approx() == 0);
+        }
+        ASSERT_OR_FAIL(result.load());
+
+        for (int round = 0; round != 100; ++round)
+        {
+            // The consumer asks for the capacity while the first enqueue reserves it
+            ReaderWriterQueue<int> q(100, defer_allocation);
+            size_t expected = q.max_capacity();
+            SimpleThread reader([&]()
+                                {
+                                    while (q.peek() == nullptr)
+                                    {
+                                        if (q.max_capacity() != expected)
+                                            result = 0;
+                                    }
+                                });
+            q.enqueue(1);
+            reader.join();
+            ASSERT_OR_FAIL(q.max_capacity() == expected);
+        }
+        ASSERT_OR_FAIL(result.load());
+        return true;
+    }
+
 #if MOODYCAMEL_HAS_EMPLACE
     bool emplace()
     {
@@ -830,6 +1136,15 @@ public:
             ASSERT_OR_FAIL(!q.wait_enqueue_timed(1, 0));
         }
 
+        {
+            // Heap allocated (plain new has to honour the buffer's alignment, with any language standard)
+            std::unique_ptr<BlockingReaderWriterCircularBuffer<int>> q(new BlockingReaderWriterCircularBuffer<int>(4));
+            ASSERT_OR_FAIL(reinterpret_cast<std::uintptr_t>(q.get()) % std::alignment_of<BlockingReaderWriterCircularBuffer<int>>::value == 0);
+            int item;
+            ASSERT_OR_FAIL(q->try_enqueue(1));
+            ASSERT_OR_FAIL(q->try_dequeue(item) && item == 1);
+        }
+
         // Element lifetimes
         Foo::reset();
         {
@@ -889,8 +1204,7 @@ public:
                                     int item;
                                     for (int i = 0; i != 1000000; ++i)
                                     {
-                                        q.wait_dequeue(item);
-                                        if (item != i)
+                                        if (!q.wait_dequeue(item) || item != i)
                                             result = 0;
                                     }
                                 });
@@ -909,6 +1223,1184 @@ public:
 
         return true;
     }
+
+    bool circular_buffer_sleep()
+    {
+        // Each side waits long enough that it has to go to sleep, and must be woken up
+        // by the other
+        weak_atomic<int> result;
+        result = 1;
+        {
+            BlockingReaderWriterCircularBuffer<int> q(2);
+            SimpleThread reader([&]()
+                                {
+                                    int item;
+                                    for (int i = 0; i != 20; ++i)
+                                    {
+                                        if (!q.wait_dequeue_timed(item, std::chrono::seconds(10)) || item != i)
+                                            result = 0;
+                                        if (i >= 10)
+                                            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                                    }
+                                });
+            SimpleThread writer([&]()
+                                {
+                                    for (int i = 0; i != 10; ++i)
+                                    {
+                                        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                                        q.wait_enqueue(i);
+                                    }
+                                    for (int i = 10; i != 20; ++i)
+                                        if (!q.wait_enqueue_timed(i, std::chrono::seconds(10)))
+                                            result = 0;
+                                });
+            writer.join();
+            reader.join();
+            ASSERT_OR_FAIL(q.size_approx() == 0);
+        }
+        ASSERT_OR_FAIL(result.load());
+
+        {
+            // Timing out while asleep leaves the buffer usable
+            BlockingReaderWriterCircularBuffer<int> q(1);
+            int item;
+            ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, 1000));
+            ASSERT_OR_FAIL(q.try_enqueue(1));
+            ASSERT_OR_FAIL(!q.wait_enqueue_timed(2, 1000));
+            ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 1000));
+            ASSERT_OR_FAIL(item == 1);
+            ASSERT_OR_FAIL(q.wait_enqueue_timed(2, 1000));
+            ASSERT_OR_FAIL(q.size_approx() == 1);
+        }
+        return true;
+    }
+
+    template <typename TQueue>
+    static bool check_wait_outcome(TQueue &q)
+    {
+        int item = 0;
+        ASSERT_OR_FAIL(q.try_enqueue(1));
+        moodycamel::wait_outcome outcome = q.wait_dequeue_outcome(item, 1000);
+        ASSERT_OR_FAIL(outcome.success && item == 1);
+        ASSERT_OR_FAIL(!outcome.spun && !outcome.slept && !outcome.woken_by_signal && !outcome.timed_out);
+        ASSERT_OR_FAIL(outcome.spins == 0 && outcome.wait_usecs == 0);
+
+        outcome = q.wait_dequeue_outcome(item, 0);
+        ASSERT_OR_FAIL(!outcome.success && outcome.timed_out);
+        ASSERT_OR_FAIL(!outcome.slept && outcome.spins == 1024);
+
+        outcome = q.wait_dequeue_outcome(item, std::chrono::milliseconds(2));
+        ASSERT_OR_FAIL(!outcome.success && outcome.timed_out);
+        ASSERT_OR_FAIL(outcome.slept && !outcome.woken_by_signal);
+        ASSERT_OR_FAIL(outcome.wait_usecs >= 1000);
+        ASSERT_OR_FAIL(item == 1);
+
+        SimpleThread writer([&]()
+                            {
+                                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                q.try_enqueue(2);
+                            });
+        outcome = q.wait_dequeue_outcome(item, -1);
+        writer.join();
+        ASSERT_OR_FAIL(outcome.success && !outcome.timed_out && item == 2);
+        ASSERT_OR_FAIL(outcome.slept && outcome.woken_by_signal && !outcome.spun);
+        ASSERT_OR_FAIL(outcome.spins == 1024 && outcome.wait_usecs >= 10000);
+        return true;
+    }
+
+    bool wait_outcome()
+    {
+        {
+            BlockingReaderWriterQueue<int> q;
+            ASSERT_OR_FAIL(check_wait_outcome(q));
+        }
+        {
+            BlockingReaderWriterCircularBuffer<int> q(4);
+            ASSERT_OR_FAIL(check_wait_outcome(q));
+        }
+        return true;
+    }
+
+    template <typename TQueue>
+    static bool check_wake_hysteresis(TQueue &q)
+    {
+        // Woken up by the third element, not before
+        q.set_wake_hysteresis(moodycamel::wake_hysteresis(3));
+        std::atomic<int> dequeued(0);
+        int item = 0;
+        SimpleThread reader([&]()
+                            {
+                                for (int i = 0; i != 3; ++i)
+                                {
+                                    q.wait_dequeue(item);
+                                    ++dequeued;
+                                }
+                            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        q.try_enqueue(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_OR_FAIL(dequeued.load() == 0);
+        q.try_enqueue(2);
+        q.try_enqueue(3);
+        reader.join();
+        ASSERT_OR_FAIL(dequeued.load() == 3 && item == 3);
+
+        // ... unless the producer says it's urgent
+        bool success = false;
+        reader = SimpleThread([&]()
+                              { success = q.wait_dequeue_timed(item, std::chrono::seconds(10)); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        q.try_enqueue(4);
+        q.wake_consumer();
+        reader.join();
+        ASSERT_OR_FAIL(success && item == 4);
+
+        // With a time limit, an element doesn't wait much longer than that even if the
+        // producer goes quiet
+        q.set_wake_hysteresis(moodycamel::wake_hysteresis(100, 20000));
+        reader = SimpleThread([&]()
+                              { success = q.wait_dequeue_timed(item, std::chrono::seconds(10)); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        q.try_enqueue(5);
+        reader.join();
+        ASSERT_OR_FAIL(success && item == 5);
+        ASSERT_OR_FAIL(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+        ASSERT_OR_FAIL(q.size_approx() == 0);
+        return true;
+    }
+
+    bool wake_hysteresis()
+    {
+        {
+            BlockingReaderWriterQueue<int> q;
+            ASSERT_OR_FAIL(check_wake_hysteresis(q));
+        }
+        {
+            BlockingReaderWriterCircularBuffer<int> q(8);
+            ASSERT_OR_FAIL(check_wake_hysteresis(q));
+        }
+        return true;
+    }
+
+    bool low_power_wait()
+    {
+        using moodycamel::spsc_sema::LowPowerWait;
+        ASSERT_OR_FAIL(!LowPowerWait::enabled());
+        // Can only be turned on where the CPU has WAITPKG; elsewhere this checks the fallback
+        ASSERT_OR_FAIL(LowPowerWait::enable(true) == LowPowerWait::supported());
+        ASSERT_OR_FAIL(LowPowerWait::enabled() == LowPowerWait::supported());
+
+        for (int pass = 0; pass != 2; ++pass)
+        {
+            BlockingReaderWriterQueue<int> q;
+            int item = -1;
+            moodycamel::wait_outcome outcome = q.wait_dequeue_outcome(item, 0);
+            ASSERT_OR_FAIL(!outcome.success && !outcome.slept && outcome.spins > 0);
+
+            bool inOrder = true;
+            SimpleThread reader([&]()
+                                {
+                                    for (int i = 0; i != 10000; ++i)
+                                    {
+                                        q.wait_dequeue(item);
+                                        inOrder = inOrder && item == i;
+                                    }
+                                });
+            for (int i = 0; i != 10000; ++i)
+            {
+                q.enqueue(i);
+                if (i % 1000 == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            reader.join();
+            ASSERT_OR_FAIL(inOrder && q.size_approx() == 0);
+
+            // Again with plain spinning
+            ASSERT_OR_FAIL(!LowPowerWait::enable(false));
+        }
+        ASSERT_OR_FAIL(!LowPowerWait::enabled());
+        return true;
+    }
+
+    template <typename TQueue>
+    static bool check_close(TQueue &q)
+    {
+        // A waiting consumer is woken up
+        bool result = true;
+        int item = 0;
+        SimpleThread reader([&]()
+                            { result = q.wait_dequeue(item); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_OR_FAIL(!q.is_closed());
+        q.close();
+        reader.join();
+        ASSERT_OR_FAIL(!result && item == 0);
+        ASSERT_OR_FAIL(q.is_closed());
+
+        // Dequeues keep failing, right away, and enqueues fail too
+        ASSERT_OR_FAIL(!q.wait_dequeue(item));
+        ASSERT_OR_FAIL(!q.wait_dequeue_timed(item, std::chrono::seconds(10)));
+        ASSERT_OR_FAIL(!q.try_dequeue(item));
+        moodycamel::wait_outcome outcome = q.wait_dequeue_outcome(item, -1);
+        ASSERT_OR_FAIL(!outcome.success && outcome.closed && !outcome.timed_out);
+        ASSERT_OR_FAIL(!q.try_enqueue(1));
+        ASSERT_OR_FAIL(q.size_approx() == 0 && item == 0);
+        q.close();
+        ASSERT_OR_FAIL(!q.wait_dequeue(item));
+        return true;
+    }
+
+    template <typename TQueue>
+    static bool check_close_drains(TQueue &q)
+    {
+        // Elements enqueued before close() are still dequeued
+        ASSERT_OR_FAIL(q.try_enqueue(1));
+        ASSERT_OR_FAIL(q.try_enqueue(2));
+        ASSERT_OR_FAIL(q.try_enqueue(3));
+        q.close();
+        ASSERT_OR_FAIL(!q.try_enqueue(4));
+        ASSERT_OR_FAIL(q.size_approx() == 3);
+        int item = 0;
+        ASSERT_OR_FAIL(q.wait_dequeue(item) && item == 1);
+        ASSERT_OR_FAIL(q.try_dequeue(item) && item == 2);
+        moodycamel::wait_outcome outcome = q.wait_dequeue_outcome(item, -1);
+        ASSERT_OR_FAIL(outcome.success && !outcome.closed && item == 3);
+        ASSERT_OR_FAIL(!q.wait_dequeue(item) && item == 3);
+        ASSERT_OR_FAIL(q.size_approx() == 0);
+        return true;
+    }
+
+    bool close()
+    {
+        {
+            BlockingReaderWriterQueue<int> q;
+            ASSERT_OR_FAIL(check_close(q));
+            ASSERT_OR_FAIL(!q.enqueue(1) && !q.emplace(1) && !q.pop());
+        }
+        {
+            BlockingReaderWriterQueue<int> q;
+            ASSERT_OR_FAIL(check_close_drains(q));
+        }
+        {
+            BlockingReaderWriterCircularBuffer<int> q(4);
+            ASSERT_OR_FAIL(check_close(q));
+            ASSERT_OR_FAIL(!q.wait_enqueue(1) && !q.wait_enqueue_timed(1, 0));
+        }
+        {
+            BlockingReaderWriterCircularBuffer<int> q(4);
+            ASSERT_OR_FAIL(check_close_drains(q));
+        }
+
+        // No sentinel needed for move-only elements
+        {
+            BlockingReaderWriterQueue<std::unique_ptr<int>> q;
+            int sum = 0;
+            SimpleThread reader([&]()
+                                {
+                                    std::unique_ptr<int> element;
+                                    while (q.wait_dequeue(element))
+                                        sum += *element;
+                                });
+            for (int i = 1; i <= 100; ++i)
+            {
+                q.enqueue(std::unique_ptr<int>(new int(i)));
+            }
+            q.close();
+            reader.join();
+            ASSERT_OR_FAIL(sum == 5050);
+        }
+
+        // A producer waiting for room is woken up too
+        {
+            BlockingReaderWriterCircularBuffer<int> q(1);
+            ASSERT_OR_FAIL(q.try_enqueue(1));
+            bool result = true;
+            SimpleThread writer([&]()
+                                { result = q.wait_enqueue(2); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            q.close();
+            writer.join();
+            ASSERT_OR_FAIL(!result && q.size_approx() == 1);
+            int item = 0;
+            ASSERT_OR_FAIL(q.wait_dequeue(item) && item == 1);
+            ASSERT_OR_FAIL(!q.wait_dequeue(item));
+        }
+        return true;
+    }
+
+    bool queue_set()
+    {
+        BlockingReaderWriterQueue<int> a;
+        BlockingReaderWriterCircularBuffer<double> b(4);
+        {
+            moodycamel::QueueSet set;
+            int ia = set.add(a);
+            int ib = set.add(b);
+            ASSERT_OR_FAIL(ia == 0 && ib == 1);
+            ASSERT_OR_FAIL(set.try_select() == -1);
+            ASSERT_OR_FAIL(set.select_timed(std::chrono::milliseconds(2)) == -1);
+
+            // Woken up by whichever queue gets an element
+            SimpleThread writer([&]()
+                                {
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                    b.try_enqueue(1.5);
+                                });
+            ASSERT_OR_FAIL(set.select() == ib);
+            writer.join();
+            double d = 0;
+            ASSERT_OR_FAIL(b.try_dequeue(d) && d == 1.5);
+
+            writer = SimpleThread([&]()
+                                  {
+                                      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                      a.enqueue(1);
+                                  });
+            ASSERT_OR_FAIL(set.select_timed(std::chrono::seconds(10)) == ia);
+            writer.join();
+            int i = 0;
+            ASSERT_OR_FAIL(a.try_dequeue(i) && i == 1);
+
+            // Ready queues take turns
+            a.enqueue(2);
+            a.enqueue(3);
+            b.try_enqueue(2.5);
+            b.try_enqueue(3.5);
+            ASSERT_OR_FAIL(set.select() == ib && b.try_dequeue(d) && d == 2.5);
+            ASSERT_OR_FAIL(set.select() == ia && a.try_dequeue(i) && i == 2);
+            ASSERT_OR_FAIL(set.select() == ib && b.try_dequeue(d) && d == 3.5);
+            ASSERT_OR_FAIL(set.select() == ia && a.try_dequeue(i) && i == 3);
+            ASSERT_OR_FAIL(set.try_select() == -1);
+
+            // Closing a queue wakes up the set, too
+            writer = SimpleThread([&]()
+                                  {
+                                      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                      a.close();
+                                  });
+            ASSERT_OR_FAIL(set.select() == ia);
+            writer.join();
+            ASSERT_OR_FAIL(!a.wait_dequeue(i) && a.is_closed());
+
+            // ... but only once it's drained, after which the set waits on the others again
+            ASSERT_OR_FAIL(set.try_select() == -1 && set.select_timed(std::chrono::milliseconds(2)) == -1);
+            ASSERT_OR_FAIL(b.try_enqueue(4.5) && set.select() == ib && b.try_dequeue(d) && d == 4.5);
+            ASSERT_OR_FAIL(set.select_timed(std::chrono::milliseconds(2)) == -1);
+
+            // A removed queue is no longer looked at, nor wakes the set up
+            BlockingReaderWriterQueue<int> c;
+            int ic = set.add(c);
+            ASSERT_OR_FAIL(ic == 2 && c.enqueue(5) && set.try_select() == ic);
+            set.remove(ic);
+            ASSERT_OR_FAIL(c.enqueue(6) && set.select_timed(std::chrono::milliseconds(2)) == -1);
+            ASSERT_OR_FAIL(b.try_enqueue(5.5) && set.select() == ib);
+        }
+
+        // The queues outlive the set
+        ASSERT_OR_FAIL(b.try_enqueue(6.5));
+        return true;
+    }
+
+    bool growth_limit()
+    {
+        {
+            // Grows with smaller blocks as it nears the limit, then fails
+            ReaderWriterQueue<int> q(15);
+            q.set_growth_limit(100);
+            int count = 0;
+            while (q.enqueue(count))
+                ++count;
+            ASSERT_OR_FAIL(count == 100 && q.max_capacity() == 100);
+            int item;
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(!q.enqueue(100) && q.max_capacity() == 100);
+        }
+        {
+            ReaderWriterQueue<int> q(15);
+            size_t bytes = q.allocated_bytes();
+            ASSERT_OR_FAIL(bytes >= 16 * sizeof(int));
+            q.set_growth_limit(static_cast<size_t>(-1), bytes);
+            for (int i = 0; i != 15; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(!q.enqueue(15) && q.allocated_bytes() == bytes);
+            q.set_growth_limit(static_cast<size_t>(-1));
+            ASSERT_OR_FAIL(q.enqueue(15) && q.allocated_bytes() > bytes);
+        }
+        {
+            // The blocking queue can wait for room instead
+            BlockingReaderWriterQueue<int> q(15);
+            q.set_growth_limit(15);
+            for (int i = 0; i != 15; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(!q.enqueue(15));
+            ASSERT_OR_FAIL(!q.wait_enqueue_timed(15, std::chrono::milliseconds(2)));
+            int item = -1;
+            SimpleThread reader([&]()
+                                {
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                    q.wait_dequeue(item);
+                                });
+            ASSERT_OR_FAIL(q.wait_enqueue(15));
+            reader.join();
+            ASSERT_OR_FAIL(item == 0 && q.size_approx() == 15);
+
+            SimpleThread closer([&]()
+                                {
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                    q.close();
+                                });
+            ASSERT_OR_FAIL(!q.wait_enqueue(16));
+            closer.join();
+            for (int i = 1; i != 16; ++i)
+            {
+                ASSERT_OR_FAIL(q.wait_dequeue(item) && item == i);
+            }
+            ASSERT_OR_FAIL(!q.wait_dequeue(item));
+        }
+        {
+            // ... and for room when it can't allocate a block, too: the producer retries until
+            // the consumer has left a block it can reuse
+            typedef CountingAllocator<char> Allocator;
+            size_t bytes = 0;
+            BlockingReaderWriterQueue<int, 16, Allocator> q(15, Allocator(&bytes, 4096));
+            int count = 0;
+            while (q.enqueue(count))
+                ++count;
+            ASSERT_OR_FAIL(count > 15 && !q.wait_enqueue_timed(count, std::chrono::milliseconds(2)));
+            SimpleThread reader([&]()
+                                {
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                                    int element;
+                                    for (int i = 0; i != 16; ++i)
+                                        q.wait_dequeue(element);
+                                });
+            auto start = std::chrono::steady_clock::now();
+            ASSERT_OR_FAIL(q.wait_enqueue_timed(count, std::chrono::seconds(10)));
+            ASSERT_OR_FAIL(std::chrono::steady_clock::now() - start < std::chrono::seconds(5)); // (not just rechecked at the timeout)
+            reader.join();
+            int item = -1;
+            for (int i = 16; i <= count; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+        }
+        return true;
+    }
+
+    bool shrink()
+    {
+        {
+            // After a burst, the empty blocks can be given back
+            ReaderWriterQueue<int, 16> q(15);
+            size_t bytes = q.allocated_bytes();
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(q.shrink_to(0) >= 1000 && q.size_approx() == 1000);
+            int item;
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            size_t capacity = q.max_capacity();
+            ASSERT_OR_FAIL(capacity >= 1000);
+            ASSERT_OR_FAIL(q.shrink_to(100) >= 100 && q.max_capacity() < capacity);
+            ASSERT_OR_FAIL(q.shrink_to(0) == 15 && q.allocated_bytes() == bytes && q.size_approx() == 0);
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(q.size_approx() == 100);
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            ASSERT_OR_FAIL(!q.try_dequeue(item));
+        }
+        {
+            // Requested by the consumer, carried out when the producer next fills up a block
+            ReaderWriterQueue<int, 16> q(15);
+            int item;
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            size_t capacity = q.max_capacity();
+            q.request_shrink(0);
+            ASSERT_OR_FAIL(q.max_capacity() == capacity);
+            for (int i = 0; i != 16; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(q.max_capacity() == 30 && q.size_approx() == 16);
+            for (int i = 0; i != 16; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+        }
+        {
+            // Bursts, with both threads asking for the memory back as they go
+            BlockingReaderWriterQueue<int, 16> q(15);
+            const int count = 200000;
+            bool ok = true;
+            SimpleThread reader([&]()
+                                {
+                                    int item;
+                                    for (int i = 0; i != count; ++i)
+                                    {
+                                        ok = q.wait_dequeue(item) && ok && item == i && q.size_approx() <= static_cast<size_t>(count) && q.max_capacity() >= 15;
+                                        if ((i & 511) == 0)
+                                        {
+                                            q.request_shrink(static_cast<size_t>(i & 4095));
+                                        }
+                                    }
+                                });
+            for (int i = 0; i != count; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+                if ((i & 8191) == 0)
+                {
+                    q.shrink_to(64);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            reader.join();
+            ASSERT_OR_FAIL(ok && q.size_approx() == 0);
+            ASSERT_OR_FAIL(q.shrink_to(0) == 15);
+        }
+        return true;
+    }
+
+    bool block_cache()
+    {
+#if MOODYCAMEL_HAS_BLOCK_CACHE
+        ASSERT_OR_FAIL(BlockCache::limit() == 0);
+        {
+            // Off: nothing is kept
+            ReaderWriterQueue<int, 16> q(1000);
+        }
+        ASSERT_OR_FAIL(BlockCache::cached_bytes() == 0);
+
+        BlockCache::set_limit(1 << 20);
+        {
+            // The blocks a queue frees are reused by the next one that grows
+            ReaderWriterQueue<int, 16> q(15);
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            int item;
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            q.shrink_to(0);
+        }
+        size_t cached = BlockCache::cached_bytes();
+        ASSERT_OR_FAIL(cached > 0 && cached <= 1 << 20);
+        {
+            ReaderWriterQueue<int, 16> q(15);
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(BlockCache::cached_bytes() < cached);
+            int item;
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+        }
+        ASSERT_OR_FAIL(BlockCache::cached_bytes() == cached);
+
+        {
+            // Shared between threads
+            std::atomic<bool> ok(true);
+            SimpleThread threads[4];
+            for (int t = 0; t != 4; ++t)
+            {
+                threads[t] = SimpleThread([&](int seed)
+                                          {
+                                              for (int round = 0; round != 100; ++round)
+                                              {
+                                                  ReaderWriterQueue<int, 16> q(15);
+                                                  int item;
+                                                  for (int i = 0; i != 200 + seed; ++i)
+                                                      q.enqueue(i);
+                                                  for (int i = 0; i != 200 + seed; ++i)
+                                                  {
+                                                      if (!q.try_dequeue(item) || item != i)
+                                                          ok = false;
+                                                  }
+                                              }
+                                          },
+                                          t);
+            }
+            for (int t = 0; t != 4; ++t)
+            {
+                threads[t].join();
+            }
+            ASSERT_OR_FAIL(ok);
+        }
+
+        {
+            // Other threads hand back the blocks they keep at hand after set_limit
+            std::atomic<int> step(0);
+            SimpleThread thread([&]()
+                                {
+                                    {
+                                        ReaderWriterQueue<int, 16> q(15);
+                                        for (int i = 0; i != 200; ++i)
+                                            q.enqueue(i);
+                                    }
+                                    step = 1;
+                                    while (step != 2)
+                                        std::this_thread::yield();
+                                    {
+                                        ReaderWriterQueue<int, 16> q(15);
+                                    }
+                                    step = 3;
+                                    while (step != 4)
+                                        std::this_thread::yield();
+                                });
+            while (step != 1)
+                std::this_thread::yield();
+            BlockCache::set_limit(1 << 20);
+            size_t before = BlockCache::cached_bytes();
+            step = 2;
+            while (step != 3)
+                std::this_thread::yield();
+            size_t after = BlockCache::cached_bytes(); // (before the thread exits, which hands them back anyway)
+            step = 4;
+            thread.join();
+            ASSERT_OR_FAIL(after > before);
+        }
+
+        // Too small to hold any more
+        BlockCache::set_limit(1);
+        ASSERT_OR_FAIL(BlockCache::cached_bytes() == 0);
+        {
+            ReaderWriterQueue<int, 16> q(1000);
+        }
+        ASSERT_OR_FAIL(BlockCache::cached_bytes() == 0);
+        BlockCache::set_limit(0);
+        ASSERT_OR_FAIL(BlockCache::limit() == 0);
+#endif
+        return true;
+    }
+
+    template <typename TQueue>
+    bool check_prefault(TQueue &q)
+    {
+        // Works like any other queue
+        int enqueued = 0, dequeued = 0, item;
+        for (int i = 0; i != 5000; ++i)
+        {
+            if (q.try_enqueue(enqueued))
+                ++enqueued;
+            if (i % 3 == 0)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == dequeued++);
+            }
+        }
+        while (q.try_dequeue(item))
+        {
+            ASSERT_OR_FAIL(item == dequeued++);
+        }
+        ASSERT_OR_FAIL(dequeued == enqueued && enqueued >= 1000 && q.size_approx() == 0);
+        return true;
+    }
+
+#if defined(__linux__)
+    // The memory this process has locked into RAM, in kB (VmLck)
+    static long locked_kb()
+    {
+        FILE *status = std::fopen("/proc/self/status", "r");
+        if (status == nullptr)
+            return -1;
+        char line[256];
+        long kb = -1;
+        while (std::fgets(line, sizeof(line), status) != nullptr)
+        {
+            if (std::sscanf(line, "VmLck: %ld", &kb) == 1)
+                break;
+        }
+        std::fclose(status);
+        return kb;
+    }
+#endif
+
+    bool prefault()
+    {
+        {
+            ReaderWriterQueue<int> q(10000, moodycamel::prefault);
+            ASSERT_OR_FAIL(!q.memory_locked() && q.max_capacity() >= 10000);
+            ASSERT_OR_FAIL(check_prefault(q));
+        }
+        {
+            // Locking may be refused (e.g. past RLIMIT_MEMLOCK); the queue works either way
+            ReaderWriterQueue<int, 16> q(100, moodycamel::prefault_and_lock);
+            ASSERT_OR_FAIL(check_prefault(q));
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            q.shrink_to(0);
+        }
+#if defined(__linux__)
+        {
+            // Shrinking a locked queue leaves the blocks it keeps locked, although they share
+            // pages with the ones it frees (none of which has a page to itself)
+            ReaderWriterQueue<int, 16> q(500, moodycamel::prefault_and_lock);
+            long before = locked_kb();
+            if (q.memory_locked() && before > 0)
+            {
+                q.shrink_to(15);
+                ASSERT_OR_FAIL(q.max_capacity() < 500 && q.memory_locked());
+                ASSERT_OR_FAIL(locked_kb() == before);
+                ASSERT_OR_FAIL(check_prefault(q));
+            }
+        }
+#endif
+        {
+            BlockingReaderWriterQueue<int> q(100, moodycamel::prefault_and_lock);
+            ASSERT_OR_FAIL(check_prefault(q));
+        }
+        {
+            BlockingReaderWriterCircularBuffer<int> q(1000, moodycamel::prefault_and_lock);
+            ASSERT_OR_FAIL(q.max_capacity() == 1000);
+            ASSERT_OR_FAIL(check_prefault(q));
+            BlockingReaderWriterCircularBuffer<int> moved(std::move(q));
+            ASSERT_OR_FAIL(!q.memory_locked() && check_prefault(moved));
+        }
+        return true;
+    }
+
+    bool allocator()
+    {
+        typedef CountingAllocator<char> Allocator;
+        size_t bytes = 0;
+        {
+            ReaderWriterQueue<int, 16, Allocator> q(15, Allocator(&bytes));
+            ASSERT_OR_FAIL(bytes != 0 && bytes == q.allocated_bytes() && q.get_allocator() == Allocator(&bytes));
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue(i));
+            }
+            ASSERT_OR_FAIL(bytes == q.allocated_bytes());
+            int item;
+            for (int i = 0; i != 1000; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_dequeue(item) && item == i);
+            }
+            q.shrink_to(0);
+            ASSERT_OR_FAIL(bytes == q.allocated_bytes());
+
+            // The moved-to queue frees the blocks with the same allocator
+            ReaderWriterQueue<int, 16, Allocator> moved(std::move(q));
+            ASSERT_OR_FAIL(moved.enqueue(1) && q.enqueue(2) && bytes == moved.allocated_bytes() + q.allocated_bytes());
+            q = std::move(moved);
+        }
+        ASSERT_OR_FAIL(bytes == 0);
+        {
+            // Like a failed malloc, an allocator that throws makes enqueue fail
+            ReaderWriterQueue<int, 16, Allocator> q(15, Allocator(&bytes, 2048));
+            int count = 0;
+            while (q.enqueue(count))
+                ++count;
+            ASSERT_OR_FAIL(count >= 15 && bytes <= 2048 && bytes == q.allocated_bytes());
+        }
+        ASSERT_OR_FAIL(bytes == 0);
+        {
+            BlockingReaderWriterQueue<int, 512, Allocator> q(100, moodycamel::prefault, Allocator(&bytes));
+            ASSERT_OR_FAIL(bytes != 0 && q.enqueue(1));
+            BlockingReaderWriterCircularBuffer<int, Allocator> b(100, Allocator(&bytes));
+            ASSERT_OR_FAIL(b.try_enqueue(2) && b.get_allocator() == q.get_allocator());
+            int item;
+            ASSERT_OR_FAIL(q.wait_dequeue_timed(item, 0) && item == 1 && b.wait_dequeue_timed(item, 0) && item == 2);
+        }
+        ASSERT_OR_FAIL(bytes == 0);
+#if MOODYCAMEL_HAS_PMR
+        {
+            char buffer[1 << 14];
+            std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+            moodycamel::pmr::ReaderWriterQueue<int> q(100, &arena);
+            moodycamel::pmr::BlockingReaderWriterCircularBuffer<int> b(100, &arena);
+            int count = 0;
+            while (q.enqueue(count))
+                ++count;
+            ASSERT_OR_FAIL(count >= 100 && q.get_allocator().resource() == &arena);
+        }
+#endif
+        return true;
+    }
+
+    bool bulk()
+    {
+        int values[100];
+        for (int i = 0; i != 100; ++i)
+        {
+            values[i] = i;
+        }
+        {
+            ReaderWriterQueue<int, 16> q(15);
+            size_t n = q.try_enqueue_bulk(values, 100);
+            ASSERT_OR_FAIL(n >= 15 && n < 100 && q.size_approx() == n);
+            ASSERT_OR_FAIL(q.enqueue_bulk(values + n, 100 - n) == 100 - n && q.size_approx() == 100);
+
+            int out[30];
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(out, 30) == 30);
+            std::vector<int> rest;
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(std::back_inserter(rest), 1000) == 70 && rest.size() == 70);
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL((i < 30 ? out[i] : rest[static_cast<size_t>(i - 30)]) == i);
+            }
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(out, 30) == 0 && q.try_enqueue_bulk(values, 0) == 0);
+
+            // Runs that wrap around the end of the blocks
+            for (int round = 0; round != 50; ++round)
+            {
+                ASSERT_OR_FAIL(q.try_enqueue_bulk(values + round, 7) == 7);
+                ASSERT_OR_FAIL(q.try_dequeue_bulk(out, 30) == 7);
+                for (int i = 0; i != 7; ++i)
+                {
+                    ASSERT_OR_FAIL(out[i] == round + i);
+                }
+            }
+        }
+        {
+            // Moving from a range of move-only elements
+            std::vector<std::unique_ptr<int>> items;
+            for (int i = 0; i != 40; ++i)
+            {
+                items.push_back(std::unique_ptr<int>(new int(i)));
+            }
+            ReaderWriterQueue<std::unique_ptr<int>, 16> q(15);
+            ASSERT_OR_FAIL(q.enqueue_bulk(std::make_move_iterator(items.begin()), items.size()) == 40);
+            ASSERT_OR_FAIL(items[0] == nullptr && items[39] == nullptr);
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(items.begin(), 40) == 40);
+            for (int i = 0; i != 40; ++i)
+            {
+                ASSERT_OR_FAIL(*items[static_cast<size_t>(i)] == i);
+            }
+        }
+        {
+            // A throwing copy leaves a prefix of the range in the queue
+            ThrowingCopy src[40];
+            for (int i = 0; i != 40; ++i)
+            {
+                src[i].value = i;
+            }
+            ReaderWriterQueue<ThrowingCopy, 16> q(15);
+            size_t bytes = q.allocated_bytes();
+            bool threw = false;
+            ThrowingCopy::budget() = 15; // Runs out while making a new block
+            try
+            {
+                q.enqueue_bulk(src, 40);
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            ASSERT_OR_FAIL(threw && q.size_approx() == 15 && q.allocated_bytes() == bytes);
+
+            threw = false;
+            ThrowingCopy::budget() = 5; // Runs out within a block
+            try
+            {
+                q.enqueue_bulk(src + 15, 25);
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            ASSERT_OR_FAIL(threw && q.size_approx() == 20);
+            ThrowingCopy::budget() = -1;
+            ASSERT_OR_FAIL(q.enqueue_bulk(src + 20, 20) == 20 && q.size_approx() == 40);
+
+            // A throwing assignment leaves the element being assigned at the front
+            ThrowingCopy out[40];
+            threw = false;
+            ThrowingCopy::budget() = 5;
+            try
+            {
+                q.try_dequeue_bulk(out, 40);
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            ASSERT_OR_FAIL(threw && q.size_approx() == 35);
+            ThrowingCopy::budget() = -1;
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(out + 5, 40) == 35 && q.size_approx() == 0);
+            for (int i = 0; i != 40; ++i)
+            {
+                ASSERT_OR_FAIL(out[i].value == i);
+            }
+        }
+        {
+            BlockingReaderWriterQueue<int, 16> q(15);
+            ASSERT_OR_FAIL(q.enqueue_bulk(values, 100) == 100 && q.size_approx() == 100);
+            int out[100];
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(out, 40) == 40 && q.wait_dequeue_bulk(out + 40, 100, 0) == 60);
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(out[i] == i);
+            }
+            ASSERT_OR_FAIL(q.try_dequeue_bulk(out, 10) == 0 && q.wait_dequeue_bulk(out, 10, 0) == 0);
+
+            // Closing: what's left is still dequeued, then the bulk waits return 0
+            ASSERT_OR_FAIL(q.try_enqueue_bulk(values, 3) == 3);
+            q.close();
+            ASSERT_OR_FAIL(q.try_enqueue_bulk(values, 3) == 0 && q.enqueue_bulk(values, 3) == 0);
+            ASSERT_OR_FAIL(q.wait_dequeue_bulk(out, 10) == 3 && q.wait_dequeue_bulk(out, 10) == 0 && q.try_dequeue_bulk(out, 10) == 0);
+        }
+        {
+            BlockingReaderWriterQueue<int, 16> q(15);
+            const int COUNT = 100000;
+            bool ordered = true;
+            SimpleThread reader([&]()
+                                {
+                                    int out[64];
+                                    int expected = 0;
+                                    while (expected != COUNT)
+                                    {
+                                        size_t n = q.wait_dequeue_bulk(out, 64);
+                                        for (size_t i = 0; i != n; ++i)
+                                        {
+                                            ordered = ordered && out[i] == expected++;
+                                        }
+                                    }
+                                });
+            std::vector<int> chunk(37);
+            for (int i = 0; i < COUNT; i += 37)
+            {
+                int n = std::min(37, COUNT - i);
+                for (int j = 0; j != n; ++j)
+                {
+                    chunk[static_cast<size_t>(j)] = i + j;
+                }
+                q.enqueue_bulk(chunk.begin(), static_cast<size_t>(n));
+            }
+            reader.join();
+            ASSERT_OR_FAIL(ordered && q.size_approx() == 0);
+        }
+        return true;
+    }
+
+    template <typename TQueue>
+    bool check_enqueue_with(TQueue &q, int count)
+    {
+        for (int i = 0; i != count; ++i)
+        {
+            ASSERT_OR_FAIL(q.try_enqueue_with([i](Message &m)
+                                              {
+                                                  m.id = i;
+                                                  m.size = static_cast<size_t>(i) * 2;
+                                                  m.payload[0] = 'x';
+                                              }));
+        }
+        ASSERT_OR_FAIL(Message::live() == count);
+        Message m;
+        for (int i = 0; i != count; ++i)
+        {
+            ASSERT_OR_FAIL(q.try_dequeue(m) && m.id == i && m.size == static_cast<size_t>(i) * 2 && m.payload[0] == 'x');
+        }
+        ASSERT_OR_FAIL(!q.try_dequeue(m) && Message::live() == 1);
+        return true;
+    }
+
+    bool enqueue_with()
+    {
+        Message::live() = 0;
+        {
+            ReaderWriterQueue<Message, 16> q(15);
+            ASSERT_OR_FAIL(check_enqueue_with(q, 15));
+            ASSERT_OR_FAIL(check_enqueue_with(q, 15));
+
+            // enqueue_with grows the queue like enqueue
+            auto fill = [](Message &m)
+            { m.id = 7; };
+            int count = 0;
+            while (q.try_enqueue_with(fill))
+                ++count;
+            ASSERT_OR_FAIL(count < 100);
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue_with(fill));
+            }
+            ASSERT_OR_FAIL(q.size_approx() == static_cast<size_t>(count) + 100 && Message::live() == count + 100);
+
+            // A fill that throws enqueues nothing
+            bool threw = false;
+            try
+            {
+                q.enqueue_with([](Message &)
+                               { throw std::runtime_error("parse error"); });
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            ASSERT_OR_FAIL(threw && q.size_approx() == static_cast<size_t>(count) + 100 && Message::live() == count + 100);
+            Message m;
+            while (q.try_dequeue(m))
+                ASSERT_OR_FAIL(m.id == 7);
+        }
+        ASSERT_OR_FAIL(Message::live() == 0);
+        {
+            BlockingReaderWriterQueue<Message, 16> q(15);
+            ASSERT_OR_FAIL(check_enqueue_with(q, 15));
+            ASSERT_OR_FAIL(q.enqueue_with([](Message &m)
+                                          { m.id = 42; }));
+            Message m;
+            ASSERT_OR_FAIL(q.wait_dequeue_timed(m, 0) && m.id == 42);
+            q.close();
+            ASSERT_OR_FAIL(!q.try_enqueue_with([](Message &) {}) && !q.enqueue_with([](Message &) {}));
+        }
+        ASSERT_OR_FAIL(Message::live() == 0);
+        {
+            BlockingReaderWriterCircularBuffer<Message> q(15);
+            ASSERT_OR_FAIL(check_enqueue_with(q, 15));
+            ASSERT_OR_FAIL(check_enqueue_with(q, 15));
+            ASSERT_OR_FAIL(q.wait_enqueue_with([](Message &m)
+                                               { m.id = 42; }));
+            Message m;
+            ASSERT_OR_FAIL(q.wait_dequeue_timed(m, 0) && m.id == 42);
+
+            // A fill that throws enqueues nothing, and doesn't leave its element behind
+            bool threw = false;
+            try
+            {
+                q.wait_enqueue_with([](Message &)
+                                    { throw std::runtime_error("parse error"); });
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            ASSERT_OR_FAIL(threw && q.size_approx() == 0 && Message::live() == 1);
+            q.close();
+            ASSERT_OR_FAIL(!q.try_enqueue_with([](Message &) {}) && !q.wait_enqueue_with([](Message &) {}));
+        }
+        ASSERT_OR_FAIL(Message::live() == 0);
+        return true;
+    }
+
+    template <typename TQueue>
+    bool check_try_consume(TQueue &q, int count)
+    {
+        for (int i = 0; i != count; ++i)
+        {
+            ASSERT_OR_FAIL(q.try_enqueue_with([i](Message &m)
+                                              { m.id = i; }));
+        }
+        for (int i = 0; i != count; ++i)
+        {
+            int id = -1;
+            ASSERT_OR_FAIL(q.try_consume([&](Message &m)
+                                         { id = m.id; }) &&
+                           id == i);
+            ASSERT_OR_FAIL(Message::live() == count - i - 1);
+        }
+        ASSERT_OR_FAIL(!q.try_consume([](Message &) {}));
+        return true;
+    }
+
+    bool try_consume()
+    {
+        Message::live() = 0;
+        {
+            ReaderWriterQueue<Message, 16> q(15);
+            ASSERT_OR_FAIL(check_try_consume(q, 15));
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.enqueue_with([i](Message &m)
+                                              { m.id = i; }));
+            }
+            for (int i = 0; i != 100; ++i)
+            {
+                ASSERT_OR_FAIL(q.try_consume([i](Message const &m)
+                                             { if (m.id != i) throw std::logic_error("out of order"); }));
+            }
+
+            // If f throws, the element stays at the front
+            ASSERT_OR_FAIL(q.enqueue_with([](Message &m)
+                                          { m.id = 1; }));
+            bool threw = false;
+            try
+            {
+                q.try_consume([](Message &)
+                              { throw std::runtime_error("busy"); });
+            }
+            catch (std::runtime_error const &)
+            {
+                threw = true;
+            }
+            int id = -1;
+            ASSERT_OR_FAIL(threw && q.try_consume([&](Message &m)
+                                                  { id = m.id; }) &&
+                           id == 1);
+            ASSERT_OR_FAIL(Message::live() == 0);
+        }
+        {
+            BlockingReaderWriterQueue<Message, 16> q(15);
+            ASSERT_OR_FAIL(check_try_consume(q, 15));
+            int sum = 0;
+            SimpleThread reader([&]()
+                                {
+                                    while (q.wait_consume([&](Message &m)
+                                                          { sum += m.id; }))
+                                        continue;
+                                });
+            for (int i = 1; i <= 100; ++i)
+            {
+                q.enqueue_with([i](Message &m)
+                               { m.id = i; });
+            }
+            q.close();
+            reader.join();
+            ASSERT_OR_FAIL(sum == 5050 && !q.wait_consume_timed([](Message &) {}, 0));
+        }
+        ASSERT_OR_FAIL(Message::live() == 0);
+        {
+            BlockingReaderWriterCircularBuffer<Message> q(15);
+            ASSERT_OR_FAIL(check_try_consume(q, 15));
+            ASSERT_OR_FAIL(check_try_consume(q, 15));
+            ASSERT_OR_FAIL(!q.wait_consume_timed([](Message &) {}, 0));
+            ASSERT_OR_FAIL(q.try_enqueue_with([](Message &m)
+                                              { m.id = 3; }));
+            q.close();
+            int id = -1;
+            ASSERT_OR_FAIL(q.wait_consume([&](Message &m)
+                                          { id = m.id; }) &&
+                           id == 3 && !q.wait_consume([](Message &) {}));
+        }
+        ASSERT_OR_FAIL(Message::live() == 0);
+        return true;
+    }
 };
 
 void printTests(ReaderWriterQueueTests const &tests)